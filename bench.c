@@ -0,0 +1,612 @@
+/*
+bench: standard workloads against the engine in main.c, which is compiled
+into this program with its main() left out. Every workload prints one
+JSON line with throughput and latency percentiles, so runs can be diffed
+or collected by a script.
+
+    make bench && ./bench --rows 100000 --cache-pages 1024
+*/
+#ifndef SIMPLE_SQLITE_NO_MAIN
+#define SIMPLE_SQLITE_NO_MAIN
+#endif
+#include "main.c"
+
+#define BENCH_DEFAULT_ROWS 100000
+#define BENCH_DEFAULT_SCANS 5
+#define BENCH_DEFAULT_READ_PERCENT 90
+#define BENCH_DEFAULT_READERS 4
+#define BENCH_SNAPSHOT_CACHE_PAGES 256
+#define BENCH_SNAPSHOT_REFRESH 10000 // 读线程每做这么多次点查换一个新快照
+
+typedef struct
+{
+    uint32_t rows;
+    uint32_t batch;        // 每多少个 insert 包在一个 begin/commit 里, 1 表示每条自动提交
+    uint32_t scans;
+    uint32_t read_percent; // mixed 负载里读的比例
+    uint32_t readers;      // snapshot 负载的读线程数
+    uint64_t seed;
+    SyncMode sync_mode;
+    const char *path;
+    const char *workloads;
+    DbOptions db_options;
+} BenchOptions;
+
+uint64_t bench_random(uint64_t *state)
+{
+    // xorshift64*, 每次运行结果一样, 便于对比
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dull;
+}
+
+int compare_latencies(const void *a, const void *b)
+{
+    uint64_t left = *(const uint64_t *)a;
+    uint64_t right = *(const uint64_t *)b;
+    return (left > right) - (left < right);
+}
+
+double latency_percentile_us(uint64_t *sorted, uint64_t count, double percentile)
+{
+    return sorted[percentile_rank(count, percentile)] / 1000.0;
+}
+
+void bench_report(BenchOptions *options, const char *workload, uint64_t *latencies, uint64_t ops,
+                  uint64_t elapsed_ns)
+{
+    if (ops == 0)
+    {
+        return;
+    }
+    qsort(latencies, ops, sizeof(uint64_t), compare_latencies);
+    double seconds = elapsed_ns / 1e9;
+    printf("{\"workload\":\"%s\",\"rows\":%u,\"page_size\":%u,\"cache_pages\":%u,\"prefetch\":%u,\"compress\":%s,\"mmap\":%s,\"wal\":%s,\"batch\":%u,"
+           "\"ops\":%llu,\"seconds\":%.6f,\"ops_per_sec\":%.1f,"
+           "\"p50_us\":%.3f,\"p99_us\":%.3f,\"p999_us\":%.3f}\n",
+           workload, options->rows, PAGE_SIZE, options->db_options.cache_pages, options->db_options.prefetch_pages,
+           options->db_options.compress ? "true" : "false", options->db_options.use_mmap ? "true" : "false", options->db_options.use_wal ? "true" : "false",
+           options->batch, (unsigned long long)ops, seconds, ops / seconds,
+           latency_percentile_us(latencies, ops, 0.50), latency_percentile_us(latencies, ops, 0.99),
+           latency_percentile_us(latencies, ops, 0.999));
+    fflush(stdout);
+}
+
+Table *bench_open(BenchOptions *options, bool fresh)
+{
+    if (fresh)
+    {
+        char wal_path[PATH_MAX];
+        snprintf(wal_path, sizeof(wal_path), "%s-wal", options->path);
+        unlink(options->path);
+        unlink(wal_path);
+    }
+    Table *table = db_open(options->path, &options->db_options);
+    table->pager->sync_mode = options->sync_mode;
+    return table;
+}
+
+// 一条带参数的 insert, 用 prepare/bind/step 执行, 和应用程序的用法一样
+ExecuteResult bench_insert_one(Table *table, Statement *insert, uint32_t id)
+{
+    char username[COLUMN_USERNAME_SIZE + 1];
+    char email[COLUMN_EMAIL_SIZE + 1];
+    int username_length = snprintf(username, sizeof(username), "user%u", id);
+    int email_length = snprintf(email, sizeof(email), "user%u@example.com", id);
+    db_bind_uint32(insert, 0, id);
+    db_bind_text(insert, 1, username, username_length);
+    db_bind_text(insert, 2, email, email_length);
+    return db_step(insert, table);
+}
+
+void bench_run_statement(Table *table, const char *sql)
+{
+    Statement statement;
+    prepare_statement(sql, &statement);
+    db_step(&statement, table);
+    statement_free(&statement);
+}
+
+void bench_insert(BenchOptions *options, Table *table, const char *workload, uint32_t *ids)
+{
+    Statement insert;
+    db_prepare("insert ? ? ?", &insert);
+    uint64_t *latencies = malloc(sizeof(uint64_t) * options->rows);
+    uint64_t started = monotonic_ns();
+    for (uint32_t i = 0; i < options->rows; i++)
+    {
+        uint64_t op_started = monotonic_ns();
+        if (options->batch > 1 && i % options->batch == 0)
+        {
+            bench_run_statement(table, "begin");
+        }
+        bench_insert_one(table, &insert, ids[i]);
+        if (options->batch > 1 && (i % options->batch == options->batch - 1 || i + 1 == options->rows))
+        {
+            bench_run_statement(table, "commit");
+        }
+        latencies[i] = monotonic_ns() - op_started;
+    }
+    bench_report(options, workload, latencies, options->rows, monotonic_ns() - started);
+    free(latencies);
+    db_finalize(&insert);
+}
+
+// 按 id 点查: table_find 定位后读出 value
+bool bench_find_one(Table *table, uint32_t id)
+{
+    Cursor *cursor = table_find(table, id);
+    void *node = get_page(table->pager, cursor->page_num);
+    bool found = cursor->cell_num < *leaf_node_num_cells(node) && *leaf_node_key(node, cursor->cell_num) == id;
+    if (found)
+    {
+        Row row;
+        deserialize_row(cursor_value(cursor), &row);
+    }
+    unpin_page(table->pager, cursor->page_num);
+    cursor_close(cursor);
+    return found;
+}
+
+void bench_find(BenchOptions *options, Table *table, uint32_t *ids)
+{
+    uint64_t *latencies = malloc(sizeof(uint64_t) * options->rows);
+    uint64_t state = options->seed;
+    uint32_t missing = 0;
+    uint64_t started = monotonic_ns();
+    for (uint32_t i = 0; i < options->rows; i++)
+    {
+        uint32_t id = ids[bench_random(&state) % options->rows];
+        uint64_t op_started = monotonic_ns();
+        missing += !bench_find_one(table, id);
+        latencies[i] = monotonic_ns() - op_started;
+    }
+    bench_report(options, "find", latencies, options->rows, monotonic_ns() - started);
+    if (missing > 0)
+    {
+        fprintf(stderr, "find: %u ids were missing\n", missing);
+    }
+    free(latencies);
+}
+
+// 全表 select, 结果照常格式化, 写到 /dev/null
+void bench_scan(BenchOptions *options, Table *table)
+{
+    int null_fd = open("/dev/null", O_WRONLY);
+    ResultWriter saved = table->output;
+    result_writer_init(&table->output, null_fd, OUTPUT_TUPLE);
+    uint64_t *latencies = malloc(sizeof(uint64_t) * options->scans);
+    uint64_t started = monotonic_ns();
+    for (uint32_t i = 0; i < options->scans; i++)
+    {
+        uint64_t op_started = monotonic_ns();
+        bench_run_statement(table, "select");
+        latencies[i] = monotonic_ns() - op_started;
+    }
+    bench_report(options, "scan", latencies, options->scans, monotonic_ns() - started);
+    free(latencies);
+    result_writer_free(&table->output);
+    table->output = saved;
+    close(null_fd);
+}
+
+/*
+rank: order statistic queries on the subtree counts, alternating
+count(*) over a random id range with fetching the row at a random
+position (limit 1 offset M). Output goes to /dev/null.
+*/
+void bench_rank(BenchOptions *options, Table *table)
+{
+    int null_fd = open("/dev/null", O_WRONLY);
+    ResultWriter saved = table->output;
+    result_writer_init(&table->output, null_fd, OUTPUT_TUPLE);
+    Statement count;
+    Statement position;
+    db_prepare("select count(*) where id between ? and ?", &count);
+    db_prepare("select limit 1 offset ?", &position);
+    uint64_t *latencies = malloc(sizeof(uint64_t) * options->rows);
+    uint64_t state = options->seed + 3;
+    uint64_t started = monotonic_ns();
+    for (uint32_t i = 0; i < options->rows; i++)
+    {
+        uint32_t lower = bench_random(&state) % options->rows + 1;
+        uint64_t op_started = monotonic_ns();
+        if (i % 2 == 0)
+        {
+            db_bind_uint32(&count, 0, lower);
+            db_bind_uint32(&count, 1, lower + bench_random(&state) % options->rows);
+            db_step(&count, table);
+        }
+        else
+        {
+            db_bind_uint32(&position, 0, lower - 1);
+            db_step(&position, table);
+        }
+        latencies[i] = monotonic_ns() - op_started;
+    }
+    bench_report(options, "rank", latencies, options->rows, monotonic_ns() - started);
+    free(latencies);
+    db_finalize(&count);
+    db_finalize(&position);
+    result_writer_free(&table->output);
+    table->output = saved;
+    close(null_fd);
+}
+
+/*
+cold full scans: the table is closed and reopened before each scan and the
+kernel is asked to drop the file from its page cache, so every leaf comes
+from the device and read-ahead (--prefetch) decides the throughput.
+*/
+void bench_cold_scan(BenchOptions *options)
+{
+    int null_fd = open("/dev/null", O_WRONLY);
+    uint64_t *latencies = malloc(sizeof(uint64_t) * options->scans);
+    uint64_t elapsed = 0;
+    for (uint32_t i = 0; i < options->scans; i++)
+    {
+        Table *table = bench_open(options, false);
+        // 脏页不会被丢掉, 先写到盘上
+        sync_file(table->pager->file_descriptor);
+        posix_fadvise(table->pager->file_descriptor, 0, 0, POSIX_FADV_DONTNEED);
+        ResultWriter saved = table->output;
+        result_writer_init(&table->output, null_fd, OUTPUT_TUPLE);
+        uint64_t op_started = monotonic_ns();
+        bench_run_statement(table, "select");
+        latencies[i] = monotonic_ns() - op_started;
+        elapsed += latencies[i];
+        result_writer_free(&table->output);
+        table->output = saved;
+        db_close(table);
+    }
+    bench_report(options, "cold_scan", latencies, options->scans, elapsed);
+    free(latencies);
+    close(null_fd);
+}
+
+// 读写混合: 按比例点查已有的 id 或者插入新的 id
+void bench_mixed(BenchOptions *options, Table *table, uint32_t *ids)
+{
+    Statement insert;
+    db_prepare("insert ? ? ?", &insert);
+    uint64_t *latencies = malloc(sizeof(uint64_t) * options->rows);
+    uint64_t state = options->seed + 1;
+    uint32_t next_id = options->rows + 1;
+    uint64_t started = monotonic_ns();
+    for (uint32_t i = 0; i < options->rows; i++)
+    {
+        bool read = bench_random(&state) % 100 < options->read_percent;
+        uint32_t id = read ? ids[bench_random(&state) % options->rows] : next_id++;
+        uint64_t op_started = monotonic_ns();
+        if (read)
+        {
+            bench_find_one(table, id);
+        }
+        else
+        {
+            bench_insert_one(table, &insert, id);
+        }
+        latencies[i] = monotonic_ns() - op_started;
+    }
+    bench_report(options, "mixed", latencies, options->rows, monotonic_ns() - started);
+    free(latencies);
+    db_finalize(&insert);
+}
+
+typedef struct
+{
+    BenchOptions *options;
+    Table *table;
+    uint32_t *ids;
+    uint64_t seed;
+    uint64_t *latencies;
+    uint64_t elapsed_ns;
+    uint32_t missing;
+} BenchReader;
+
+// 读线程: 在自己的快照上点查已经提交的 id, 时不时换成更新的快照
+void *bench_reader_main(void *arg)
+{
+    BenchReader *reader = arg;
+    BenchOptions *options = reader->options;
+    uint64_t started = monotonic_ns();
+    Table *snapshot = db_snapshot_begin(reader->table, BENCH_SNAPSHOT_CACHE_PAGES);
+    uint64_t state = reader->seed;
+    for (uint32_t i = 0; i < options->rows; i++)
+    {
+        if (i > 0 && i % BENCH_SNAPSHOT_REFRESH == 0)
+        {
+            db_snapshot_end(snapshot);
+            snapshot = db_snapshot_begin(reader->table, BENCH_SNAPSHOT_CACHE_PAGES);
+        }
+        uint32_t id = reader->ids[bench_random(&state) % options->rows];
+        uint64_t op_started = monotonic_ns();
+        reader->missing += !bench_find_one(snapshot, id);
+        reader->latencies[i] = monotonic_ns() - op_started;
+    }
+    db_snapshot_end(snapshot);
+    reader->elapsed_ns = monotonic_ns() - started;
+    return NULL;
+}
+
+/*
+snapshot: reader threads look up committed ids on their own snapshots
+while this thread keeps inserting new rows, one commit per insert. Reader
+latencies are reported together as snapshot_find, the writer's as
+snapshot_insert.
+*/
+void bench_snapshot(BenchOptions *options, Table *table, uint32_t *ids)
+{
+    Table *probe = db_snapshot_begin(table, BENCH_SNAPSHOT_CACHE_PAGES);
+    if (probe == NULL)
+    {
+        fprintf(stderr, "snapshot: skipped, snapshots need the write-ahead log\n");
+        return;
+    }
+    db_snapshot_end(probe);
+
+    pthread_t *threads = malloc(sizeof(pthread_t) * options->readers);
+    BenchReader *readers = malloc(sizeof(BenchReader) * options->readers);
+    uint64_t *reader_latencies = malloc(sizeof(uint64_t) * options->rows * options->readers);
+    uint64_t started = monotonic_ns();
+    for (uint32_t i = 0; i < options->readers; i++)
+    {
+        readers[i].options = options;
+        readers[i].table = table;
+        readers[i].ids = ids;
+        readers[i].seed = options->seed + 2 + i;
+        readers[i].latencies = reader_latencies + (size_t)i * options->rows;
+        readers[i].missing = 0;
+        pthread_create(&threads[i], NULL, bench_reader_main, &readers[i]);
+    }
+
+    // 新 id 从 2 * rows 往后取, 不和前面几个负载插入的重复
+    Statement insert;
+    db_prepare("insert ? ? ?", &insert);
+    uint64_t *writer_latencies = malloc(sizeof(uint64_t) * options->rows);
+    for (uint32_t i = 0; i < options->rows; i++)
+    {
+        uint64_t op_started = monotonic_ns();
+        bench_insert_one(table, &insert, 2 * options->rows + 1 + i);
+        writer_latencies[i] = monotonic_ns() - op_started;
+    }
+    uint64_t writer_elapsed = monotonic_ns() - started;
+    db_finalize(&insert);
+
+    uint32_t missing = 0;
+    uint64_t readers_elapsed = 0;
+    for (uint32_t i = 0; i < options->readers; i++)
+    {
+        pthread_join(threads[i], NULL);
+        missing += readers[i].missing;
+        if (readers[i].elapsed_ns > readers_elapsed)
+        {
+            readers_elapsed = readers[i].elapsed_ns;
+        }
+    }
+    bench_report(options, "snapshot_find", reader_latencies, (uint64_t)options->rows * options->readers,
+                 readers_elapsed);
+    bench_report(options, "snapshot_insert", writer_latencies, options->rows, writer_elapsed);
+    if (missing > 0)
+    {
+        fprintf(stderr, "snapshot: %u committed ids were missing\n", missing);
+    }
+    free(writer_latencies);
+    free(reader_latencies);
+    free(readers);
+    free(threads);
+}
+
+bool bench_selected(BenchOptions *options, const char *workload)
+{
+    const char *list = options->workloads;
+    size_t length = strlen(workload);
+    while (*list != '\0')
+    {
+        const char *end = strchrnul(list, ',');
+        if ((size_t)(end - list) == length && strncmp(list, workload, length) == 0)
+        {
+            return true;
+        }
+        list = *end == ',' ? end + 1 : end;
+    }
+    return false;
+}
+
+void bench_usage(const char *program)
+{
+    printf("Usage: %s [--rows N] [--cache-pages N] [--page-size N] [--prefetch N] [--compress] [--mmap] [--no-wal]\n"
+           "          [--sync off|normal|full] [--batch N] [--scans N] [--read-percent P] [--readers N] [--seed N] [--db path]\n"
+           "          [--workloads insert_seq,insert_random,find,scan,rank,mixed,snapshot,cold_scan]\n",
+           program);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    BenchOptions options = {.rows = BENCH_DEFAULT_ROWS,
+                            .batch = 1,
+                            .scans = BENCH_DEFAULT_SCANS,
+                            .read_percent = BENCH_DEFAULT_READ_PERCENT,
+                            .readers = BENCH_DEFAULT_READERS,
+                            .seed = 0x9e3779b97f4a7c15ull,
+                            .sync_mode = SYNC_NORMAL,
+                            .path = "/tmp/simple-sqlite-bench.db",
+                            .workloads = "insert_seq,insert_random,find,scan,rank,mixed,snapshot,cold_scan",
+                            .db_options = {.cache_pages = PAGER_DEFAULT_CACHE_PAGES,
+                                           .use_mmap = false,
+                                           .background_writer = false,
+                                           .use_wal = true,
+                                           .page_size = PAGE_SIZE_DEFAULT,
+                                           .prefetch_pages = PAGER_PREFETCH_DEFAULT_WINDOW,
+                                           .compress = false}};
+    for (int i = 1; i < argc; i++)
+    {
+        bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--rows") == 0 && has_value)
+        {
+            options.rows = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--cache-pages") == 0 && has_value)
+        {
+            options.db_options.cache_pages = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--page-size") == 0 && has_value)
+        {
+            options.db_options.page_size = strtoul(argv[++i], NULL, 10);
+            if (!page_size_supported(options.db_options.page_size))
+            {
+                bench_usage(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i], "--prefetch") == 0 && has_value)
+        {
+            options.db_options.prefetch_pages = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--compress") == 0)
+        {
+            options.db_options.compress = true;
+        }
+        else if (strcmp(argv[i], "--mmap") == 0)
+        {
+            options.db_options.use_mmap = true;
+        }
+        else if (strcmp(argv[i], "--no-wal") == 0)
+        {
+            options.db_options.use_wal = false;
+        }
+        else if (strcmp(argv[i], "--sync") == 0 && has_value)
+        {
+            i++;
+            if (strcmp(argv[i], "off") == 0)
+            {
+                options.sync_mode = SYNC_OFF;
+            }
+            else if (strcmp(argv[i], "normal") == 0)
+            {
+                options.sync_mode = SYNC_NORMAL;
+            }
+            else if (strcmp(argv[i], "full") == 0)
+            {
+                options.sync_mode = SYNC_FULL;
+            }
+            else
+            {
+                bench_usage(argv[0]);
+            }
+        }
+        else if (strcmp(argv[i], "--batch") == 0 && has_value)
+        {
+            options.batch = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--scans") == 0 && has_value)
+        {
+            options.scans = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--readers") == 0 && has_value)
+        {
+            options.readers = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--read-percent") == 0 && has_value)
+        {
+            options.read_percent = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--seed") == 0 && has_value)
+        {
+            options.seed = strtoull(argv[++i], NULL, 10) | 1;
+        }
+        else if (strcmp(argv[i], "--db") == 0 && has_value)
+        {
+            options.path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--workloads") == 0 && has_value)
+        {
+            options.workloads = argv[++i];
+        }
+        else
+        {
+            bench_usage(argv[0]);
+        }
+    }
+    if (options.rows == 0 || options.batch == 0 || options.read_percent > 100 || options.readers == 0)
+    {
+        bench_usage(argv[0]);
+    }
+
+    // 顺序的 id 和打乱的 id
+    uint32_t *sequential = malloc(sizeof(uint32_t) * options.rows);
+    uint32_t *shuffled = malloc(sizeof(uint32_t) * options.rows);
+    uint64_t state = options.seed;
+    for (uint32_t i = 0; i < options.rows; i++)
+    {
+        sequential[i] = shuffled[i] = i + 1;
+    }
+    for (uint32_t i = options.rows - 1; i > 0; i--)
+    {
+        uint32_t j = bench_random(&state) % (i + 1);
+        uint32_t swap = shuffled[i];
+        shuffled[i] = shuffled[j];
+        shuffled[j] = swap;
+    }
+
+    if (bench_selected(&options, "insert_seq"))
+    {
+        Table *table = bench_open(&options, true);
+        bench_insert(&options, table, "insert_seq", sequential);
+        db_close(table);
+    }
+
+    // 后面几个负载都在随机插入建好的表上跑
+    bool reads = bench_selected(&options, "find") || bench_selected(&options, "scan") ||
+                 bench_selected(&options, "rank") || bench_selected(&options, "mixed") || bench_selected(&options, "snapshot") ||
+                 bench_selected(&options, "cold_scan");
+    if (bench_selected(&options, "insert_random") || reads)
+    {
+        Table *table = bench_open(&options, true);
+        if (bench_selected(&options, "insert_random"))
+        {
+            bench_insert(&options, table, "insert_random", shuffled);
+        }
+        else
+        {
+            // 不计时地把表建好
+            BenchOptions setup = options;
+            setup.batch = BATCH_FLUSH_ROWS;
+            FILE *saved = stdout;
+            stdout = fopen("/dev/null", "w");
+            bench_insert(&setup, table, "setup", shuffled);
+            fclose(stdout);
+            stdout = saved;
+        }
+        if (bench_selected(&options, "find"))
+        {
+            bench_find(&options, table, shuffled);
+        }
+        if (bench_selected(&options, "scan"))
+        {
+            bench_scan(&options, table);
+        }
+        if (bench_selected(&options, "rank"))
+        {
+            bench_rank(&options, table);
+        }
+        if (bench_selected(&options, "mixed"))
+        {
+            bench_mixed(&options, table, shuffled);
+        }
+        if (bench_selected(&options, "snapshot"))
+        {
+            bench_snapshot(&options, table, shuffled);
+        }
+        db_close(table);
+        if (bench_selected(&options, "cold_scan"))
+        {
+            bench_cold_scan(&options);
+        }
+    }
+
+    free(sequential);
+    free(shuffled);
+    return EXIT_SUCCESS;
+}
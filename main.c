@@ -1,4 +1,4 @@
-
+#define _GNU_SOURCE // mremap
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,7 +7,19 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 #include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #define COLUMN_USERNAME_SIZE 32
 #define COLUMN_EMAIL_SIZE 255
@@ -24,20 +36,68 @@ typedef struct
 const uint32_t ID_SIZE = size_of_attribute(Row, id);
 const uint32_t USERNAME_SIZE = size_of_attribute(Row, username);
 const uint32_t EMAIL_SIZE = size_of_attribute(Row, email);
-const uint32_t ID_OFFSET = 0; // id 字段的开始位置
-const uint32_t USERNAME_OFFSET = ID_OFFSET + USERNAME_SIZE;
-const uint32_t EMAIL_OFFSET = USERNAME_OFFSET + EMAIL_SIZE;
 const uint32_t ROW_SIZE = ID_SIZE + USERNAME_SIZE + EMAIL_SIZE;
 
-const uint32_t PAGE_SIZE = 4096; // 一页大小
-#define TABLE_MAX_PAGES 100      // 一个表的总页数
+/*
+serialized value layout: each string is stored as a one byte length
+followed by its bytes, so a value only takes as much room as its data
+*/
+const uint32_t FIELD_LENGTH_SIZE = sizeof(uint8_t);
+const uint32_t VALUE_MAX_SIZE = FIELD_LENGTH_SIZE + COLUMN_USERNAME_SIZE +
+                                FIELD_LENGTH_SIZE + COLUMN_EMAIL_SIZE;
+
+/*
+page size is chosen when a file is created (4 to 64 KB) and recorded in
+its header; layout_init derives the node layout from it when the file is
+opened. The layout is global, so all databases open in one process share
+one page size.
+*/
+#define PAGE_SIZE_DEFAULT 4096
+#define PAGE_SIZE_MIN 4096
+#define PAGE_SIZE_MAX 65536 // 槽是 u16 的页内偏移, 页不能更大
+uint32_t PAGE_SIZE = PAGE_SIZE_DEFAULT; // 一页大小
+#define PAGER_DEFAULT_CACHE_PAGES 1024 // 缓冲池默认帧数 (4 MB)
+#define PAGER_MIN_CACHE_PAGES 16       // 一次插入最多同时 pin 住的页数要小于它
+#define PAGER_MAX_CACHE_PAGES (1u << 24) // 页表按 2 * cache_pages 取大小, 不能溢出
+#define PAGER_MMAP_RESERVE ((size_t)1 << 40) // mmap 模式预留的地址空间 (1 TB)
+#define PAGER_MMAP_MIN_GROW_PAGES 256        // mmap 模式每次至少扩展 1 MB
+#define PAGER_WRITER_INTERVAL_MS 100  // 后台写线程的唤醒间隔
+#define PAGER_WRITER_BATCH_PAGES 64   // 后台写线程每次最多写回的页数
+#define PAGER_PREFETCH_THREADS 8         // 预读线程数, 也就是最多同时在读的页数
+#define PAGER_PREFETCH_FRAME_SHARE 8     // 在读的预读页最多占 1/8 的帧
+#define PAGER_PREFETCH_DEFAULT_WINDOW 32 // 扫描默认提前读的叶子数
+#define PAGER_PREFETCH_MAX_WINDOW 256
+#define PAGER_PREFETCH_MIN_READ_NS 20000 // 平均读一页快于 20 us 说明在操作系统缓存里, 不值得预读
+#define COMPRESS_SECTOR 512        // 压缩文件里槽的对齐单位
+#define COMPRESS_DIRECTORY_PAGES 4 // 页映射块目录占的页数, 决定压缩文件最多能有多少页
+#define LZ_HASH_BITS 12    // 压缩时找重复用的哈希表 4096 项
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535 // 偏移存两个字节
+#define IMPORT_RUN_ROWS (1 << 17)          // 外部排序每个 run 在内存里排的行数
+#define IMPORT_DEFAULT_FILL_PERCENT 100    // .import 默认把页装满
+#define BULK_MAX_LEVELS 32                 // 批量建树时内部节点的最大层数
+#define RESULT_BUFFER_SIZE (1 << 20)       // 结果输出缓冲区 1 MB
+#define SCAN_MAX_THREADS 64                // 并行扫描最多的线程数
+#define SCAN_PARTITIONS_PER_THREAD 4       // 每个线程分到几个子树, 让各线程的工作量更均匀
+#define WAL_MAGIC 0x57414c31             // "WAL1"
+#define WAL_HEADER_SIZE 16
+#define WAL_FRAME_HEADER_SIZE 24
+#define WAL_AUTOCHECKPOINT_FRAMES 1000  // 日志里的页帧超过这个数就在提交后做检查点
+#define BATCH_FLUSH_ROWS 65536            // 批里攒了这么多行就先写进树, 限制内存
+#define SCRIPT_CHUNK_SIZE (1 << 20)       // 批处理模式每次从输入读 1 MB
+#define STATS_HISTOGRAM_BUCKETS 24        // 语句耗时按 2 的幂微秒分桶, 最后一桶是 4 秒以上
+#define INVALID_PAGE_NUM UINT32_MAX
+#define PAGER_NO_FRAME UINT32_MAX
 // const uint32_t ROWS_PER_PAGE = PAGE_SIZE / ROW_SIZE;             // 一页有多少行
 // const uint32_t TABLE_MAX_ROWS = ROWS_PER_PAGE * TABLE_MAX_PAGES; // 一个表有多少行
 
 typedef enum
 {
     NODE_INTERNAL,
-    NODE_LEAF
+    NODE_LEAF,
+    NODE_FREE, // 在空闲页链表里
+    NODE_INDEX_INTERNAL,
+    NODE_INDEX_LEAF
 } NodeType;
 
 /*
@@ -50,7 +110,7 @@ const uint32_t IS_ROOT_SIZE = sizeof(uint8_t);
 const uint32_t IS_ROOT_OFFSET = NODE_TYPE_SIZE;
 
 const uint32_t PARENT_POINTER_SIZE = sizeof(uint32_t);
-const uint32_t PARENT_POINTER_OFFSET = NODE_TYPE_OFFSET + IS_ROOT_SIZE;
+const uint32_t PARENT_POINTER_OFFSET = IS_ROOT_OFFSET + IS_ROOT_SIZE;
 const uint8_t COMMON_NODE_HEADER_SIZE = NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_POINTER_SIZE;
 
 /*
@@ -58,27 +118,32 @@ leaf node header layout
 */
 const uint32_t LEAF_NODE_NUM_CELLS_SIZE = sizeof(uint32_t);
 const uint32_t LEAF_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;
-// const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE;
 const uint32_t LEAF_NODE_NEXT_LEAF_SIZE = sizeof(uint32_t);
-const uint32_t LEAF_NODE_NEXT_LEAF_OFFSET = COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE;
-const uint32_t LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE +
-                                       LEAF_NODE_NUM_CELLS_SIZE +
-                                       LEAF_NODE_NEXT_LEAF_SIZE;
+const uint32_t LEAF_NODE_NEXT_LEAF_OFFSET = LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE;
+const uint32_t LEAF_NODE_CONTENT_START_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_CONTENT_START_OFFSET = LEAF_NODE_NEXT_LEAF_OFFSET + LEAF_NODE_NEXT_LEAF_SIZE;
+const uint32_t LEAF_NODE_FRAGMENTED_SIZE = sizeof(uint32_t);
+const uint32_t LEAF_NODE_FRAGMENTED_OFFSET = LEAF_NODE_CONTENT_START_OFFSET + LEAF_NODE_CONTENT_START_SIZE;
+const uint32_t LEAF_NODE_HEADER_SIZE = LEAF_NODE_FRAGMENTED_OFFSET + LEAF_NODE_FRAGMENTED_SIZE;
 
 /*
-leaf node body layout
+leaf node body layout (structure of arrays)
+
+| header | key 0 | key 1 | ... | slot 0 | slot 1 | ... -> free <- ... | value 1 | value 0 |
+
+All keys sit together right after the header so a search only touches a
+few cache lines. The slot array follows the keys and holds the page offset
+of each value; value content grows down from the end of the page.
 */
 const uint32_t LEAF_NODE_KEY_SIZE = sizeof(uint32_t);
-const uint32_t LEAF_NODE_KEY_OFFSET = 0;
-const uint32_t LEAF_NODE_VALUE_SIZE = ROW_SIZE;
-const uint32_t LEAF_NODE_VALUE_OFFSET = LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE;
+const uint32_t LEAF_NODE_SLOT_SIZE = sizeof(uint16_t);
+const uint32_t LEAF_NODE_ENTRY_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_SLOT_SIZE;
+const uint32_t LEAF_NODE_MIN_VALUE_SIZE = 2 * FIELD_LENGTH_SIZE;
+const uint32_t LEAF_NODE_MAX_VALUE_SIZE = VALUE_MAX_SIZE;
 
-const uint32_t LEAF_NODE_CELL_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE;
-const uint32_t LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
-const uint32_t LEAF_NODE_MAX_CELLS = LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE;
-
-const uint32_t LEAF_NODE_RIGHT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) / 2;
-const uint32_t LEAF_NODE_LEFT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT;
+uint32_t LEAF_NODE_SPACE_FOR_CELLS; // 以下几个随页大小变, 由 layout_init 计算
+// 行都是空字符串时一页能放的最多行数, 只用作上界
+uint32_t LEAF_NODE_MAX_CELLS;
 
 /*
 access leaf node fields
@@ -91,10 +156,164 @@ const uint32_t INTERNAL_NODE_RIGHT_CHILD_OFFSET = COMMON_NODE_HEADER_SIZE + INTE
 const uint32_t INTERNAL_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE +
                                            INTERNAL_NODE_NUM_KEYS_SIZE + INTERNAL_NODE_RIGHT_CHILD_SIZE;
 
+/*
+internal node body layout: a fixed size key array followed by a fixed size
+child array, so the keys searched on the way down are contiguous. Then
+the number of rows under each child, the right child's last, which lets
+count, offset and rank queries descend instead of walking the leaves.
+Files from before the counts (format versions 1 and 2) have no count
+array and more cells per node; INTERNAL_NODE_HAS_COUNTS tells them apart.
+*/
 const uint32_t INTERNAL_NODE_KEYS_SIZE = sizeof(uint32_t);
 const uint32_t INTERNAL_NODE_CHILD_SIZE = sizeof(uint32_t);
-const uint32_t INTERNAL_NODE_CELL_SIZE = INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEYS_SIZE;
-const uint32_t INTERNAL_NODE_MAX_CELLS = 3;
+const uint32_t INTERNAL_NODE_COUNT_SIZE = sizeof(uint32_t);
+uint32_t INTERNAL_NODE_CELL_SIZE;
+uint32_t INTERNAL_NODE_SPACE_FOR_CELLS;
+uint32_t INTERNAL_NODE_MAX_CELLS;
+const uint32_t INTERNAL_NODE_KEYS_OFFSET = INTERNAL_NODE_HEADER_SIZE;
+uint32_t INTERNAL_NODE_CHILDREN_OFFSET;
+uint32_t INTERNAL_NODE_COUNTS_OFFSET;
+bool INTERNAL_NODE_HAS_COUNTS;
+
+/*
+underflow thresholds for delete: a leaf holding less than a quarter of its
+space, or an internal node with fewer children than this, is rebalanced
+with a sibling. Lower than half so that a node just split is not merged
+straight back by the next delete.
+*/
+uint32_t LEAF_NODE_MIN_USED_BYTES;
+uint32_t INTERNAL_NODE_MIN_CHILDREN;
+
+void layout_init(uint32_t page_size, bool subtree_counts)
+{
+    PAGE_SIZE = page_size;
+    LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
+    LEAF_NODE_MAX_CELLS = LEAF_NODE_SPACE_FOR_CELLS / (LEAF_NODE_ENTRY_SIZE + LEAF_NODE_MIN_VALUE_SIZE);
+    INTERNAL_NODE_HAS_COUNTS = subtree_counts;
+    INTERNAL_NODE_CELL_SIZE = INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEYS_SIZE;
+    INTERNAL_NODE_SPACE_FOR_CELLS = PAGE_SIZE - INTERNAL_NODE_HEADER_SIZE;
+    if (subtree_counts)
+    {
+        // 每个孩子多一个行数, 最右孩子的行数单独占一项
+        INTERNAL_NODE_CELL_SIZE += INTERNAL_NODE_COUNT_SIZE;
+        INTERNAL_NODE_SPACE_FOR_CELLS -= INTERNAL_NODE_COUNT_SIZE;
+    }
+    INTERNAL_NODE_MAX_CELLS = INTERNAL_NODE_SPACE_FOR_CELLS / INTERNAL_NODE_CELL_SIZE;
+    INTERNAL_NODE_CHILDREN_OFFSET = INTERNAL_NODE_KEYS_OFFSET + INTERNAL_NODE_MAX_CELLS * INTERNAL_NODE_KEYS_SIZE;
+    INTERNAL_NODE_COUNTS_OFFSET = INTERNAL_NODE_CHILDREN_OFFSET + INTERNAL_NODE_MAX_CELLS * INTERNAL_NODE_CHILD_SIZE;
+    LEAF_NODE_MIN_USED_BYTES = LEAF_NODE_SPACE_FOR_CELLS / 4;
+    INTERNAL_NODE_MIN_CHILDREN = (INTERNAL_NODE_MAX_CELLS + 1) / 4 > 2 ? (INTERNAL_NODE_MAX_CELLS + 1) / 4 : 2;
+}
+
+bool page_size_supported(uint32_t page_size)
+{
+    return page_size >= PAGE_SIZE_MIN && page_size <= PAGE_SIZE_MAX && (page_size & (page_size - 1)) == 0;
+}
+
+/*
+file header (page 0): format version, page size and page count, the root
+page of the tree and the free page list. Pages emptied by delete are
+chained from free_head through a next pointer in each free page, and
+get_unused_page_num hands them out before growing the file. Headers
+written before the version field existed have 0 there and 4 KB pages.
+Version 3 added the subtree counts of internal nodes; files of versions
+1 and 2 (2 being compressed) keep working without them until .vacuum
+rebuilds the tree. From version 3 on compression is a flag.
+*/
+#define HEADER_MAGIC 0x4c515353 // "SSQL"
+#define HEADER_FORMAT_VERSION 3
+#define HEADER_FORMAT_UNCOUNTED 1  // 内部节点还没有子树行数
+#define HEADER_FORMAT_COMPRESSED 2 // 同上, 页压缩存放 (see pager_write_compressed)
+#define HEADER_FLAG_COMPRESSED 1
+const uint32_t HEADER_MAGIC_OFFSET = 0;
+const uint32_t HEADER_ROOT_PAGE_OFFSET = 4;
+const uint32_t HEADER_FREE_HEAD_OFFSET = 8;
+const uint32_t HEADER_FREE_COUNT_OFFSET = 12;
+const uint32_t HEADER_INDEX_ROOTS_OFFSET = 16; // 每个可建索引的列一个根页号, 0 表示没有索引, 最多两列
+const uint32_t HEADER_VERSION_OFFSET = 24;
+const uint32_t HEADER_PAGE_SIZE_OFFSET = 28;
+const uint32_t HEADER_PAGE_COUNT_OFFSET = 32;
+const uint32_t HEADER_FLAGS_OFFSET = 36;
+const uint32_t HEADER_SIZE = 40;
+const uint32_t FREE_PAGE_NEXT_OFFSET = COMMON_NODE_HEADER_SIZE;
+
+uint32_t *header_magic(void *page)
+{
+    return page + HEADER_MAGIC_OFFSET;
+}
+
+uint32_t *header_root_page(void *page)
+{
+    return page + HEADER_ROOT_PAGE_OFFSET;
+}
+
+uint32_t *header_free_head(void *page)
+{
+    return page + HEADER_FREE_HEAD_OFFSET;
+}
+
+uint32_t *header_free_count(void *page)
+{
+    return page + HEADER_FREE_COUNT_OFFSET;
+}
+
+uint32_t *header_index_root(void *page, uint32_t column)
+{
+    return page + HEADER_INDEX_ROOTS_OFFSET + column * sizeof(uint32_t);
+}
+
+uint32_t *header_version(void *page)
+{
+    return page + HEADER_VERSION_OFFSET;
+}
+
+uint32_t *header_page_size(void *page)
+{
+    return page + HEADER_PAGE_SIZE_OFFSET;
+}
+
+uint32_t *header_page_count(void *page)
+{
+    return page + HEADER_PAGE_COUNT_OFFSET;
+}
+
+uint32_t *header_flags(void *page)
+{
+    return page + HEADER_FLAGS_OFFSET;
+}
+
+// 压缩的文件: 版本 2, 或者版本 3 起带压缩标志
+bool header_compressed(void *page)
+{
+    return *header_version(page) == HEADER_FORMAT_COMPRESSED ||
+           (*header_version(page) >= HEADER_FORMAT_VERSION && (*header_flags(page) & HEADER_FLAG_COMPRESSED));
+}
+
+uint32_t *free_page_next(void *node)
+{
+    return node + FREE_PAGE_NEXT_OFFSET;
+}
+
+/*
+secondary index node layout: a slotted page like the table leaves. Sorted
+u16 slots follow the header and cells are packed from the end of the page.
+A cell is child page | id | value length | value bytes; leaves leave the
+child at 0. An internal cell's entry is the upper bound of its child, the
+child after the last cell is kept in the link field, which in a leaf is
+the next leaf. Index nodes have no parent pointers.
+*/
+const uint32_t INDEX_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;
+const uint32_t INDEX_NODE_LINK_OFFSET = INDEX_NODE_NUM_CELLS_OFFSET + sizeof(uint32_t);
+const uint32_t INDEX_NODE_CONTENT_START_OFFSET = INDEX_NODE_LINK_OFFSET + sizeof(uint32_t);
+const uint32_t INDEX_NODE_FRAGMENTED_OFFSET = INDEX_NODE_CONTENT_START_OFFSET + sizeof(uint32_t);
+const uint32_t INDEX_NODE_HEADER_SIZE = INDEX_NODE_FRAGMENTED_OFFSET + sizeof(uint32_t);
+const uint32_t INDEX_NODE_SLOT_SIZE = sizeof(uint16_t);
+const uint32_t INDEX_CELL_CHILD_OFFSET = 0;
+const uint32_t INDEX_CELL_ID_OFFSET = 4;
+const uint32_t INDEX_CELL_LENGTH_OFFSET = 8;
+const uint32_t INDEX_CELL_VALUE_OFFSET = 9;
+#define INDEX_MAX_CELL_SIZE (9 + COLUMN_EMAIL_SIZE)
+#define INDEX_MAX_DEPTH 32
 
 uint32_t *internal_node_num_keys(void *node)
 {
@@ -108,12 +327,18 @@ uint32_t *internal_node_right_child(void *node)
 
 uint32_t *internal_node_cell(void *node, uint32_t cell_num)
 {
-    return node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE;
+    return node + INTERNAL_NODE_CHILDREN_OFFSET + cell_num * INTERNAL_NODE_CHILD_SIZE;
 }
 
 uint32_t *internal_node_key(void *node, uint32_t key_num)
 {
-    return (void *)internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
+    return node + INTERNAL_NODE_KEYS_OFFSET + key_num * INTERNAL_NODE_KEYS_SIZE;
+}
+
+// 第 cell_num 个单元的孩子子树里的行数; 最右孩子的在 INTERNAL_NODE_MAX_CELLS 处
+uint32_t *internal_node_cell_count(void *node, uint32_t cell_num)
+{
+    return node + INTERNAL_NODE_COUNTS_OFFSET + cell_num * INTERNAL_NODE_COUNT_SIZE;
 }
 
 uint32_t *leaf_node_next_leaf(void *node)
@@ -138,19 +363,55 @@ uint32_t *leaf_node_num_cells(void *node)
     return node + LEAF_NODE_NUM_CELLS_OFFSET; // 跨过header 返回指向num_cells的指针
 }
 
-void *leaf_node_cell(void *node, uint32_t cell_num)
+uint32_t *leaf_node_content_start(void *node)
+{
+    return node + LEAF_NODE_CONTENT_START_OFFSET;
+}
+
+uint32_t *leaf_node_fragmented_bytes(void *node)
 {
-    return node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_CELL_SIZE;
+    return node + LEAF_NODE_FRAGMENTED_OFFSET;
 }
 
 uint32_t *leaf_node_key(void *node, uint32_t cell_num)
 {
-    return leaf_node_cell(node, cell_num);
+    return node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_KEY_SIZE;
+}
+
+// 槽数组紧跟在键数组后面, 位置随 num_cells 变化
+uint16_t *leaf_node_slot(void *node, uint32_t cell_num)
+{
+    return (void *)leaf_node_key(node, *leaf_node_num_cells(node)) + cell_num * LEAF_NODE_SLOT_SIZE;
 }
 
 void *leaf_node_value(void *node, uint32_t cell_num)
 {
-    return leaf_node_cell(node, cell_num) + LEAF_NODE_KEY_SIZE;
+    return node + *leaf_node_slot(node, cell_num);
+}
+
+uint32_t value_size(void *value)
+{
+    uint8_t username_length = *(uint8_t *)value;
+    uint8_t email_length = *(uint8_t *)(value + FIELD_LENGTH_SIZE + username_length);
+    return 2 * FIELD_LENGTH_SIZE + username_length + email_length;
+}
+
+uint32_t leaf_node_value_size(void *node, uint32_t cell_num)
+{
+    return value_size(leaf_node_value(node, cell_num));
+}
+
+// 槽数组和内容区之间连续的空闲字节
+uint32_t leaf_node_gap(void *node)
+{
+    uint32_t slots_end = LEAF_NODE_HEADER_SIZE + *leaf_node_num_cells(node) * LEAF_NODE_ENTRY_SIZE;
+    return *leaf_node_content_start(node) - slots_end;
+}
+
+// 压缩后能得到的空闲字节, 包括删除留下的碎片
+uint32_t leaf_node_free_space(void *node)
+{
+    return leaf_node_gap(node) + *leaf_node_fragmented_bytes(node);
 }
 
 void set_node_type(void *node, NodeType type)
@@ -172,6 +433,8 @@ void initialize_leaf_node(void *node)
     set_node_root(node, false);
     *leaf_node_num_cells(node) = 0;
     *leaf_node_next_leaf(node) = 0;
+    *leaf_node_content_start(node) = PAGE_SIZE;
+    *leaf_node_fragmented_bytes(node) = 0;
 }
 void initalize_leaf_node(void *node)
 {
@@ -197,6 +460,118 @@ uint32_t *internal_node_child(void *node, uint32_t child_num)
     }
 }
 
+// 第 child_num 个孩子子树里的行数, child_num == num_keys 时是最右孩子的
+uint32_t *internal_node_count(void *node, uint32_t child_num)
+{
+    if (child_num == *internal_node_num_keys(node))
+    {
+        return internal_node_cell_count(node, INTERNAL_NODE_MAX_CELLS);
+    }
+    return internal_node_cell_count(node, child_num);
+}
+
+/*
+key search kernel: lower bound (first key >= target) over a sorted key
+array. Binary search narrows the range down to a small window, then the
+window is counted with SIMD compares, 8 keys per instruction with AVX2 and
+4 with SSE2. The kernel is picked once from the CPU features at startup.
+*/
+#define KEY_SEARCH_WINDOW 32
+
+uint32_t key_count_less_scalar(const uint32_t *keys, uint32_t count, uint32_t key)
+{
+    uint32_t less = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        less += keys[i] < key;
+    }
+    return less;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+SSE2/AVX2 only have signed compares, flipping the sign bit of both sides
+turns them into unsigned compares. A true lane is -1, so subtracting the
+compare mask counts the keys below the target.
+*/
+__attribute__((target("sse2"))) uint32_t key_count_less_sse2(const uint32_t *keys, uint32_t count, uint32_t key)
+{
+    const __m128i bias = _mm_set1_epi32(INT32_MIN);
+    __m128i target = _mm_xor_si128(_mm_set1_epi32(key), bias);
+    __m128i less = _mm_setzero_si128();
+    uint32_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i chunk = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(keys + i)), bias);
+        less = _mm_sub_epi32(less, _mm_cmplt_epi32(chunk, target));
+    }
+    uint32_t lanes[4];
+    _mm_storeu_si128((__m128i *)lanes, less);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + key_count_less_scalar(keys + i, count - i, key);
+}
+
+__attribute__((target("avx2"))) uint32_t key_count_less_avx2(const uint32_t *keys, uint32_t count, uint32_t key)
+{
+    const __m256i bias = _mm256_set1_epi32(INT32_MIN);
+    __m256i target = _mm256_xor_si256(_mm256_set1_epi32(key), bias);
+    __m256i less = _mm256_setzero_si256();
+    uint32_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i chunk = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(keys + i)), bias);
+        less = _mm256_sub_epi32(less, _mm256_cmpgt_epi32(target, chunk));
+    }
+    uint32_t lanes[8];
+    _mm256_storeu_si256((__m256i *)lanes, less);
+    uint32_t total = 0;
+    for (uint32_t lane = 0; lane < 8; lane++)
+    {
+        total += lanes[lane];
+    }
+    return total + key_count_less_sse2(keys + i, count - i, key);
+}
+#endif
+
+uint32_t (*key_count_less)(const uint32_t *keys, uint32_t count, uint32_t key) = key_count_less_scalar;
+const char *key_search_kernel_name = "scalar";
+
+void key_search_init()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        key_count_less = key_count_less_avx2;
+        key_search_kernel_name = "avx2";
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        key_count_less = key_count_less_sse2;
+        key_search_kernel_name = "sse2";
+    }
+#endif
+}
+
+uint32_t key_lower_bound(const uint32_t *keys, uint32_t count, uint32_t key)
+{
+    uint32_t low = 0;
+    uint32_t high = count;
+    // [0, low) 都小于 key, [high, count) 都不小于 key
+    while (high - low > KEY_SEARCH_WINDOW)
+    {
+        uint32_t middle = low + (high - low) / 2;
+        if (keys[middle] >= key)
+        {
+            high = middle;
+        }
+        else
+        {
+            low = middle + 1;
+        }
+    }
+    return low + key_count_less(keys + low, high - low, key);
+}
+
 typedef struct
 {
     char *buffer;
@@ -209,11 +584,17 @@ typedef enum
     EXECUTE_SUCCESS,
     EXECUTE_TABLE_FULL,
     EXECUTE_DUPLICATE_KEY,
+    EXECUTE_ALREADY_IN_BATCH,
+    EXECUTE_NOT_IN_BATCH,
+    EXECUTE_INDEX_EXISTS,
+    EXECUTE_UNBOUND_PARAMETER,
+    EXECUTE_READ_ONLY,
 } ExecuteResult;
 
 typedef enum
 {
     MATE_COMMAND_SUCCESS,
+    META_COMMAND_FAILED, // 命令认识, 但出错了 (批处理的汇总里算失败)
     META_COMMAND_UNRECOGNIZED_COMMAND
 } MetaCommandResult;
 
@@ -229,29 +610,374 @@ typedef enum
 typedef enum
 {
     STATEMENT_INSERT,
-    STATEMEND_SELECT
+    STATEMEND_SELECT,
+    STATEMENT_BEGIN,
+    STATEMENT_COMMIT,
+    STATEMENT_DELETE,
+    STATEMENT_CREATE_INDEX
 } StatementType;
 
+#define STATEMENT_TYPE_COUNT (STATEMENT_CREATE_INDEX + 1)
+
+// 可以建二级索引的列
+typedef enum
+{
+    INDEX_USERNAME,
+    INDEX_EMAIL,
+    INDEX_COLUMN_COUNT
+} IndexColumn;
+
+/*
+buffer pool frame
+*/
+typedef struct
+{
+    uint32_t page_num;  // 帧里缓存的页号, 空帧为 INVALID_PAGE_NUM
+    uint32_t pin_count; // 大于 0 时不能被淘汰
+    bool referenced;    // CLOCK 算法的引用位
+    bool dirty;         // 被修改过, 淘汰或关闭时需要写回文件
+    bool loading;       // 正在从文件读入, 读完之前别的线程要等
+    void *data;
+} Frame;
+
+typedef enum
+{
+    PAGER_MODE_BUFFERED, // lseek + read 到缓冲池的帧里
+    PAGER_MODE_MMAP      // 直接返回文件映射里的指针
+} PagerMode;
+
+typedef enum
+{
+    SYNC_OFF,    // 从不 fdatasync, 交给操作系统
+    SYNC_NORMAL, // 组提交: 后台线程每个周期对日志 fdatasync 一次
+    SYNC_FULL    // 每次提交返回前 fdatasync 日志
+} SyncMode;
+
+typedef enum
+{
+    PAGER_ACCESS_RANDOM,    // 点查, 关掉内核预读
+    PAGER_ACCESS_SEQUENTIAL // 顺序扫描, 积极预读
+} PagerAccess;
+
+// 提交前被淘汰进日志的页, 以及它覆盖掉的日志索引项 (0 表示原来在主文件里)
+typedef struct
+{
+    uint32_t page_num;
+    uint64_t committed_offset;
+} WalUndo;
+
+// .stats 的计数器, 都在 pager->lock 里更新. mmap 模式下命中和读盘由内核处理, 不计数
+typedef struct
+{
+    uint64_t page_hits;
+    uint64_t page_misses;
+    uint64_t bytes_read;        // 缺页时从主文件或日志读入
+    uint64_t bytes_written;     // 写回主文件 (淘汰, 后台写线程, 检查点)
+    uint64_t wal_bytes_written; // 写进日志的页帧和提交记录
+    uint64_t prefetch_reads;    // 预读线程读入的页 (包含在 bytes_read 里)
+} PagerStats;
+
+// 排队等预读线程读取的页: 帧已经认领好, 读完解除 pin
+typedef struct
+{
+    uint32_t frame_index;
+    int fd;
+    off_t offset;
+    uint32_t length; // 小于 PAGE_SIZE 时读到的是压缩过的页
+} PrefetchRead;
+
+// 压缩文件里一页的位置; sector 为 0 表示这页还没写进主文件
+typedef struct
+{
+    uint32_t sector;  // 槽的起点, 以 COMPRESS_SECTOR 为单位
+    uint16_t length;  // 压缩后的字节数, 0 表示原样存放整页
+    uint8_t capacity; // 槽的扇区数; 页变长装不下时换一个槽
+    uint8_t unused;
+} PageSlot;
+
+// 压缩文件里同样大小的一组空闲槽, 记的是起始扇区
+typedef struct
+{
+    uint32_t *sectors;
+    uint32_t count;
+    uint32_t capacity;
+} SlotList;
+
 typedef struct
 {
     int file_descriptor;
-    uint32_t file_length;
+    PagerMode mode;
+    uint64_t file_length;
     uint32_t num_pages;
-    void *pages[TABLE_MAX_PAGES];
+    uint32_t num_frames;
+    Frame *frames;
+    uint32_t *page_table;      // 页号 -> 帧下标, 线性探测的哈希表
+    uint32_t page_table_mask;  // 哈希表大小减一 (大小为 2 的幂)
+    uint32_t clock_hand;
+    /*
+    mmap mode: the whole reserved range stays at a fixed address, so page
+    pointers survive while the mapped prefix grows into it.
+    */
+    void *map_base;
+    size_t map_length;
+    PagerAccess access;
+    /*
+    lock protects the frame table. Page contents are only modified while
+    pinned, so the background writer only ever writes unpinned frames.
+    */
+    pthread_mutex_t lock;
+    pthread_cond_t page_loaded; // 有帧读完了, 唤醒等待 loading 的线程
+    pthread_cond_t writer_wakeup;
+    pthread_t writer_thread;
+    bool writer_running;
+    bool writer_stop;
+    /*
+    write-ahead log: modified pages are appended to <db>-wal as frames and
+    every statement ends with a commit record. The main file only changes
+    at checkpoints, so after a crash it holds the last checkpoint and the
+    committed frames in the log are replayed on top of it.
+    */
+    int wal_fd; // -1 表示没有日志
+    char *wal_path;
+    SyncMode sync_mode;
+    uint64_t wal_length;       // 下一个帧写入的位置
+    uint32_t wal_salt;         // 每次重置日志换一个, 上一轮留下的帧校验不过
+    uint64_t wal_checksum;     // 到目前为止所有帧的累计校验和
+    uint32_t wal_frames;       // 日志里的页帧数
+    uint32_t wal_uncommitted;  // 最后一个提交记录之后写入的页帧数
+    uint64_t commit_checksum;  // 最后一个提交记录之后的累计校验和, 回滚时从这里接着写
+    uint32_t commit_num_pages; // 最后一次提交时的页数
+    bool wal_unsynced;         // 有已提交但还没 fdatasync 的帧
+    uint32_t *wal_index_pages; // 页号 -> 日志里最新的帧, 线性探测的哈希表
+    uint64_t *wal_index_offsets;
+    uint32_t wal_index_mask;
+    uint32_t wal_index_count;
+    WalUndo *wal_undo; // 最后一次提交之后被淘汰进日志的页, 快照用它还原出已提交的索引
+    uint32_t wal_undo_count;
+    uint32_t wal_undo_capacity;
+    uint32_t readers; // 打开着的快照数; 有快照时检查点要等
+    pthread_cond_t readers_done;
+    PrefetchRead *prefetch_queue; // num_frames 个位置的环形队列
+    uint32_t prefetch_head;
+    uint32_t prefetch_queued;
+    uint32_t prefetch_inflight; // 认领了帧还没读完的页, 包括还在队列里的
+    uint32_t prefetch_window;   // 扫描提前读的叶子数, 0 表示不预读
+    int64_t read_ns;            // 最近读一页的平均耗时, 从操作系统缓存读时不预读
+    pthread_cond_t prefetch_wakeup;
+    pthread_t prefetch_threads[PAGER_PREFETCH_THREADS];
+    uint32_t prefetch_running; // 已经启动的预读线程数
+    bool prefetch_stop;
+    /*
+    compressed main file: page 0 stays in place at offset 0, every other
+    page lives in a slot found through the page map, which is stored in
+    page-sized map chunks listed by the directory after page 0.
+    */
+    bool compressed;
+    char *path;                // 主文件路径, .vacuum 压紧压缩文件时换文件用
+    PageSlot *slots;           // 页号 -> 槽, 长度是 map_chunks 个映射块
+    uint32_t map_chunks;
+    uint64_t *chunk_offsets;   // 目录: 每个映射块在文件里的位置, 0 表示还没有
+    bool *chunk_dirty;
+    bool map_dirty;            // 有映射块或目录还没写回
+    SlotList *free_slots;      // 按扇区数分开的空闲槽, 分配时先用它们
+    SlotList *released_slots;  // 换槽留下的旧槽, 磁盘上的映射不再指向它们之后才能重用
+    uint8_t *compress_buffer;
+    PagerStats stats;
 } Pager;
 
+typedef struct
+{
+    uint32_t cache_pages; // 缓冲池帧数
+    bool use_mmap;
+    bool background_writer; // 空闲时由后台线程慢慢写回脏页
+    bool use_wal;           // mmap 模式下不能控制写盘顺序, 不使用日志
+    uint32_t page_size;     // 只在新建文件时使用, 已有的文件用文件头里记录的
+    uint32_t prefetch_pages; // 扫描提前读的叶子数, 0 表示不预读
+    bool compress;           // 新建文件时用压缩存放
+} DbOptions;
+
+// 输入里的一个词: 直接指向原来的字符串, 不复制也不改写
+typedef struct
+{
+    const char *start;
+    uint32_t length;
+} Token;
+
+// select/delete 的 where/limit 条件, 归一成 id 的闭区间
+typedef struct
+{
+    uint32_t lower;
+    uint32_t upper;
+    uint32_t limit;
+    uint32_t offset; // 先跳过区间里的这么多行
+    bool empty; // 条件互相矛盾, 不用访问表
+    int32_t column; // username = v 或 email = v 的等值条件, -1 表示没有
+    Token value;
+} KeyRange;
+
+/*
+A statement is parsed once into a plan. Every operand is either a literal
+(numbers already parsed, strings as tokens into the statement text) or a
+? parameter whose value is bound before each step, so running a prepared
+statement again does no parsing at all.
+*/
+#define STATEMENT_MAX_PARAMS 64
+#define STATEMENT_MAX_PREDICATES 16
+
+typedef enum
+{
+    PARAM_NUMBER,
+    PARAM_USERNAME,
+    PARAM_EMAIL
+} ParamKind;
+
+typedef struct
+{
+    ParamKind kind;
+    bool bound;
+    uint32_t number;
+    Token text; // 绑定的文本不复制, 调用者保证它在 step 之前有效
+} Param;
+
+typedef struct
+{
+    int32_t param; // ? 参数的下标, -1 表示字面量
+    uint32_t number;
+    Token text;
+} Operand;
+
+typedef struct
+{
+    Operand id;
+    Operand username;
+    Operand email;
+} InsertOperands;
+
+typedef enum
+{
+    PREDICATE_ID_EQ,
+    PREDICATE_ID_BETWEEN,
+    PREDICATE_ID_GT,
+    PREDICATE_ID_GE,
+    PREDICATE_ID_LT,
+    PREDICATE_ID_LE,
+    PREDICATE_COLUMN_EQ
+} PredicateOp;
+
+typedef struct
+{
+    PredicateOp op;
+    IndexColumn column; // PREDICATE_COLUMN_EQ 比较的列
+    Operand value;
+    Operand upper; // between 的上界
+} Predicate;
+
 typedef struct
 {
     StatementType type;
-    Row row_to_insert;
+    InsertOperands *rows; // insert 可以带多行, 每行是 id username email 三个词
+    uint32_t num_rows;
+    Predicate predicates[STATEMENT_MAX_PREDICATES];
+    uint32_t num_predicates;
+    bool has_limit;
+    Operand limit;
+    bool has_offset;
+    Operand offset;
+    bool count; // select count(*)
+    IndexColumn index_column; // create index 的列
+    Param params[STATEMENT_MAX_PARAMS];
+    uint32_t num_params;
+    char *sql; // db_prepare 保存的语句文本, 字面量 token 指向这里
 } Statement;
 
-// 表的内存结构
+// .prepare 起了名字的语句
+typedef struct PreparedStatement
+{
+    char *name;
+    Statement statement;
+    struct PreparedStatement *next;
+} PreparedStatement;
+
+typedef enum
+{
+    OUTPUT_TUPLE,  // (id, username, email )
+    OUTPUT_CSV,    // id,username,email
+    OUTPUT_BINARY  // id (4 字节小端) + 长度前缀的 username 和 email, 即页里存的原样字节
+} OutputMode;
+
+/*
+select output goes through a result writer instead of one printf per row:
+rows are formatted into a large reusable buffer which is flushed to the
+file descriptor with writev. With fd -1 the writer is a memory sink whose
+buffer grows instead, for callers that collect results themselves.
+*/
+// 几个 writer 按顺序共用一个 fd: 只有第 turn 个能写, 后面的缓冲满了就等它写完
+typedef struct
+{
+    pthread_cond_t changed;
+    uint32_t turn;
+} OutputTurn;
+
+typedef struct
+{
+    OutputMode mode;
+    int fd;
+    char *buffer;
+    size_t length;
+    size_t capacity;
+    pthread_mutex_t *lock; // 多个 writer 共用一个 fd 时, 每次 flush 在锁里完成
+    OutputTurn *order;     // 不为 NULL 时等轮到 position 再写
+    uint32_t position;
+} ResultWriter;
+
+/*
+B-tree and statement counters for .stats. Statement times go into log2
+histograms: bucket 0 is under 1 us, bucket i covers [2^(i-1), 2^i) us.
+*/
+typedef struct
+{
+    uint64_t leaf_splits;
+    uint64_t internal_splits;
+    uint64_t statements[STATEMENT_TYPE_COUNT];
+    uint64_t statement_ns[STATEMENT_TYPE_COUNT];
+    uint64_t histogram[STATEMENT_TYPE_COUNT][STATS_HISTOGRAM_BUCKETS];
+} TableStats;
+
+// 批里等着写进树的一行: key 和已经编码好的 value
 typedef struct
+{
+    uint32_t id;
+    uint32_t size;
+    uint8_t value[2 * sizeof(uint8_t) + COLUMN_USERNAME_SIZE + COLUMN_EMAIL_SIZE];
+} PendingRow;
+
+// 表的内存结构
+typedef struct Table
 {
     // uint32_t num_rows;
     Pager *pager;
     uint32_t root_page_num;
+    uint32_t index_roots[INDEX_COLUMN_COUNT]; // 二级索引的根页, 0 表示没有
+    ResultWriter output; // select 的结果写到这里
+    FILE *messages;      // 执行语句时的提示 (不是结果行), 默认 stdout, 服务模式下放进回复
+    uint32_t scan_threads; // 大于 1 时全表扫描分给多个线程
+    bool scan_unordered;   // 并行扫描时各线程的结果不按 key 排序直接输出
+    /*
+    insert batching: rows collect here and go into the tree sorted by key
+    in one pass. Outside begin/commit the batch is a single statement.
+    */
+    bool in_batch;
+    PendingRow *pending_rows;
+    uint32_t num_pending;
+    uint32_t pending_capacity;
+    uint64_t batch_duplicates; // 这个批里因为重复 key 被跳过的行
+    PreparedStatement *prepared;
+    Pager *snapshot_of; // 快照: 只读, 读的是这个 pager 最后一次提交时的状态
+    struct Table *snapshot; // 命令行 .snapshot 打开的快照, select 读它
+    TableStats stats;
+    FILE *stats_file;           // .stats dump: 每隔 stats_interval_ns 往这里追加一份统计
+    uint64_t stats_interval_ns;
+    uint64_t stats_last_dump;
 } Table;
 
 typedef struct
@@ -262,709 +988,7804 @@ typedef struct
     bool end_of_table;
 } Cursor;
 
-void *get_page(Pager *pager, uint32_t page_num)
+static uint32_t page_table_slot(Pager *pager, uint32_t page_num)
 {
-    if (page_num > TABLE_MAX_PAGES)
-    {
-        printf("Tried to fetch page number out of bounds. %d > %d\n", page_num,
-               TABLE_MAX_PAGES);
-        exit(EXIT_FAILURE);
-    }
+    return (page_num * 2654435761u) & pager->page_table_mask;
+}
 
-    if (pager->pages[page_num] == NULL) // 如果该页不存在则分配内存
+// 返回缓存该页的帧下标, 不在缓冲池中返回 PAGER_NO_FRAME
+uint32_t page_table_lookup(Pager *pager, uint32_t page_num)
+{
+    uint32_t slot = page_table_slot(pager, page_num);
+    while (pager->page_table[slot] != PAGER_NO_FRAME)
     {
-        void *page = malloc(PAGE_SIZE);
-        uint32_t num_pages = pager->file_length / PAGE_SIZE;
-        if (pager->file_length % PAGE_SIZE)
+        uint32_t frame_index = pager->page_table[slot];
+        if (pager->frames[frame_index].page_num == page_num)
         {
-            num_pages += 1;
+            return frame_index;
         }
+        slot = (slot + 1) & pager->page_table_mask;
+    }
+    return PAGER_NO_FRAME;
+}
 
-        if (page_num < num_pages) // 如果文件够大于页数，则从文件读入
-        {
-            lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-            ssize_t bytes_read = read(pager->file_descriptor, page, PAGE_SIZE);
-            if (bytes_read == -1)
-            {
-                printf("Error reading file: %d\n", errno);
-                exit(EXIT_FAILURE);
-            }
-        }
-        pager->pages[page_num] = page;
-        if (page_num >= pager->num_pages)
+void page_table_insert(Pager *pager, uint32_t page_num, uint32_t frame_index)
+{
+    uint32_t slot = page_table_slot(pager, page_num);
+    while (pager->page_table[slot] != PAGER_NO_FRAME)
+    {
+        slot = (slot + 1) & pager->page_table_mask;
+    }
+    pager->page_table[slot] = frame_index;
+}
+
+void page_table_remove(Pager *pager, uint32_t page_num)
+{
+    uint32_t mask = pager->page_table_mask;
+    uint32_t slot = page_table_slot(pager, page_num);
+    while (pager->frames[pager->page_table[slot]].page_num != page_num)
+    {
+        slot = (slot + 1) & mask;
+    }
+
+    // backward shift 删除: 把后面探测链上的项往前挪, 不留墓碑
+    uint32_t hole = slot;
+    uint32_t next = (hole + 1) & mask;
+    while (pager->page_table[next] != PAGER_NO_FRAME)
+    {
+        uint32_t frame_index = pager->page_table[next];
+        uint32_t home = page_table_slot(pager, pager->frames[frame_index].page_num);
+        if (((next - home) & mask) >= ((next - hole) & mask))
         {
-            pager->num_pages = page_num + 1;
+            pager->page_table[hole] = frame_index;
+            hole = next;
         }
+        next = (next + 1) & mask;
     }
-
-    return pager->pages[page_num];
+    pager->page_table[hole] = PAGER_NO_FRAME;
 }
 
-void print_row(Row *row)
+uint64_t monotonic_ns()
 {
-    printf("(%d, %s, %s )\n", row->id, row->username, row->email);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
 }
 
-// 将标量拷贝到内存的目的位置
-void serialize_row(Row *source, void *destination)
+void pager_note_written(Pager *pager, uint32_t first_page, uint32_t count)
 {
-    memcpy(destination + ID_OFFSET, &(source->id), ID_SIZE);
-    strncpy(destination + USERNAME_OFFSET, source->username, USERNAME_SIZE);
-    strncpy(destination + EMAIL_OFFSET, source->email, EMAIL_SIZE);
+    uint64_t end_of_run = ((uint64_t)first_page + count) * PAGE_SIZE;
+    pager->stats.bytes_written += (uint64_t)count * PAGE_SIZE;
+    if (end_of_run > pager->file_length)
+    {
+        pager->file_length = end_of_run;
+    }
 }
 
-void deserialize_row(void *source, Row *destination)
+void sync_file(int fd)
 {
-    memcpy(&(destination->id), source + ID_OFFSET, ID_SIZE);
-    memcpy(&(destination->username), source + USERNAME_OFFSET, USERNAME_SIZE);
-    memcpy(&(destination->email), source + EMAIL_OFFSET, EMAIL_SIZE);
+    if (fdatasync(fd) == -1)
+    {
+        printf("Error syncing file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
 }
 
-// 计算行在表内的位置
-void *cursor_value(Cursor *cursor)
+/*
+Page codec for compressed files, an LZ4-style block format: a sequence is
+a token byte (literal count in the high 4 bits, match length - 4 in the
+low 4 bits, 15 meaning more length bytes follow, each 255 adding to it),
+the literals, a 2-byte little-endian offset back into the output and the
+extra match length bytes. The last sequence has literals only. Matches
+are found through a hash of the next 4 bytes, so it is one pass with no
+entropy coding: pages compress at memory speed and nothing is linked in.
+*/
+uint32_t lz_write_length(uint8_t *out, uint32_t out_pos, uint32_t length)
 {
-    // uint32_t row_num = cursor->row_num;
-    uint32_t page_num = cursor->page_num;
-    void *page = get_page(cursor->table->pager, page_num);
-    // uint32_t row_offset = row_num % ROWS_PER_PAGE; // 行是所在那一页的第几行
-    // uint32_t byte_offset = row_offset * ROW_SIZE;  // 行在那一页的byte位置
-    // return page + byte_offset;                     // 行在整个表的位置
-    return leaf_node_value(page, cursor->cell_num);
+    while (length >= 255)
+    {
+        out[out_pos++] = 255;
+        length -= 255;
+    }
+    out[out_pos++] = length;
+    return out_pos;
 }
 
-void cursor_advance(Cursor *cursor)
+// 写一个序列; 输出放不下时返回 0
+uint32_t lz_emit(uint8_t *out, uint32_t out_pos, uint32_t capacity, const uint8_t *literals,
+                 uint32_t literal_length, uint32_t offset, uint32_t match_length)
 {
-    // cursor->row_num += 1;
-    // if (cursor->row_num >= cursor->table->num_rows)
-    uint32_t page_num = cursor->page_num;
-    void *node = get_page(cursor->table->pager, page_num);
+    uint32_t needed = 1 + literal_length + literal_length / 255 + 1;
+    if (match_length > 0)
+    {
+        needed += 2 + (match_length - LZ_MIN_MATCH) / 255 + 1;
+    }
+    if (out_pos + needed > capacity)
+    {
+        return 0;
+    }
+    uint8_t *token = out + out_pos++;
+    *token = (literal_length < 15 ? literal_length : 15) << 4;
+    if (literal_length >= 15)
+    {
+        out_pos = lz_write_length(out, out_pos, literal_length - 15);
+    }
+    memcpy(out + out_pos, literals, literal_length);
+    out_pos += literal_length;
+    if (match_length > 0)
+    {
+        out[out_pos++] = offset & 0xff;
+        out[out_pos++] = offset >> 8;
+        uint32_t extra = match_length - LZ_MIN_MATCH;
+        *token |= extra < 15 ? extra : 15;
+        if (extra >= 15)
+        {
+            out_pos = lz_write_length(out, out_pos, extra - 15);
+        }
+    }
+    return out_pos;
+}
 
-    cursor->cell_num += 1;
-    if (cursor->cell_num >= *leaf_node_num_cells(node))
+// 压缩 length 字节到 out; 结果超过 capacity 时返回 0, 调用方原样存放
+uint32_t lz_compress(const uint8_t *in, uint32_t length, uint8_t *out, uint32_t capacity)
+{
+    uint32_t table[1 << LZ_HASH_BITS]; // 位置 + 1, 0 表示空
+    memset(table, 0, sizeof(table));
+    uint32_t anchor = 0;
+    uint32_t pos = 0;
+    uint32_t out_pos = 0;
+    while (pos + LZ_MIN_MATCH <= length)
     {
-        // cursor->end_of_table = true;
-        uint32_t next_page_num = *leaf_node_next_leaf(node);
-        if (next_page_num == 0)
+        uint32_t sequence;
+        memcpy(&sequence, in + pos, sizeof(sequence));
+        uint32_t hash = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+        uint32_t candidate = table[hash];
+        table[hash] = pos + 1;
+        if (candidate == 0 || pos - (candidate - 1) > LZ_MAX_OFFSET ||
+            memcmp(in + candidate - 1, in + pos, LZ_MIN_MATCH) != 0)
         {
-            cursor->end_of_table = true;
+            // 很久没找到重复时步子迈大一点, 不可压缩的数据很快就过去
+            pos += 1 + ((pos - anchor) >> 6);
+            continue;
         }
-        else
+        candidate--;
+        uint32_t match_length = LZ_MIN_MATCH;
+        while (pos + match_length < length && in[candidate + match_length] == in[pos + match_length])
         {
-            cursor->page_num = next_page_num;
-            cursor->cell_num = 0;
+            match_length++;
         }
+        out_pos = lz_emit(out, out_pos, capacity, in + anchor, pos - anchor, pos - candidate, match_length);
+        if (out_pos == 0)
+        {
+            return 0;
+        }
+        pos += match_length;
+        anchor = pos;
     }
+    return lz_emit(out, out_pos, capacity, in + anchor, length - anchor, 0, 0);
 }
 
-void pager_flush(Pager *pager, uint32_t page_num)
+bool lz_read_length(const uint8_t *in, uint32_t length, uint32_t *in_pos, uint32_t *value)
 {
-    if (pager->pages[page_num] == NULL)
+    uint8_t byte;
+    do
     {
-        printf("Tried to flush null page\n");
-        exit(EXIT_FAILURE);
-    }
+        if (*in_pos >= length || *value > PAGE_SIZE_MAX)
+        {
+            return false;
+        }
+        byte = in[(*in_pos)++];
+        *value += byte;
+    } while (byte == 255);
+    return true;
+}
 
-    off_t offset = lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-    if (offset == -1)
+// 解压到正好 out_length 字节; 数据不对时返回 false, 不会越界
+bool lz_decompress(const uint8_t *in, uint32_t length, uint8_t *out, uint32_t out_length)
+{
+    uint32_t in_pos = 0;
+    uint32_t out_pos = 0;
+    while (in_pos < length)
     {
-        printf("Error seeking: %d\n", errno);
-        exit(EXIT_FAILURE);
+        uint8_t token = in[in_pos++];
+        uint32_t literal_length = token >> 4;
+        if (literal_length == 15 && !lz_read_length(in, length, &in_pos, &literal_length))
+        {
+            return false;
+        }
+        if (literal_length > length - in_pos || literal_length > out_length - out_pos)
+        {
+            return false;
+        }
+        memcpy(out + out_pos, in + in_pos, literal_length);
+        in_pos += literal_length;
+        out_pos += literal_length;
+        if (in_pos == length)
+        {
+            break; // 最后一个序列只有字面量
+        }
+
+        if (length - in_pos < 2)
+        {
+            return false;
+        }
+        uint32_t offset = in[in_pos] | (uint32_t)in[in_pos + 1] << 8;
+        in_pos += 2;
+        uint32_t match_length = token & 15;
+        if (match_length == 15 && !lz_read_length(in, length, &in_pos, &match_length))
+        {
+            return false;
+        }
+        match_length += LZ_MIN_MATCH;
+        if (offset == 0 || offset > out_pos || match_length > out_length - out_pos)
+        {
+            return false;
+        }
+        if (offset >= match_length)
+        {
+            memcpy(out + out_pos, out + out_pos - offset, match_length);
+        }
+        else
+        {
+            // 和自己重叠的匹配 (比如一串相同的字节) 只能一个一个拷
+            for (uint32_t i = 0; i < match_length; i++)
+            {
+                out[out_pos + i] = out[out_pos + i - offset];
+            }
+        }
+        out_pos += match_length;
     }
-    ssize_t bytes_written = write(pager->file_descriptor, pager->pages[page_num], PAGE_SIZE);
+    return out_pos == out_length;
+}
+
+// 压缩文件里映射块和目录的位置
+uint32_t compress_slots_per_chunk() { return PAGE_SIZE / sizeof(PageSlot); }
+uint32_t compress_max_chunks() { return COMPRESS_DIRECTORY_PAGES * PAGE_SIZE / sizeof(uint64_t); }
+uint64_t compress_data_start() { return (uint64_t)(1 + COMPRESS_DIRECTORY_PAGES) * PAGE_SIZE; }
 
-    if (bytes_written == -1)
+// 在文件末尾分配 sectors 个扇区
+uint64_t pager_compress_allocate(Pager *pager, uint32_t sectors)
+{
+    uint64_t offset = (pager->file_length + COMPRESS_SECTOR - 1) / COMPRESS_SECTOR * COMPRESS_SECTOR;
+    pager->file_length = offset + (uint64_t)sectors * COMPRESS_SECTOR;
+    return offset;
+}
+
+void slot_list_push(SlotList *list, uint32_t sector)
+{
+    if (list->count == list->capacity)
     {
-        printf("Error writing: %d\n", errno);
-        exit(EXIT_FAILURE);
+        list->capacity = list->capacity == 0 ? 16 : 2 * list->capacity;
+        list->sectors = realloc(list->sectors, sizeof(uint32_t) * list->capacity);
     }
+    list->sectors[list->count++] = sector;
 }
 
-void db_close(Table *table)
+// 把从 sector 起的 sectors 个扇区放进 lists, 比一页长的拆成几段
+void slot_lists_add(SlotList *lists, uint32_t sector, uint64_t sectors)
 {
-    Pager *pager = table->pager;
-    // uint32_t num_full_pages = table->num_rows / ROWS_PER_PAGE; // 完整的页数
+    while (sectors > 0)
+    {
+        uint32_t length = sectors < PAGE_SIZE / COMPRESS_SECTOR ? (uint32_t)sectors : PAGE_SIZE / COMPRESS_SECTOR;
+        slot_list_push(&lists[length], sector);
+        sector += length;
+        sectors -= length;
+    }
+}
 
-    for (uint32_t i = 0; i < pager->num_pages; i++)
+/*
+find a slot of exactly sectors sectors: a free slot of that size, else
+the front of the smallest larger one with the rest going back to the
+free lists, else new space at the end of the file. Returns its first
+sector.
+*/
+uint32_t pager_slot_allocate(Pager *pager, uint32_t sectors)
+{
+    for (uint32_t size = sectors; size <= PAGE_SIZE / COMPRESS_SECTOR; size++)
     {
-        if (pager->pages[i] == NULL)
+        SlotList *list = &pager->free_slots[size];
+        if (list->count > 0)
         {
-            continue;
+            uint32_t sector = list->sectors[--list->count];
+            slot_lists_add(pager->free_slots, sector + sectors, size - sectors);
+            return sector;
         }
-        pager_flush(pager, i);
-        free(pager->pages[i]);
-        pager->pages[i] = NULL;
     }
+    return pager_compress_allocate(pager, sectors) / COMPRESS_SECTOR;
+}
 
-    int result = close(pager->file_descriptor);
-    if (result == -1)
+/*
+old slots become free once the page map on disk no longer points at
+them: until then a crash would bring back a map whose pages live there.
+Called after the map is written and synced.
+*/
+void pager_slots_reuse(Pager *pager)
+{
+    for (uint32_t size = 1; size <= PAGE_SIZE / COMPRESS_SECTOR; size++)
     {
-        printf("Error closing db file.\n");
-        exit(EXIT_FAILURE);
+        SlotList *released = &pager->released_slots[size];
+        for (uint32_t i = 0; i < released->count; i++)
+        {
+            slot_list_push(&pager->free_slots[size], released->sectors[i]);
+        }
+        released->count = 0;
     }
+}
 
-    for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) // TODO 重复一次？？？
+// 清空 (clear) 或释放 (free) 两组空闲槽
+void pager_slots_reset(Pager *pager, bool free_memory)
+{
+    if (pager->free_slots == NULL)
     {
-        void *page = pager->pages[i];
-        if (page)
+        return;
+    }
+    for (uint32_t size = 0; size <= PAGE_SIZE / COMPRESS_SECTOR; size++)
+    {
+        pager->free_slots[size].count = 0;
+        pager->released_slots[size].count = 0;
+        if (free_memory)
         {
-            free(page);
-            pager->pages[i] = NULL;
+            free(pager->free_slots[size].sectors);
+            free(pager->released_slots[size].sectors);
         }
     }
-    free(pager);
-    free(table);
+    if (free_memory)
+    {
+        free(pager->free_slots);
+        free(pager->released_slots);
+    }
 }
 
-Pager *pager_open(const char *filename)
+// 压缩文件的页映射能不能放下 num_pages 页; 其他文件没有这个上限
+bool pager_map_has_room(Pager *pager, uint64_t num_pages)
 {
-    int fd = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+    return !pager->compressed || num_pages <= (uint64_t)compress_max_chunks() * compress_slots_per_chunk();
+}
 
-    if (fd == 1)
+// 让页映射能放下 page_num; 写之前 table_has_room 已经挡住了装不下的语句
+void pager_map_reserve(Pager *pager, uint32_t page_num)
+{
+    uint32_t chunks = page_num / compress_slots_per_chunk() + 1;
+    if (chunks <= pager->map_chunks)
     {
-        printf("Unable to open file \n");
-        exit(EXIT_FAILURE);
+        return;
     }
-
-    off_t file_length = lseek(fd, 0, SEEK_END);
-
-    Pager *pager = malloc(sizeof(Pager));
-    pager->file_descriptor = fd;
-    pager->file_length = file_length;
-    pager->num_pages = (file_length / PAGE_SIZE);
-
-    if (file_length % PAGE_SIZE != 0)
+    if (chunks > compress_max_chunks())
     {
-        printf("db file is not a whole number of pages. Corrupt file.\n");
+        printf("Compressed db file is full: its page map holds %u pages.\n",
+               compress_max_chunks() * compress_slots_per_chunk());
         exit(EXIT_FAILURE);
     }
-
-    for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++)
+    pager->slots = realloc(pager->slots, (size_t)chunks * PAGE_SIZE);
+    memset(pager->slots + (size_t)pager->map_chunks * compress_slots_per_chunk(), 0,
+           (size_t)(chunks - pager->map_chunks) * PAGE_SIZE);
+    pager->chunk_dirty = realloc(pager->chunk_dirty, sizeof(bool) * chunks);
+    for (uint32_t i = pager->map_chunks; i < chunks; i++)
     {
-        pager->pages[i] = NULL;
+        pager->chunk_dirty[i] = false;
     }
-    return pager;
+    pager->map_chunks = chunks;
 }
 
-Table *db_open(const char *filename)
+/*
+write one page of a compressed file. It is rewritten in place when the
+new image fits its slot, otherwise moved to a free slot of exactly its
+size (see pager_slot_allocate) and the old slot is released. Pages that
+do not shrink by at least a sector are stored as they are. Called with
+pager->lock held or single-threaded.
+*/
+void pager_write_compressed(Pager *pager, uint32_t page_num, void *data)
 {
-    Pager *pager = pager_open(filename);
-
-    Table *table = (Table *)malloc(sizeof(Table));
-
-    table->pager = pager;
-
-    table->root_page_num = 0;
+    const void *stored = data;
+    uint32_t stored_length = PAGE_SIZE;
+    off_t offset = 0;
+    if (page_num != 0) // 第 0 页永远原样放在文件开头
+    {
+        pager_map_reserve(pager, page_num);
+        uint32_t length = lz_compress(data, PAGE_SIZE, pager->compress_buffer, PAGE_SIZE - COMPRESS_SECTOR);
+        if (length != 0)
+        {
+            stored = pager->compress_buffer;
+            stored_length = length;
+        }
+        uint32_t sectors = (stored_length + COMPRESS_SECTOR - 1) / COMPRESS_SECTOR;
+        PageSlot *slot = &pager->slots[page_num];
+        if (slot->sector == 0 || slot->capacity < sectors)
+        {
+            if (slot->sector != 0)
+            {
+                slot_lists_add(pager->released_slots, slot->sector, slot->capacity);
+            }
+            slot->sector = pager_slot_allocate(pager, sectors);
+            slot->capacity = sectors;
+        }
+        slot->length = length;
+        pager->chunk_dirty[page_num / compress_slots_per_chunk()] = true;
+        pager->map_dirty = true;
+        offset = (off_t)slot->sector * COMPRESS_SECTOR;
+    }
 
-    if (pager->num_pages == 0)
+    if (pwrite(pager->file_descriptor, stored, stored_length, offset) != (ssize_t)stored_length)
     {
-        void *root_node = get_page(pager, 0);
-        initialize_leaf_node(root_node);
+        printf("Error writing: %d\n", errno);
+        exit(EXIT_FAILURE);
     }
-    return table;
+    pager->stats.bytes_written += stored_length;
 }
 
-InputBuffer *new_input_buffer()
+/*
+write the page map chunks changed since the last call, then the chunk
+directory if a chunk was placed for the first time. New chunks are synced
+before the directory points at them. Caller holds pager->lock.
+*/
+void pager_write_map(Pager *pager)
 {
-    InputBuffer *input_buffer = (InputBuffer *)malloc(sizeof(InputBuffer));
-    input_buffer->buffer = NULL;
-    input_buffer->buffer_length = 0;
-    input_buffer->input_length = 0;
-    return input_buffer;
+    if (!pager->map_dirty)
+    {
+        return;
+    }
+    bool directory_changed = false;
+    for (uint32_t i = 0; i < pager->map_chunks; i++)
+    {
+        if (!pager->chunk_dirty[i])
+        {
+            continue;
+        }
+        if (pager->chunk_offsets[i] == 0)
+        {
+            pager->chunk_offsets[i] = (uint64_t)pager_slot_allocate(pager, PAGE_SIZE / COMPRESS_SECTOR) * COMPRESS_SECTOR;
+            directory_changed = true;
+        }
+        if (pwrite(pager->file_descriptor, pager->slots + (size_t)i * compress_slots_per_chunk(), PAGE_SIZE,
+                   pager->chunk_offsets[i]) != PAGE_SIZE)
+        {
+            printf("Error writing: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        pager->stats.bytes_written += PAGE_SIZE;
+        pager->chunk_dirty[i] = false;
+    }
+    if (directory_changed)
+    {
+        if (pager->sync_mode != SYNC_OFF)
+        {
+            sync_file(pager->file_descriptor);
+        }
+        size_t directory_size = (size_t)COMPRESS_DIRECTORY_PAGES * PAGE_SIZE;
+        if (pwrite(pager->file_descriptor, pager->chunk_offsets, directory_size, PAGE_SIZE) !=
+            (ssize_t)directory_size)
+        {
+            printf("Error writing: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        pager->stats.bytes_written += directory_size;
+    }
+    pager->map_dirty = false;
 }
 
-void print_constants()
+void pager_write_page(Pager *pager, uint32_t page_num, void *data)
 {
-    printf("ROW_SIZE: %d\n", ROW_SIZE);
-    printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
-    printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
-    printf("LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
-    printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
-    printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
+    if (pager->compressed)
+    {
+        pager_write_compressed(pager, page_num, data);
+        return;
+    }
+    ssize_t bytes_written = pwrite(pager->file_descriptor, data, PAGE_SIZE,
+                                   (off_t)page_num * PAGE_SIZE);
+
+    if (bytes_written != PAGE_SIZE)
+    {
+        printf("Error writing: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    pager_note_written(pager, page_num, 1);
 }
 
-uint32_t get_unused_page_num(Pager *pager)
+// 从 offset 开始写完所有 iovec, 处理短写
+void pwritev_all(int fd, struct iovec *iov, int iovcnt, off_t offset)
 {
-    return pager->num_pages;
+    while (iovcnt > 0)
+    {
+        ssize_t bytes_written = pwritev(fd, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX, offset);
+        if (bytes_written <= 0)
+        {
+            printf("Error writing: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        offset += bytes_written;
+        while (iovcnt > 0 && (size_t)bytes_written >= iov->iov_len)
+        {
+            bytes_written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base += bytes_written;
+            iov->iov_len -= bytes_written;
+        }
+    }
 }
 
-void print_prompt() { printf("db > "); }
-
-void read_input(InputBuffer *input_buffer)
+// 把一段连续页用一次 pwritev 写出去
+void pager_write_run(Pager *pager, uint32_t first_page, struct iovec *iov, int iovcnt)
 {
-    ssize_t bytes_read =
-        getline(&(input_buffer->buffer), &(input_buffer->buffer_length), stdin);
+    if (pager->compressed)
+    {
+        // 压缩后每页大小不同, 槽也不一定相邻, 只能一页一页写
+        for (int i = 0; i < iovcnt; i++)
+        {
+            pager_write_compressed(pager, first_page + i, iov[i].iov_base);
+        }
+        return;
+    }
+    pwritev_all(pager->file_descriptor, iov, iovcnt, (off_t)first_page * PAGE_SIZE);
+    pager_note_written(pager, first_page, iovcnt);
+}
 
-    if (bytes_read <= 0)
+void pager_flush(Pager *pager, uint32_t page_num)
+{
+    uint32_t frame_index = page_table_lookup(pager, page_num);
+    if (frame_index == PAGER_NO_FRAME)
     {
-        printf("Error reading input\n");
+        printf("Tried to flush page %d that is not in the buffer pool\n", page_num);
         exit(EXIT_FAILURE);
     }
 
-    input_buffer->input_length = bytes_read - 1;
-    input_buffer->buffer[bytes_read - 1] = 0;
+    Frame *frame = &pager->frames[frame_index];
+    pager_write_page(pager, page_num, frame->data);
+    frame->dirty = false;
 }
 
-void close_input_buffer(InputBuffer *input_buffer)
+typedef struct
 {
-    free(input_buffer->buffer);
-    free(input_buffer);
+    uint32_t page_num;
+    uint32_t frame_index;
+} DirtyPage;
+
+int compare_dirty_pages(const void *a, const void *b)
+{
+    uint32_t left = ((const DirtyPage *)a)->page_num;
+    uint32_t right = ((const DirtyPage *)b)->page_num;
+    return (left > right) - (left < right);
 }
 
-MetaCommandResult do_meta_command(InputBuffer *input_buffer, Table *table)
+/*
+Write back up to max_pages unpinned dirty frames. They are sorted by page
+number and adjacent pages go out together in one pwritev. Returns the
+number of pages written. Caller holds pager->lock.
+*/
+uint32_t pager_write_back(Pager *pager, uint32_t max_pages)
 {
-    if (strcmp(input_buffer->buffer, ".exit") == 0)
+    DirtyPage *dirty = malloc(sizeof(DirtyPage) * pager->num_frames);
+    uint32_t num_dirty = 0;
+    for (uint32_t i = 0; i < pager->num_frames && num_dirty < max_pages; i++)
     {
-        db_close(table);
-        exit(EXIT_SUCCESS);
+        Frame *frame = &pager->frames[i];
+        if (frame->page_num != INVALID_PAGE_NUM && frame->dirty && frame->pin_count == 0)
+        {
+            dirty[num_dirty].page_num = frame->page_num;
+            dirty[num_dirty].frame_index = i;
+            num_dirty++;
+        }
     }
-    else if (strcmp(input_buffer->buffer, ".constants") == 0)
+    qsort(dirty, num_dirty, sizeof(DirtyPage), compare_dirty_pages);
+
+    struct iovec iov[IOV_MAX];
+    uint32_t run_start = 0;
+    while (run_start < num_dirty)
     {
-        printf("Constants:\n");
-        print_constants();
-        return MATE_COMMAND_SUCCESS;
+        uint32_t run_length = 0;
+        while (run_start + run_length < num_dirty && run_length < IOV_MAX &&
+               dirty[run_start + run_length].page_num == dirty[run_start].page_num + run_length)
+        {
+            Frame *frame = &pager->frames[dirty[run_start + run_length].frame_index];
+            iov[run_length].iov_base = frame->data;
+            iov[run_length].iov_len = PAGE_SIZE;
+            frame->dirty = false;
+            run_length++;
+        }
+        pager_write_run(pager, dirty[run_start].page_num, iov, run_length);
+        run_start += run_length;
     }
-    else
+    if (pager->compressed)
     {
-        return META_COMMAND_UNRECOGNIZED_COMMAND;
+        pager_write_map(pager);
+        pager_slots_reuse(pager); // 没有日志时崩溃本来就不安全, 旧槽马上就能重用
     }
+
+    free(dirty);
+    return num_dirty;
 }
 
-PrepareResult prepare_insert(InputBuffer *input_buffer, Statement *statement)
+// 和 SQLite 一样的 32 位字校验和, 带上前一个值就串成了一条链
+uint64_t wal_checksum(uint64_t seed, const void *data, uint32_t length)
 {
-    statement->type = STATEMENT_INSERT;
-    char *keyword = strtok(input_buffer->buffer, " ");
-    char *id_string = strtok(NULL, " ");
-    char *username = strtok(NULL, " ");
-    char *email = strtok(NULL, " ");
-    if (keyword == NULL || id_string == NULL || username == NULL || email == NULL)
-    {
-        return PREPARE_SYNTAX_ERROR;
-    }
-    int id = atoi(id_string);
-    if (strlen(username) > COLUMN_EMAIL_SIZE)
+    uint32_t s1 = (uint32_t)seed;
+    uint32_t s2 = (uint32_t)(seed >> 32);
+    const uint8_t *bytes = data;
+    for (uint32_t i = 0; i + 4 <= length; i += 4)
     {
-        return PREPARE_STRING_TOO_LONG;
+        uint32_t word;
+        memcpy(&word, bytes + i, sizeof(word));
+        s1 += word + s2;
+        s2 += word + s1;
     }
-    if (strlen(email) > COLUMN_EMAIL_SIZE)
+    return ((uint64_t)s2 << 32) | s1;
+}
+
+/*
+WAL frame header: page number, database size in pages (non-zero only on
+a commit record), salt of the current log generation, data size (a page,
+or 0 for a commit record) and the running checksum over every frame so far.
+*/
+void wal_frame_header(Pager *pager, uint8_t *header, uint32_t page_num, uint32_t commit_pages, void *data)
+{
+    uint32_t data_size = data == NULL ? 0 : PAGE_SIZE;
+    memcpy(header, &page_num, 4);
+    memcpy(header + 4, &commit_pages, 4);
+    memcpy(header + 8, &pager->wal_salt, 4);
+    memcpy(header + 12, &data_size, 4);
+    uint64_t checksum = wal_checksum(pager->wal_checksum, header, 16);
+    if (data != NULL)
     {
-        return PREPARE_STRING_TOO_LONG;
+        checksum = wal_checksum(checksum, data, PAGE_SIZE);
     }
-    statement->row_to_insert.id = id;
-    strcpy(statement->row_to_insert.username, username);
-    strcpy(statement->row_to_insert.email, email);
-
-    return PREPARE_SUCCESS;
+    memcpy(header + 16, &checksum, 8);
+    pager->wal_checksum = checksum;
 }
 
-NodeType get_node_type(void *node)
+void wal_index_clear(Pager *pager)
 {
-    uint8_t value = *((uint8_t *)(node + NODE_TYPE_OFFSET));
-    return (NodeType)value;
+    for (uint32_t i = 0; i <= pager->wal_index_mask; i++)
+    {
+        pager->wal_index_pages[i] = INVALID_PAGE_NUM;
+    }
+    pager->wal_index_count = 0;
 }
 
-uint32_t get_node_max_key(void *node)
+uint64_t wal_index_lookup(Pager *pager, uint32_t page_num)
 {
-    switch (get_node_type(node))
+    uint32_t slot = (page_num * 2654435761u) & pager->wal_index_mask;
+    while (pager->wal_index_pages[slot] != INVALID_PAGE_NUM)
     {
-    case NODE_INTERNAL:
-        return *internal_node_key(node, *internal_node_num_keys(node) - 1);
-
-    case NODE_LEAF:
-        return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+        if (pager->wal_index_pages[slot] == page_num)
+        {
+            return pager->wal_index_offsets[slot];
+        }
+        slot = (slot + 1) & pager->wal_index_mask;
     }
+    return 0;
 }
 
-uint32_t *node_parent(void *node) { return node + PARENT_POINTER_OFFSET; }
+void wal_index_set(Pager *pager, uint32_t page_num, uint64_t offset);
 
-uint32_t internal_node_find_child(void *node, uint32_t key)
+// 把哈希表重建成 size 个槽; 位置为 0 的项 (回滚掉的页) 顺便去掉
+void wal_index_rebuild(Pager *pager, uint32_t size)
 {
-    uint32_t num_keys = *internal_node_num_keys(node);
-
-    uint32_t min_index = 0;
-    uint32_t max_index = num_keys;
-    while (min_index != max_index)
+    uint32_t old_size = pager->wal_index_mask + 1;
+    uint32_t *old_pages = pager->wal_index_pages;
+    uint64_t *old_offsets = pager->wal_index_offsets;
+    pager->wal_index_pages = malloc(sizeof(uint32_t) * size);
+    pager->wal_index_offsets = malloc(sizeof(uint64_t) * size);
+    pager->wal_index_mask = size - 1;
+    wal_index_clear(pager);
+    for (uint32_t i = 0; i < old_size; i++)
     {
-        uint32_t index = (min_index + max_index) / 2;
-        uint32_t key_to_right = *internal_node_key(node, index);
-        if (key_to_right >= key)
+        if (old_pages[i] != INVALID_PAGE_NUM && old_offsets[i] != 0)
         {
-            max_index = index;
+            wal_index_set(pager, old_pages[i], old_offsets[i]);
+        }
+    }
+    free(old_pages);
+    free(old_offsets);
+}
+
+// 装载因子超过一半就把哈希表扩大一倍
+void wal_index_grow(Pager *pager)
+{
+    wal_index_rebuild(pager, 2 * (pager->wal_index_mask + 1));
+}
+
+// offset 是页数据在日志里的位置, 不是帧头的位置
+void wal_index_set(Pager *pager, uint32_t page_num, uint64_t offset)
+{
+    uint32_t slot = (page_num * 2654435761u) & pager->wal_index_mask;
+    while (pager->wal_index_pages[slot] != INVALID_PAGE_NUM)
+    {
+        if (pager->wal_index_pages[slot] == page_num)
+        {
+            pager->wal_index_offsets[slot] = offset;
+            return;
+        }
+        slot = (slot + 1) & pager->wal_index_mask;
+    }
+    pager->wal_index_pages[slot] = page_num;
+    pager->wal_index_offsets[slot] = offset;
+    pager->wal_index_count++;
+    if (2 * pager->wal_index_count > pager->wal_index_mask + 1)
+    {
+        wal_index_grow(pager);
+    }
+}
+
+// 清空日志, 换一个新的 salt 写日志头
+void wal_reset(Pager *pager)
+{
+    pager->wal_salt = pager->wal_salt * 1103515245u + 12345u;
+    pager->wal_checksum = pager->wal_salt;
+    pager->commit_checksum = pager->wal_checksum;
+    pager->wal_length = WAL_HEADER_SIZE;
+    pager->wal_frames = 0;
+    pager->wal_uncommitted = 0;
+    pager->wal_undo_count = 0;
+    wal_index_clear(pager);
+
+    uint32_t header[4] = {WAL_MAGIC, PAGE_SIZE, pager->wal_salt, 0};
+    if (ftruncate(pager->wal_fd, 0) == -1 ||
+        pwrite(pager->wal_fd, header, WAL_HEADER_SIZE, 0) != WAL_HEADER_SIZE)
+    {
+        printf("Error resetting wal: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// 淘汰还没提交的脏页时写进日志, 不带提交标记. Caller holds pager->lock.
+void wal_append_page(Pager *pager, uint32_t page_num, void *data)
+{
+    uint8_t header[WAL_FRAME_HEADER_SIZE];
+    wal_frame_header(pager, header, page_num, 0, data);
+    struct iovec iov[2] = {{header, WAL_FRAME_HEADER_SIZE}, {data, PAGE_SIZE}};
+    pwritev_all(pager->wal_fd, iov, 2, pager->wal_length);
+    if (pager->wal_undo_count == pager->wal_undo_capacity)
+    {
+        pager->wal_undo_capacity = pager->wal_undo_capacity == 0 ? 64 : 2 * pager->wal_undo_capacity;
+        pager->wal_undo = realloc(pager->wal_undo, sizeof(WalUndo) * pager->wal_undo_capacity);
+    }
+    pager->wal_undo[pager->wal_undo_count].page_num = page_num;
+    pager->wal_undo[pager->wal_undo_count].committed_offset = wal_index_lookup(pager, page_num);
+    pager->wal_undo_count++;
+    wal_index_set(pager, page_num, pager->wal_length + WAL_FRAME_HEADER_SIZE);
+    pager->wal_length += WAL_FRAME_HEADER_SIZE + PAGE_SIZE;
+    pager->stats.wal_bytes_written += WAL_FRAME_HEADER_SIZE + PAGE_SIZE;
+    pager->wal_frames++;
+    pager->wal_uncommitted++;
+}
+
+void pager_prefetch_drain(Pager *pager);
+
+/*
+mmap mode has no log, so a commit can only ask the kernel to write the
+mapped pages back: started in the background under .sync normal, waited
+for and followed by fdatasync under .sync full.
+*/
+void pager_sync_mapped(Pager *pager)
+{
+    if (pager->mode != PAGER_MODE_MMAP || pager->sync_mode == SYNC_OFF || pager->map_length == 0)
+    {
+        return;
+    }
+    if (msync(pager->map_base, pager->map_length, pager->sync_mode == SYNC_FULL ? MS_SYNC : MS_ASYNC) == -1)
+    {
+        printf("Error syncing file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    if (pager->sync_mode == SYNC_FULL)
+    {
+        sync_file(pager->file_descriptor);
+    }
+}
+
+/*
+Commit: log every dirty frame, followed by a commit record, with one
+pwritev. Pages evicted earlier in the statement are already in the log
+and are covered by the same commit record. In normal mode the
+fdatasync is left to the background thread, so all commits in one
+interval share a single sync (group commit).
+*/
+void pager_commit(Pager *pager)
+{
+    if (pager->wal_fd == -1)
+    {
+        pager_sync_mapped(pager);
+        return;
+    }
+    pthread_mutex_lock(&pager->lock);
+    DirtyPage *dirty = malloc(sizeof(DirtyPage) * pager->num_frames);
+    uint32_t num_dirty = 0;
+    for (uint32_t i = 0; i < pager->num_frames; i++)
+    {
+        Frame *frame = &pager->frames[i];
+        if (frame->page_num != INVALID_PAGE_NUM && frame->dirty)
+        {
+            dirty[num_dirty].page_num = frame->page_num;
+            dirty[num_dirty].frame_index = i;
+            num_dirty++;
+        }
+    }
+    if (num_dirty == 0 && pager->wal_uncommitted == 0)
+    {
+        free(dirty);
+        pthread_mutex_unlock(&pager->lock);
+        return;
+    }
+    qsort(dirty, num_dirty, sizeof(DirtyPage), compare_dirty_pages);
+
+    uint8_t *headers = malloc(WAL_FRAME_HEADER_SIZE * (num_dirty + 1));
+    struct iovec *iov = malloc(sizeof(struct iovec) * (2 * num_dirty + 1));
+    uint64_t offset = pager->wal_length;
+    for (uint32_t i = 0; i < num_dirty; i++)
+    {
+        Frame *frame = &pager->frames[dirty[i].frame_index];
+        uint8_t *header = headers + i * WAL_FRAME_HEADER_SIZE;
+        wal_frame_header(pager, header, frame->page_num, 0, frame->data);
+        iov[2 * i].iov_base = header;
+        iov[2 * i].iov_len = WAL_FRAME_HEADER_SIZE;
+        iov[2 * i + 1].iov_base = frame->data;
+        iov[2 * i + 1].iov_len = PAGE_SIZE;
+        wal_index_set(pager, frame->page_num, offset + WAL_FRAME_HEADER_SIZE);
+        offset += WAL_FRAME_HEADER_SIZE + PAGE_SIZE;
+        frame->dirty = false;
+    }
+    uint8_t *commit = headers + num_dirty * WAL_FRAME_HEADER_SIZE;
+    wal_frame_header(pager, commit, INVALID_PAGE_NUM, pager->num_pages, NULL);
+    iov[2 * num_dirty].iov_base = commit;
+    iov[2 * num_dirty].iov_len = WAL_FRAME_HEADER_SIZE;
+    offset += WAL_FRAME_HEADER_SIZE;
+
+    pwritev_all(pager->wal_fd, iov, 2 * num_dirty + 1, pager->wal_length);
+    pager->stats.wal_bytes_written += offset - pager->wal_length;
+    pager->wal_length = offset;
+    pager->wal_frames += num_dirty;
+    pager->wal_uncommitted = 0;
+    pager->wal_undo_count = 0;
+    pager->commit_checksum = pager->wal_checksum;
+    pager->commit_num_pages = pager->num_pages;
+    if (pager->sync_mode == SYNC_FULL)
+    {
+        sync_file(pager->wal_fd);
+    }
+    else if (pager->sync_mode == SYNC_NORMAL)
+    {
+        pager->wal_unsynced = true;
+    }
+    free(iov);
+    free(headers);
+    free(dirty);
+    pthread_mutex_unlock(&pager->lock);
+}
+
+/*
+Rollback: forget every change since the last commit. All frames are
+dropped unwritten (a clean one may have been read back from an
+uncommitted log frame), pages evicted into the log since the commit point
+at their committed frames again and the log is cut back to the commit
+record, so the checksum chain goes on from there. Returns false without
+a log. Nothing may be pinned.
+*/
+bool pager_rollback(Pager *pager)
+{
+    if (pager->wal_fd == -1)
+    {
+        return false;
+    }
+    pthread_mutex_lock(&pager->lock);
+    pager_prefetch_drain(pager);
+    for (uint32_t i = 0; i < pager->num_frames; i++)
+    {
+        Frame *frame = &pager->frames[i];
+        if (frame->page_num != INVALID_PAGE_NUM)
+        {
+            if (frame->pin_count > 0)
+            {
+                printf("Tried to roll back page %d while it is pinned\n", frame->page_num);
+                exit(EXIT_FAILURE);
+            }
+            page_table_remove(pager, frame->page_num);
+            frame->page_num = INVALID_PAGE_NUM;
+            frame->dirty = false;
+            frame->referenced = false;
+        }
+    }
+    // 倒着还原, 同一页被淘汰多次时最早那次记下的才是提交时的位置; 提交时不在日志里的页去掉
+    for (uint32_t i = pager->wal_undo_count; i-- > 0;)
+    {
+        wal_index_set(pager, pager->wal_undo[i].page_num, pager->wal_undo[i].committed_offset);
+    }
+    if (pager->wal_undo_count > 0)
+    {
+        wal_index_rebuild(pager, pager->wal_index_mask + 1);
+    }
+    pager->wal_length -= (uint64_t)pager->wal_uncommitted * (WAL_FRAME_HEADER_SIZE + PAGE_SIZE);
+    pager->wal_frames -= pager->wal_uncommitted;
+    pager->wal_uncommitted = 0;
+    pager->wal_undo_count = 0;
+    pager->wal_checksum = pager->commit_checksum;
+    pager->num_pages = pager->commit_num_pages;
+    pthread_mutex_unlock(&pager->lock);
+    return true;
+}
+
+typedef struct
+{
+    uint32_t page_num;
+    uint64_t offset;
+} WalPage;
+
+int compare_wal_pages(const void *a, const void *b)
+{
+    uint32_t left = ((const WalPage *)a)->page_num;
+    uint32_t right = ((const WalPage *)b)->page_num;
+    return (left > right) - (left < right);
+}
+
+
+/*
+Checkpoint: copy the latest image of every page in the log back into the
+main file, in page order with adjacent pages in one pwritev, then start a
+new log. Only called when everything in the log is committed. A crash
+half way is harmless, the log is still intact and gets replayed again.
+*/
+void pager_checkpoint(Pager *pager)
+{
+    if (pager->wal_fd == -1)
+    {
+        return;
+    }
+    pthread_mutex_lock(&pager->lock);
+    // 快照还在读主文件和日志, 等它们都关掉; 预读也要读完才能重用日志
+    while (pager->readers > 0)
+    {
+        pthread_cond_wait(&pager->readers_done, &pager->lock);
+    }
+    pager_prefetch_drain(pager);
+    if (pager->wal_index_count > 0)
+    {
+        if (pager->sync_mode != SYNC_OFF)
+        {
+            sync_file(pager->wal_fd);
+        }
+        WalPage *pages = malloc(sizeof(WalPage) * pager->wal_index_count);
+        uint32_t count = 0;
+        for (uint32_t i = 0; i <= pager->wal_index_mask; i++)
+        {
+            if (pager->wal_index_pages[i] != INVALID_PAGE_NUM)
+            {
+                pages[count].page_num = pager->wal_index_pages[i];
+                pages[count].offset = pager->wal_index_offsets[i];
+                count++;
+            }
+        }
+        qsort(pages, count, sizeof(WalPage), compare_wal_pages);
+
+        uint32_t batch = count < IOV_MAX ? count : IOV_MAX;
+        uint8_t *staging = malloc((size_t)batch * PAGE_SIZE);
+        struct iovec *iov = malloc(sizeof(struct iovec) * batch);
+        uint32_t run_start = 0;
+        while (run_start < count)
+        {
+            uint32_t run_length = 0;
+            while (run_start + run_length < count && run_length < batch &&
+                   pages[run_start + run_length].page_num == pages[run_start].page_num + run_length)
+            {
+                void *buffer = staging + (size_t)run_length * PAGE_SIZE;
+                if (pread(pager->wal_fd, buffer, PAGE_SIZE, pages[run_start + run_length].offset) != PAGE_SIZE)
+                {
+                    printf("Error reading wal: %d\n", errno);
+                    exit(EXIT_FAILURE);
+                }
+                iov[run_length].iov_base = buffer;
+                iov[run_length].iov_len = PAGE_SIZE;
+                run_length++;
+            }
+            pager_write_run(pager, pages[run_start].page_num, iov, run_length);
+            run_start += run_length;
+        }
+        free(iov);
+        free(staging);
+        free(pages);
+        if (pager->compressed)
+        {
+            pager_write_map(pager);
+        }
+        if (pager->sync_mode != SYNC_OFF)
+        {
+            sync_file(pager->file_descriptor);
+        }
+        if (pager->compressed)
+        {
+            pager_slots_reuse(pager);
+        }
+    }
+    if (pager->wal_length > WAL_HEADER_SIZE)
+    {
+        wal_reset(pager);
+    }
+    pager->wal_unsynced = false;
+    pthread_mutex_unlock(&pager->lock);
+}
+
+/*
+Recovery: scan the log from the start, checking salt and checksum chain,
+and stop at the first frame that does not verify (a torn write or a frame
+from an older generation). Pages are only applied up to the last commit
+record, then the recovered pages are checkpointed into the main file.
+*/
+void wal_recover(Pager *pager)
+{
+    off_t wal_size = lseek(pager->wal_fd, 0, SEEK_END);
+    uint32_t header[4];
+    if (wal_size < WAL_HEADER_SIZE || pread(pager->wal_fd, header, WAL_HEADER_SIZE, 0) != WAL_HEADER_SIZE ||
+        header[0] != WAL_MAGIC || header[1] != PAGE_SIZE)
+    {
+        wal_reset(pager);
+        return;
+    }
+    pager->wal_salt = header[2];
+    pager->wal_checksum = pager->wal_salt;
+
+    WalPage *pending = malloc(sizeof(WalPage) * 64);
+    uint32_t pending_capacity = 64;
+    uint32_t num_pending = 0;
+    uint32_t committed_pages = 0;
+    uint8_t frame[WAL_FRAME_HEADER_SIZE];
+    uint8_t *data = malloc(PAGE_SIZE);
+    uint64_t offset = WAL_HEADER_SIZE;
+    while (offset + WAL_FRAME_HEADER_SIZE <= (uint64_t)wal_size &&
+           pread(pager->wal_fd, frame, WAL_FRAME_HEADER_SIZE, offset) == WAL_FRAME_HEADER_SIZE)
+    {
+        uint32_t page_num, commit_pages, salt, data_size;
+        uint64_t stored_checksum;
+        memcpy(&page_num, frame, 4);
+        memcpy(&commit_pages, frame + 4, 4);
+        memcpy(&salt, frame + 8, 4);
+        memcpy(&data_size, frame + 12, 4);
+        memcpy(&stored_checksum, frame + 16, 8);
+        if (salt != pager->wal_salt || (data_size != 0 && data_size != PAGE_SIZE) ||
+            offset + WAL_FRAME_HEADER_SIZE + data_size > (uint64_t)wal_size)
+        {
+            break;
+        }
+        uint64_t checksum = wal_checksum(pager->wal_checksum, frame, 16);
+        if (data_size != 0)
+        {
+            if (pread(pager->wal_fd, data, PAGE_SIZE, offset + WAL_FRAME_HEADER_SIZE) != PAGE_SIZE)
+            {
+                break;
+            }
+            checksum = wal_checksum(checksum, data, PAGE_SIZE);
+        }
+        if (checksum != stored_checksum)
+        {
+            break;
+        }
+        pager->wal_checksum = checksum;
+
+        if (data_size != 0)
+        {
+            if (num_pending == pending_capacity)
+            {
+                pending_capacity *= 2;
+                pending = realloc(pending, sizeof(WalPage) * pending_capacity);
+            }
+            pending[num_pending].page_num = page_num;
+            pending[num_pending].offset = offset + WAL_FRAME_HEADER_SIZE;
+            num_pending++;
+        }
+        if (commit_pages != 0)
+        {
+            for (uint32_t i = 0; i < num_pending; i++)
+            {
+                wal_index_set(pager, pending[i].page_num, pending[i].offset);
+            }
+            num_pending = 0;
+            committed_pages = commit_pages;
+        }
+        offset += WAL_FRAME_HEADER_SIZE + data_size;
+    }
+    free(data);
+    free(pending);
+
+    if (committed_pages > pager->num_pages)
+    {
+        pager->num_pages = committed_pages;
+    }
+    // 最后一个提交之后的帧直接丢掉, 检查点之后日志重新开始
+    pager->wal_length = offset;
+    pager->wal_uncommitted = 0;
+    pager_checkpoint(pager);
+}
+
+void *pager_writer_main(void *arg)
+{
+    Pager *pager = arg;
+    pthread_mutex_lock(&pager->lock);
+    while (!pager->writer_stop)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += PAGER_WRITER_INTERVAL_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&pager->writer_wakeup, &pager->lock, &deadline);
+        if (pager->writer_stop)
+        {
+            break;
+        }
+        if (pager->wal_fd == -1)
+        {
+            pager_write_back(pager, PAGER_WRITER_BATCH_PAGES);
+        }
+        else if (pager->wal_unsynced)
+        {
+            // 组提交: 这个周期里的所有提交共用一次 fdatasync, 同步时不占着锁
+            pager->wal_unsynced = false;
+            int wal_fd = pager->wal_fd;
+            pthread_mutex_unlock(&pager->lock);
+            sync_file(wal_fd);
+            pthread_mutex_lock(&pager->lock);
+        }
+    }
+    pthread_mutex_unlock(&pager->lock);
+    return NULL;
+}
+
+// CLOCK 淘汰: 跳过被 pin 住的帧, 引用位为 1 的给第二次机会
+uint32_t pager_find_victim(Pager *pager)
+{
+    for (uint32_t step = 0; step < 2 * pager->num_frames; step++)
+    {
+        uint32_t frame_index = pager->clock_hand;
+        Frame *frame = &pager->frames[frame_index];
+        pager->clock_hand = (pager->clock_hand + 1) % pager->num_frames;
+
+        if (frame->page_num == INVALID_PAGE_NUM)
+        {
+            return frame_index;
+        }
+        if (frame->pin_count > 0)
+        {
+            continue;
+        }
+        if (frame->referenced)
+        {
+            frame->referenced = false;
+            continue;
+        }
+        return frame_index;
+    }
+
+    printf("All %d buffer pool frames are pinned.\n", pager->num_frames);
+    exit(EXIT_FAILURE);
+}
+
+void pager_apply_access(Pager *pager)
+{
+    if (pager->map_length == 0)
+    {
+        return;
+    }
+    int advice = pager->access == PAGER_ACCESS_SEQUENTIAL ? MADV_SEQUENTIAL : MADV_RANDOM;
+    if (madvise(pager->map_base, pager->map_length, advice) == -1)
+    {
+        printf("Error in madvise: %d\n", errno);
+    }
+}
+
+// 告诉内核接下来的访问模式, 只对 mmap 模式有效
+void pager_advise(Pager *pager, PagerAccess access)
+{
+    if (pager->mode != PAGER_MODE_MMAP || pager->access == access)
+    {
+        return;
+    }
+    pager->access = access;
+    pager_apply_access(pager);
+}
+
+// 让映射至少覆盖 num_pages 页: 先 ftruncate 扩大文件, 再原地 mremap 进预留区
+void pager_map_grow(Pager *pager, uint32_t num_pages)
+{
+    size_t needed = (size_t)num_pages * PAGE_SIZE;
+    if (needed <= pager->map_length)
+    {
+        return;
+    }
+
+    size_t new_length = pager->map_length * 2;
+    if (new_length < (size_t)PAGER_MMAP_MIN_GROW_PAGES * PAGE_SIZE)
+    {
+        new_length = (size_t)PAGER_MMAP_MIN_GROW_PAGES * PAGE_SIZE;
+    }
+    if (new_length < needed)
+    {
+        new_length = needed;
+    }
+    if (new_length > PAGER_MMAP_RESERVE)
+    {
+        printf("Database exceeds the mmap reservation of %zu bytes.\n", PAGER_MMAP_RESERVE);
+        exit(EXIT_FAILURE);
+    }
+
+    if (new_length > pager->file_length && ftruncate(pager->file_descriptor, new_length) == -1)
+    {
+        printf("Error extending db file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+
+    void *mapped;
+    if (pager->map_length == 0)
+    {
+        mapped = mmap(pager->map_base, new_length, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_FIXED, pager->file_descriptor, 0);
+    }
+    else
+    {
+        // 释放映射后面那段预留, mremap 就能原地扩展而不用移动
+        munmap(pager->map_base + pager->map_length, new_length - pager->map_length);
+        mapped = mremap(pager->map_base, pager->map_length, new_length, 0);
+    }
+    if (mapped != pager->map_base)
+    {
+        printf("Error mapping db file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+
+    pager->map_length = new_length;
+    if (new_length > pager->file_length)
+    {
+        pager->file_length = new_length;
+    }
+    pager_apply_access(pager);
+}
+
+/*
+called with pager->lock held: gives page_num the CLOCK victim's frame and
+pins it once. Returns true when the caller has to fill the frame from *fd
+at *offset, *length bytes (less than a page for a compressed page); a page
+past the end of the file is zero-filled here instead.
+*/
+bool pager_claim_frame(Pager *pager, uint32_t page_num, uint32_t *frame_out, int *fd, off_t *offset,
+                       uint32_t *length)
+{
+    uint32_t frame_index = pager_find_victim(pager);
+    Frame *frame = &pager->frames[frame_index];
+    if (frame->page_num != INVALID_PAGE_NUM)
+    {
+        if (frame->dirty && pager->wal_fd != -1)
+        {
+            // 主文件只在检查点时修改, 没提交的脏页也先写进日志
+            wal_append_page(pager, frame->page_num, frame->data);
+            frame->dirty = false;
+        }
+        else if (frame->dirty)
+        {
+            pager_flush(pager, frame->page_num);
+        }
+        page_table_remove(pager, frame->page_num);
+    }
+
+    uint32_t num_pages = pager->file_length / PAGE_SIZE;
+    if (pager->file_length % PAGE_SIZE)
+    {
+        num_pages += 1;
+    }
+
+    frame->page_num = page_num;
+    frame->pin_count = 1;
+    frame->referenced = true;
+    frame->dirty = false;
+    page_table_insert(pager, page_num, frame_index);
+    *frame_out = frame_index;
+
+    if (page_num >= pager->num_pages)
+    {
+        pager->num_pages = page_num + 1;
+    }
+
+    // 日志里有更新的版本就从日志读
+    uint64_t wal_offset = pager->wal_fd == -1 ? 0 : wal_index_lookup(pager, page_num);
+    *length = PAGE_SIZE;
+    if (wal_offset != 0 || (!pager->compressed && page_num < num_pages)) // 如果文件够大于页数，则从文件读入
+    {
+        *fd = wal_offset != 0 ? pager->wal_fd : pager->file_descriptor;
+        *offset = wal_offset != 0 ? (off_t)wal_offset : (off_t)page_num * PAGE_SIZE;
+        return true;
+    }
+    if (pager->compressed && page_num == 0)
+    {
+        *fd = pager->file_descriptor;
+        *offset = 0;
+        return true;
+    }
+    if (pager->compressed && page_num < pager->map_chunks * compress_slots_per_chunk() &&
+        pager->slots[page_num].sector != 0)
+    {
+        PageSlot *slot = &pager->slots[page_num];
+        *fd = pager->file_descriptor;
+        *offset = (off_t)slot->sector * COMPRESS_SECTOR;
+        *length = slot->length == 0 ? PAGE_SIZE : slot->length;
+        return true;
+    }
+    memset(frame->data, 0, PAGE_SIZE);
+    return false;
+}
+
+/*
+called with pager->lock held, which is dropped during the read so other
+threads keep using the pool. Also keeps a moving average of the read time,
+which tells scans whether reads ahead are worth it (see scan_prefetch).
+A compressed page is read into a stack buffer and decompressed into data.
+*/
+void pager_read_frame(Pager *pager, int fd, void *data, off_t offset, uint32_t length)
+{
+    uint8_t packed[PAGE_SIZE_MAX];
+    pthread_mutex_unlock(&pager->lock);
+    uint64_t started = monotonic_ns();
+    ssize_t bytes_read = pread(fd, length == PAGE_SIZE ? data : packed, length, offset);
+    int64_t elapsed = monotonic_ns() - started;
+    bool corrupt = length != PAGE_SIZE &&
+                   (bytes_read != (ssize_t)length || !lz_decompress(packed, length, data, PAGE_SIZE));
+    pthread_mutex_lock(&pager->lock);
+    if (bytes_read == -1)
+    {
+        printf("Error reading file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    if (corrupt)
+    {
+        printf("Corrupt compressed page at offset %lld.\n", (long long)offset);
+        exit(EXIT_FAILURE);
+    }
+    pager->stats.bytes_read += bytes_read;
+    pager->read_ns += (elapsed - pager->read_ns) / 4;
+}
+
+// called with pager->lock held: 把还在队列里的预读拿出来, 预读线程会跳过它
+bool pager_take_prefetch(Pager *pager, uint32_t frame_index, PrefetchRead *read)
+{
+    for (uint32_t i = 0; i < pager->prefetch_queued; i++)
+    {
+        PrefetchRead *queued = &pager->prefetch_queue[(pager->prefetch_head + i) % pager->num_frames];
+        if (queued->frame_index == frame_index)
+        {
+            *read = *queued;
+            queued->frame_index = PAGER_NO_FRAME;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+called with pager->lock held. A miss claims the frame (pinned and marked
+loading) before dropping the lock for the read, so scans on other threads
+keep going while this one waits on the disk.
+*/
+void *pager_fetch_frame(Pager *pager, uint32_t page_num)
+{
+    uint32_t frame_index = page_table_lookup(pager, page_num);
+    if (frame_index != PAGER_NO_FRAME)
+    {
+        Frame *frame = &pager->frames[frame_index];
+        frame->pin_count += 1;
+        frame->referenced = true;
+        pager->stats.page_hits++;
+        // 预读还在排队就自己读, 已经在读了就等它而不是再读一遍
+        PrefetchRead read;
+        if (frame->loading && pager_take_prefetch(pager, frame_index, &read))
+        {
+            pager_read_frame(pager, read.fd, frame->data, read.offset, read.length);
+            frame->loading = false;
+            frame->pin_count -= 1; // 预读认领时的 pin
+            pager->prefetch_inflight--;
+            pthread_cond_broadcast(&pager->page_loaded);
+        }
+        while (frame->loading)
+        {
+            pthread_cond_wait(&pager->page_loaded, &pager->lock);
+        }
+        return frame->data;
+    }
+
+    pager->stats.page_misses++;
+    int fd;
+    off_t offset;
+    uint32_t length;
+    bool needs_read = pager_claim_frame(pager, page_num, &frame_index, &fd, &offset, &length);
+    Frame *frame = &pager->frames[frame_index];
+    if (needs_read)
+    {
+        frame->loading = true;
+        pager_read_frame(pager, fd, frame->data, offset, length);
+        frame->loading = false;
+        pthread_cond_broadcast(&pager->page_loaded);
+    }
+    return frame->data;
+}
+
+/*
+read-ahead thread pool. pager_prefetch claims frames for pages a scan
+will reach soon and queues their reads; a prefetch thread preads each one
+while its frame stays pinned and loading, so a get_page that arrives first
+waits for the read in flight instead of issuing its own. Several threads
+keep several reads outstanding, which is what lets the device work at
+queue depth instead of one read at a time.
+*/
+void *pager_prefetch_main(void *arg)
+{
+    Pager *pager = arg;
+    pthread_mutex_lock(&pager->lock);
+    while (true)
+    {
+        while (pager->prefetch_queued == 0 && !pager->prefetch_stop)
+        {
+            pthread_cond_wait(&pager->prefetch_wakeup, &pager->lock);
+        }
+        // 停止前把队列里的读完, 认领的帧才会解除 pin
+        if (pager->prefetch_queued == 0)
+        {
+            break;
+        }
+        PrefetchRead read = pager->prefetch_queue[pager->prefetch_head];
+        pager->prefetch_head = (pager->prefetch_head + 1) % pager->num_frames;
+        pager->prefetch_queued--;
+        if (read.frame_index == PAGER_NO_FRAME)
+        {
+            continue; // 扫描等不及, 自己读了
+        }
+        Frame *frame = &pager->frames[read.frame_index];
+        pager_read_frame(pager, read.fd, frame->data, read.offset, read.length);
+        pager->stats.prefetch_reads++;
+        frame->loading = false;
+        frame->pin_count -= 1;
+        pager->prefetch_inflight--;
+        pthread_cond_broadcast(&pager->page_loaded);
+    }
+    pthread_mutex_unlock(&pager->lock);
+    return NULL;
+}
+
+/*
+start reading pages that are not in the buffer pool yet. At most 1/8 of
+the frames are held by reads in flight; pages past that are left for
+get_page. In mmap mode the kernel is asked to read them instead.
+*/
+void pager_prefetch(Pager *pager, const uint32_t *pages, uint32_t count)
+{
+    if (pager->mode == PAGER_MODE_MMAP)
+    {
+        for (uint32_t i = 0; i < count; i++)
+        {
+            if ((size_t)(pages[i] + 1) * PAGE_SIZE <= pager->map_length)
+            {
+                madvise(pager->map_base + (size_t)pages[i] * PAGE_SIZE, PAGE_SIZE, MADV_WILLNEED);
+            }
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&pager->lock);
+    // 被 get_page 拿走的读取还占着队列的位置, 两个都要限制
+    uint32_t limit = pager->num_frames / PAGER_PREFETCH_FRAME_SHARE;
+    uint32_t queued = 0;
+    for (uint32_t i = 0; i < count && pager->prefetch_inflight < limit && pager->prefetch_queued < limit; i++)
+    {
+        if (pages[i] >= pager->num_pages || page_table_lookup(pager, pages[i]) != PAGER_NO_FRAME)
+        {
+            continue;
+        }
+        PrefetchRead read;
+        if (!pager_claim_frame(pager, pages[i], &read.frame_index, &read.fd, &read.offset, &read.length))
+        {
+            pager->frames[read.frame_index].pin_count -= 1;
+            continue;
+        }
+        pager->frames[read.frame_index].loading = true;
+        uint32_t tail = (pager->prefetch_head + pager->prefetch_queued) % pager->num_frames;
+        pager->prefetch_queue[tail] = read;
+        pager->prefetch_queued++;
+        pager->prefetch_inflight++;
+        queued++;
+    }
+    if (queued > 0)
+    {
+        // 线程在第一次需要时才启动, 不扫描的库不多开线程
+        while (pager->prefetch_running < PAGER_PREFETCH_THREADS)
+        {
+            pthread_create(&pager->prefetch_threads[pager->prefetch_running], NULL, pager_prefetch_main, pager);
+            pager->prefetch_running++;
+        }
+        // 每个新读取叫醒一个线程, 不用全部叫醒来抢锁
+        for (uint32_t i = 0; i < queued && i < pager->prefetch_running; i++)
+        {
+            pthread_cond_signal(&pager->prefetch_wakeup);
+        }
+    }
+    pthread_mutex_unlock(&pager->lock);
+}
+
+// called with pager->lock held: 等所有预读完成, 之后才能改写日志或丢弃帧
+void pager_prefetch_drain(Pager *pager)
+{
+    while (pager->prefetch_inflight > 0)
+    {
+        pthread_cond_wait(&pager->page_loaded, &pager->lock);
+    }
+}
+
+// 读完队列里的页后结束预读线程; 下次 pager_prefetch 会重新启动
+void pager_prefetch_stop(Pager *pager)
+{
+    if (pager->prefetch_running == 0)
+    {
+        return;
+    }
+    pthread_mutex_lock(&pager->lock);
+    pager->prefetch_stop = true;
+    pthread_cond_broadcast(&pager->prefetch_wakeup);
+    pthread_mutex_unlock(&pager->lock);
+    for (uint32_t i = 0; i < pager->prefetch_running; i++)
+    {
+        pthread_join(pager->prefetch_threads[i], NULL);
+    }
+    pager->prefetch_running = 0;
+    pager->prefetch_stop = false;
+}
+
+/*
+Fetch a page into the buffer pool and pin it. Every get_page must be
+balanced by an unpin_page once the caller is done with the pointer.
+*/
+void *get_page(Pager *pager, uint32_t page_num)
+{
+    if (pager->mode == PAGER_MODE_MMAP)
+    {
+        pager_map_grow(pager, page_num + 1);
+        if (page_num >= pager->num_pages)
+        {
+            pager->num_pages = page_num + 1;
+        }
+        return pager->map_base + (size_t)page_num * PAGE_SIZE;
+    }
+
+    pthread_mutex_lock(&pager->lock);
+    void *page = pager_fetch_frame(pager, page_num);
+    pthread_mutex_unlock(&pager->lock);
+    return page;
+}
+
+void unpin_page(Pager *pager, uint32_t page_num)
+{
+    if (pager->mode == PAGER_MODE_MMAP)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&pager->lock);
+    uint32_t frame_index = page_table_lookup(pager, page_num);
+    if (frame_index == PAGER_NO_FRAME || pager->frames[frame_index].pin_count == 0)
+    {
+        printf("Tried to unpin page %d that is not pinned\n", page_num);
+        exit(EXIT_FAILURE);
+    }
+    pager->frames[frame_index].pin_count -= 1;
+    pthread_mutex_unlock(&pager->lock);
+}
+
+/*
+Record that a pinned page was modified. Only dirty pages are written back,
+so every path that changes a page must call this before unpinning it.
+In mmap mode the kernel already tracks dirty pages of the mapping.
+*/
+void mark_page_dirty(Pager *pager, uint32_t page_num)
+{
+    if (pager->mode == PAGER_MODE_MMAP)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&pager->lock);
+    uint32_t frame_index = page_table_lookup(pager, page_num);
+    if (frame_index == PAGER_NO_FRAME || pager->frames[frame_index].pin_count == 0)
+    {
+        printf("Tried to mark page %d dirty without pinning it\n", page_num);
+        exit(EXIT_FAILURE);
+    }
+    pager->frames[frame_index].dirty = true;
+    pthread_mutex_unlock(&pager->lock);
+}
+
+void print_row(Row *row)
+{
+    printf("(%d, %s, %s )\n", row->id, row->username, row->email);
+}
+
+void result_writer_init(ResultWriter *writer, int fd, OutputMode mode)
+{
+    writer->mode = mode;
+    writer->fd = fd;
+    writer->buffer = malloc(RESULT_BUFFER_SIZE);
+    writer->length = 0;
+    writer->capacity = RESULT_BUFFER_SIZE;
+    writer->lock = NULL;
+    writer->order = NULL;
+    writer->position = 0;
+}
+
+void result_writer_free(ResultWriter *writer)
+{
+    free(writer->buffer);
+    writer->buffer = NULL;
+}
+
+// 写完所有 iovec, 处理被信号打断和只写了一部分的情况
+void write_all(int fd, struct iovec *iov, int iov_count)
+{
+    while (iov_count > 0)
+    {
+        int batch = iov_count < IOV_MAX ? iov_count : IOV_MAX;
+        ssize_t written = writev(fd, iov, batch);
+        if (written == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            printf("Error writing results: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        while (iov_count > 0 && (size_t)written >= iov->iov_len)
+        {
+            written -= iov->iov_len;
+            iov++;
+            iov_count--;
+        }
+        if (iov_count > 0)
+        {
+            iov->iov_base += written;
+            iov->iov_len -= written;
+        }
+    }
+}
+
+void result_writer_flush(ResultWriter *writer)
+{
+    if (writer->fd == -1 || writer->length == 0)
+    {
+        return;
+    }
+    if (writer->lock != NULL)
+    {
+        pthread_mutex_lock(writer->lock);
+    }
+    while (writer->order != NULL && writer->order->turn != writer->position)
+    {
+        pthread_cond_wait(&writer->order->changed, writer->lock);
+    }
+    if (writer->fd == STDOUT_FILENO)
+    {
+        // 提示符之类还在 stdio 缓冲区里, 先刷出去保证顺序
+        fflush(stdout);
+    }
+    struct iovec iov = {writer->buffer, writer->length};
+    write_all(writer->fd, &iov, 1);
+    writer->length = 0;
+    if (writer->lock != NULL)
+    {
+        pthread_mutex_unlock(writer->lock);
+    }
+}
+
+// 按顺序输出的 writer 写完了, 轮到下一个
+void result_writer_end_turn(ResultWriter *writer)
+{
+    result_writer_flush(writer);
+    pthread_mutex_lock(writer->lock);
+    writer->order->turn++;
+    pthread_cond_broadcast(&writer->order->changed);
+    pthread_mutex_unlock(writer->lock);
+}
+
+// 保证缓冲区还能再放 bytes 个字节, 返回写入位置
+char *result_writer_reserve(ResultWriter *writer, size_t bytes)
+{
+    if (writer->length + bytes > writer->capacity)
+    {
+        if (writer->fd != -1)
+        {
+            result_writer_flush(writer);
+        }
+        else
+        {
+            while (writer->length + bytes > writer->capacity)
+            {
+                writer->capacity *= 2;
+            }
+            writer->buffer = realloc(writer->buffer, writer->capacity);
+        }
+    }
+    return writer->buffer + writer->length;
+}
+
+char *format_uint32(char *out, uint32_t value)
+{
+    char digits[10];
+    int count = 0;
+    do
+    {
+        digits[count++] = '0' + value % 10;
+        value /= 10;
+    } while (value != 0);
+    while (count > 0)
+    {
+        *out++ = digits[--count];
+    }
+    return out;
+}
+
+// 含逗号, 引号或换行的字段加引号, 引号本身写两遍
+char *format_csv_field(char *out, const char *field, uint8_t length)
+{
+    if (memchr(field, ',', length) == NULL && memchr(field, '"', length) == NULL &&
+        memchr(field, '\n', length) == NULL)
+    {
+        memcpy(out, field, length);
+        return out + length;
+    }
+    *out++ = '"';
+    for (uint8_t i = 0; i < length; i++)
+    {
+        if (field[i] == '"')
+        {
+            *out++ = '"';
+        }
+        *out++ = field[i];
+    }
+    *out++ = '"';
+    return out;
+}
+
+// 直接从页里的 value 格式化一行, 不经过 Row
+void result_writer_row(ResultWriter *writer, uint32_t key, void *value)
+{
+    uint8_t username_length = *(uint8_t *)value;
+    char *username = value + FIELD_LENGTH_SIZE;
+    uint8_t email_length = *(uint8_t *)(username + username_length);
+    char *email = username + username_length + FIELD_LENGTH_SIZE;
+
+    if (writer->mode == OUTPUT_BINARY)
+    {
+        uint32_t size = 2 * FIELD_LENGTH_SIZE + username_length + email_length;
+        char *out = result_writer_reserve(writer, ID_SIZE + size);
+        memcpy(out, &key, ID_SIZE);
+        memcpy(out + ID_SIZE, value, size);
+        writer->length += ID_SIZE + size;
+        return;
+    }
+
+    // 数字最多 10 位, CSV 转义最多让字段翻倍再加两个引号
+    char *start = result_writer_reserve(writer, 16 + 2 * (username_length + email_length) + 4);
+    char *out = start;
+    if (writer->mode == OUTPUT_CSV)
+    {
+        out = format_uint32(out, key);
+        *out++ = ',';
+        out = format_csv_field(out, username, username_length);
+        *out++ = ',';
+        out = format_csv_field(out, email, email_length);
+        *out++ = '\n';
+    }
+    else
+    {
+        *out++ = '(';
+        out = format_uint32(out, key);
+        memcpy(out, ", ", 2);
+        out += 2;
+        memcpy(out, username, username_length);
+        out += username_length;
+        memcpy(out, ", ", 2);
+        out += 2;
+        memcpy(out, email, email_length);
+        out += email_length;
+        memcpy(out, " )\n", 3);
+        out += 3;
+    }
+    writer->length += out - start;
+}
+
+// count(*) 的结果: 二进制模式是 8 字节小端, 其它模式一行数字
+void result_writer_count(ResultWriter *writer, uint64_t count)
+{
+    if (writer->mode == OUTPUT_BINARY)
+    {
+        memcpy(result_writer_reserve(writer, sizeof(count)), &count, sizeof(count));
+        writer->length += sizeof(count);
+        return;
+    }
+    char *out = result_writer_reserve(writer, 24);
+    int length = snprintf(out, 24, writer->mode == OUTPUT_CSV ? "%llu\n" : "(%llu)\n", (unsigned long long)count);
+    writer->length += length;
+}
+
+// 行序列化之后 value 占多少字节, id 作为 key 单独存放
+uint32_t row_value_size(Row *row)
+{
+    return 2 * FIELD_LENGTH_SIZE + strlen(row->username) + strlen(row->email);
+}
+
+// 写成 value: 用户名长度 | 用户名 | 邮箱长度 | 邮箱; 返回 value 的字节数
+uint32_t encode_value(void *destination, const char *username, uint8_t username_length,
+                      const char *email, uint8_t email_length)
+{
+    *(uint8_t *)destination = username_length;
+    memcpy(destination + FIELD_LENGTH_SIZE, username, username_length);
+    void *email_field = destination + FIELD_LENGTH_SIZE + username_length;
+    *(uint8_t *)email_field = email_length;
+    memcpy(email_field + FIELD_LENGTH_SIZE, email, email_length);
+    return 2 * FIELD_LENGTH_SIZE + username_length + email_length;
+}
+
+void serialize_row(Row *source, void *destination)
+{
+    encode_value(destination, source->username, strlen(source->username), source->email,
+                 strlen(source->email));
+}
+
+// id 不在 value 里, 由调用者从 key 填上
+void deserialize_row(void *source, Row *destination)
+{
+    uint8_t username_length = *(uint8_t *)source;
+    memcpy(destination->username, source + FIELD_LENGTH_SIZE, username_length);
+    destination->username[username_length] = '\0';
+    source += FIELD_LENGTH_SIZE + username_length;
+    uint8_t email_length = *(uint8_t *)source;
+    memcpy(destination->email, source + FIELD_LENGTH_SIZE, email_length);
+    destination->email[email_length] = '\0';
+}
+
+// 计算行在表内的位置
+void *cursor_value(Cursor *cursor)
+{
+    // uint32_t row_num = cursor->row_num;
+    uint32_t page_num = cursor->page_num;
+    void *page = get_page(cursor->table->pager, page_num);
+    // uint32_t row_offset = row_num % ROWS_PER_PAGE; // 行是所在那一页的第几行
+    // uint32_t byte_offset = row_offset * ROW_SIZE;  // 行在那一页的byte位置
+    // return page + byte_offset;                     // 行在整个表的位置
+    // cursor 自己 pin 着当前页, 返回的指针在 cursor 离开该页之前一直有效
+    unpin_page(cursor->table->pager, page_num);
+    return leaf_node_value(page, cursor->cell_num);
+}
+
+uint32_t cursor_key(Cursor *cursor)
+{
+    void *page = get_page(cursor->table->pager, cursor->page_num);
+    uint32_t key = *leaf_node_key(page, cursor->cell_num);
+    unpin_page(cursor->table->pager, cursor->page_num);
+    return key;
+}
+
+/*
+table_find 给出的是第一个 >= key 的位置, 可能正好在叶子末尾;
+这时顺着 next_leaf 挪到下一个有数据的叶子, 没有了就是表尾
+*/
+void cursor_settle(Cursor *cursor)
+{
+    Pager *pager = cursor->table->pager;
+    void *node = get_page(pager, cursor->page_num);
+    while (cursor->cell_num >= *leaf_node_num_cells(node))
+    {
+        uint32_t next_page_num = *leaf_node_next_leaf(node);
+        if (next_page_num == 0)
+        {
+            cursor->end_of_table = true;
+            break;
+        }
+        // 本函数和 cursor 各持有一个 pin, 一起换到下一页
+        void *next = get_page(pager, next_page_num);
+        get_page(pager, next_page_num);
+        unpin_page(pager, cursor->page_num);
+        unpin_page(pager, cursor->page_num);
+        cursor->page_num = next_page_num;
+        cursor->cell_num = 0;
+        node = next;
+    }
+    unpin_page(pager, cursor->page_num);
+}
+
+void cursor_advance(Cursor *cursor)
+{
+    // cursor->row_num += 1;
+    // if (cursor->row_num >= cursor->table->num_rows)
+    uint32_t page_num = cursor->page_num;
+    void *node = get_page(cursor->table->pager, page_num);
+
+    cursor->cell_num += 1;
+    if (cursor->cell_num >= *leaf_node_num_cells(node))
+    {
+        // cursor->end_of_table = true;
+        uint32_t next_page_num = *leaf_node_next_leaf(node);
+        if (next_page_num == 0)
+        {
+            cursor->end_of_table = true;
+        }
+        else
+        {
+            // 把 cursor 持有的 pin 从当前页换到下一页
+            get_page(cursor->table->pager, next_page_num);
+            unpin_page(cursor->table->pager, page_num);
+            cursor->page_num = next_page_num;
+            cursor->cell_num = 0;
+        }
+    }
+    unpin_page(cursor->table->pager, page_num);
+}
+
+void cursor_close(Cursor *cursor)
+{
+    unpin_page(cursor->table->pager, cursor->page_num);
+    free(cursor);
+}
+
+// 缓冲池: cache_pages 个帧和页号到帧的哈希表
+void pager_init_frames(Pager *pager, uint32_t cache_pages)
+{
+    pager->num_frames = cache_pages;
+    pager->frames = malloc(sizeof(Frame) * cache_pages);
+    for (uint32_t i = 0; i < cache_pages; i++)
+    {
+        pager->frames[i].page_num = INVALID_PAGE_NUM;
+        pager->frames[i].pin_count = 0;
+        pager->frames[i].referenced = false;
+        pager->frames[i].dirty = false;
+        pager->frames[i].loading = false;
+        pager->frames[i].data = malloc(PAGE_SIZE);
+    }
+
+    // 哈希表至少是帧数的两倍, 保持较低的装载因子
+    uint32_t table_size = 1;
+    while (table_size < 2 * cache_pages)
+    {
+        table_size <<= 1;
+    }
+    pager->page_table = malloc(sizeof(uint32_t) * table_size);
+    pager->page_table_mask = table_size - 1;
+    for (uint32_t i = 0; i < table_size; i++)
+    {
+        pager->page_table[i] = PAGER_NO_FRAME;
+    }
+    pager->clock_hand = 0;
+
+    pager->prefetch_queue = malloc(sizeof(PrefetchRead) * cache_pages);
+    pager->prefetch_head = 0;
+    pager->prefetch_queued = 0;
+    pager->prefetch_inflight = 0;
+    pager->prefetch_running = 0;
+    pager->prefetch_stop = false;
+    pager->read_ns = 0;
+
+    pthread_mutex_init(&pager->lock, NULL);
+    pthread_cond_init(&pager->page_loaded, NULL);
+    pthread_cond_init(&pager->prefetch_wakeup, NULL);
+}
+
+void pager_free_frames(Pager *pager)
+{
+    pager_prefetch_stop(pager);
+    free(pager->prefetch_queue);
+    pthread_cond_destroy(&pager->prefetch_wakeup);
+    for (uint32_t i = 0; i < pager->num_frames; i++)
+    {
+        free(pager->frames[i].data);
+    }
+    pthread_mutex_destroy(&pager->lock);
+    pthread_cond_destroy(&pager->page_loaded);
+    free(pager->frames);
+    free(pager->page_table);
+}
+
+void table_flush_pending(Table *table);
+void db_finalize(Statement *statement);
+void stats_dump(Table *table);
+void db_snapshot_end(Table *snapshot);
+
+void db_close(Table *table)
+{
+    if (table->snapshot != NULL)
+    {
+        db_snapshot_end(table->snapshot);
+    }
+    // 没有 commit 的批在关闭时一起提交
+    table_flush_pending(table);
+    if (table->stats_file != NULL)
+    {
+        stats_dump(table);
+        fclose(table->stats_file);
+    }
+    Pager *pager = table->pager;
+    // uint32_t num_full_pages = table->num_rows / ROWS_PER_PAGE; // 完整的页数
+    pager_prefetch_stop(pager);
+
+    if (pager->mode == PAGER_MODE_MMAP)
+    {
+        // 写入已经在共享映射里了, 只需要把预扩展的尾部截掉
+        munmap(pager->map_base, PAGER_MMAP_RESERVE);
+        if (ftruncate(pager->file_descriptor, (off_t)pager->num_pages * PAGE_SIZE) == -1)
+        {
+            printf("Error truncating db file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (pager->writer_running)
+    {
+        pthread_mutex_lock(&pager->lock);
+        pager->writer_stop = true;
+        pthread_cond_signal(&pager->writer_wakeup);
+        pthread_mutex_unlock(&pager->lock);
+        pthread_join(pager->writer_thread, NULL);
+    }
+
+    if (pager->wal_fd != -1)
+    {
+        // 正常关闭: 提交剩下的修改, 全部搬回主文件, 日志就不需要了
+        pager_commit(pager);
+        pager_checkpoint(pager);
+        close(pager->wal_fd);
+        unlink(pager->wal_path);
+        free(pager->wal_path);
+        free(pager->wal_index_pages);
+        free(pager->wal_index_offsets);
+    }
+
+    // 只写回修改过的页, 相邻的页合并成一次 pwritev
+    pager_write_back(pager, UINT32_MAX);
+    if (pager->wal_fd == -1 && pager->sync_mode != SYNC_OFF)
+    {
+        sync_file(pager->file_descriptor); // mmap 模式下映射已经拆掉, 写过的页都还在页缓存里
+    }
+    int result = close(pager->file_descriptor);
+    if (result == -1)
+    {
+        printf("Error closing db file.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pager_free_frames(pager);
+    pthread_cond_destroy(&pager->writer_wakeup);
+    pthread_cond_destroy(&pager->readers_done);
+    free(pager->wal_undo);
+    free(pager->path);
+    free(pager->slots);
+    free(pager->chunk_offsets);
+    free(pager->chunk_dirty);
+    pager_slots_reset(pager, true);
+    free(pager->compress_buffer);
+    free(pager);
+    result_writer_free(&table->output);
+    free(table->pending_rows);
+    while (table->prepared != NULL)
+    {
+        PreparedStatement *next = table->prepared->next;
+        db_finalize(&table->prepared->statement);
+        free(table->prepared->name);
+        free(table->prepared);
+        table->prepared = next;
+    }
+    free(table);
+}
+
+/*
+The page size has to be known before anything is read through the pager:
+it comes from the header of an existing file, or from the log header when
+a new file crashed before its first checkpoint, otherwise from the options.
+Whether pages are stored compressed is decided the same way.
+*/
+uint32_t pager_file_format(int fd, off_t file_length, const char *filename, DbOptions *options, bool *compressed)
+{
+    uint32_t header[HEADER_SIZE / sizeof(uint32_t)];
+    *compressed = false;
+    if (file_length > 0)
+    {
+        if (pread(fd, header, HEADER_SIZE, 0) != HEADER_SIZE ||
+            *header_magic(header) != HEADER_MAGIC)
+        {
+            printf("db file has no valid header. Not a database or an older format.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (*header_version(header) > HEADER_FORMAT_VERSION)
+        {
+            printf("db file format version %u is newer than this program supports.\n", *header_version(header));
+            exit(EXIT_FAILURE);
+        }
+        uint32_t page_size = *header_version(header) == 0 ? PAGE_SIZE_DEFAULT : *header_page_size(header);
+        if (!page_size_supported(page_size))
+        {
+            printf("db file has an unsupported page size %u. Corrupt file.\n", page_size);
+            exit(EXIT_FAILURE);
+        }
+        *compressed = header_compressed(header);
+        return page_size;
+    }
+
+    char wal_path[PATH_MAX];
+    snprintf(wal_path, sizeof(wal_path), "%s-wal", filename);
+    int wal_fd = open(wal_path, O_RDONLY);
+    if (wal_fd != -1)
+    {
+        uint32_t wal_header[4];
+        bool valid = pread(wal_fd, wal_header, WAL_HEADER_SIZE, 0) == WAL_HEADER_SIZE &&
+                     wal_header[0] == WAL_MAGIC && page_size_supported(wal_header[1]);
+        close(wal_fd);
+        if (valid)
+        {
+            return wal_header[1];
+        }
+    }
+    *compressed = options->compress;
+    return options->page_size;
+}
+
+int compare_slots(const void *a, const void *b)
+{
+    uint32_t left = ((const PageSlot *)a)->sector;
+    uint32_t right = ((const PageSlot *)b)->sector;
+    return (left > right) - (left < right);
+}
+
+// 打开时, 映射块和已用的槽之间的空隙 (包括最后一个之后到文件末尾) 都是空闲槽
+void pager_compress_find_free(Pager *pager, uint32_t chunks)
+{
+    uint32_t per_chunk = compress_slots_per_chunk();
+    PageSlot *used = malloc(sizeof(PageSlot) * ((size_t)chunks * per_chunk + chunks));
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < chunks; i++)
+    {
+        if (pager->chunk_offsets[i] != 0)
+        {
+            used[count].sector = pager->chunk_offsets[i] / COMPRESS_SECTOR;
+            used[count++].capacity = PAGE_SIZE / COMPRESS_SECTOR;
+        }
+    }
+    for (uint32_t page_num = 1; page_num < chunks * per_chunk; page_num++)
+    {
+        if (pager->slots[page_num].sector != 0)
+        {
+            used[count++] = pager->slots[page_num];
+        }
+    }
+    qsort(used, count, sizeof(PageSlot), compare_slots);
+    uint64_t next = compress_data_start() / COMPRESS_SECTOR;
+    for (uint32_t i = 0; i <= count; i++)
+    {
+        uint64_t start = i < count ? used[i].sector : pager->file_length / COMPRESS_SECTOR;
+        if (start > next)
+        {
+            slot_lists_add(pager->free_slots, next, start - next);
+        }
+        if (i < count && start + used[i].capacity > next)
+        {
+            next = start + used[i].capacity;
+        }
+    }
+    free(used);
+}
+
+/*
+set up the page map of a compressed file. A new file gets its header page
+and an empty chunk directory on disk right away, so a crash before the
+first checkpoint cannot leave it looking like an uncompressed file. Map
+entries that point past the end of the file were written but not synced
+before a crash; they are dropped and the log brings those pages back.
+*/
+void pager_compress_open(Pager *pager, const char *filename, bool compressed)
+{
+    pager->compressed = compressed;
+    pager->path = strdup(filename);
+    pager->slots = NULL;
+    pager->map_chunks = 0;
+    pager->chunk_offsets = NULL;
+    pager->chunk_dirty = NULL;
+    pager->map_dirty = false;
+    pager->free_slots = NULL;
+    pager->released_slots = NULL;
+    pager->compress_buffer = NULL;
+    if (!compressed)
+    {
+        return;
+    }
+
+    int fd = pager->file_descriptor;
+    size_t directory_size = (size_t)COMPRESS_DIRECTORY_PAGES * PAGE_SIZE;
+    pager->compress_buffer = malloc(PAGE_SIZE);
+    pager->chunk_offsets = calloc(1, directory_size);
+    pager->free_slots = calloc(PAGE_SIZE / COMPRESS_SECTOR + 1, sizeof(SlotList));
+    pager->released_slots = calloc(PAGE_SIZE / COMPRESS_SECTOR + 1, sizeof(SlotList));
+    uint64_t file_size = pager->file_length;
+    if (file_size == 0)
+    {
+        void *header = calloc(1, PAGE_SIZE);
+        *header_magic(header) = HEADER_MAGIC;
+        *header_version(header) = HEADER_FORMAT_VERSION;
+        *header_flags(header) = HEADER_FLAG_COMPRESSED;
+        *header_page_size(header) = PAGE_SIZE;
+        if (pwrite(fd, header, PAGE_SIZE, 0) != PAGE_SIZE ||
+            pwrite(fd, pager->chunk_offsets, directory_size, PAGE_SIZE) != (ssize_t)directory_size)
+        {
+            printf("Error writing: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        free(header);
+        sync_file(fd);
+        file_size = compress_data_start();
+    }
+
+    uint32_t header[HEADER_SIZE / sizeof(uint32_t)];
+    if (pread(fd, header, HEADER_SIZE, 0) != HEADER_SIZE ||
+        pread(fd, pager->chunk_offsets, directory_size, PAGE_SIZE) != (ssize_t)directory_size)
+    {
+        printf("Compressed db file has no page map. Corrupt file.\n");
+        exit(EXIT_FAILURE);
+    }
+    pager->num_pages = *header_page_count(header);
+    pager->file_length = compress_data_start();
+    uint32_t chunks = 0;
+    for (uint32_t i = 0; i < compress_max_chunks(); i++)
+    {
+        uint64_t offset = pager->chunk_offsets[i];
+        if (offset % COMPRESS_SECTOR != 0 || offset < compress_data_start() || offset + PAGE_SIZE > file_size)
+        {
+            pager->chunk_offsets[i] = 0;
+            continue;
+        }
+        chunks = i + 1;
+    }
+    if (chunks > 0)
+    {
+        pager_map_reserve(pager, chunks * compress_slots_per_chunk() - 1);
+    }
+    for (uint32_t i = 0; i < chunks; i++)
+    {
+        uint64_t offset = pager->chunk_offsets[i];
+        if (offset == 0)
+        {
+            continue;
+        }
+        if (pread(fd, pager->slots + (size_t)i * compress_slots_per_chunk(), PAGE_SIZE, offset) != PAGE_SIZE)
+        {
+            printf("Error reading file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        if (offset + PAGE_SIZE > pager->file_length)
+        {
+            pager->file_length = offset + PAGE_SIZE;
+        }
+    }
+    // 文件末尾的新空间从所有已用的槽之后开始
+    for (uint32_t page_num = 0; page_num < chunks * compress_slots_per_chunk(); page_num++)
+    {
+        PageSlot *slot = &pager->slots[page_num];
+        uint64_t start = (uint64_t)slot->sector * COMPRESS_SECTOR;
+        uint32_t length = slot->length == 0 ? PAGE_SIZE : slot->length;
+        if (slot->sector == 0)
+        {
+            continue;
+        }
+        if (start < compress_data_start() || start + length > file_size ||
+            length > (uint32_t)slot->capacity * COMPRESS_SECTOR)
+        {
+            memset(slot, 0, sizeof(PageSlot));
+            continue;
+        }
+        if (start + (uint64_t)slot->capacity * COMPRESS_SECTOR > pager->file_length)
+        {
+            pager->file_length = start + (uint64_t)slot->capacity * COMPRESS_SECTOR;
+        }
+    }
+    if (file_size > pager->file_length)
+    {
+        pager->file_length = file_size;
+    }
+    pager_compress_find_free(pager, chunks);
+}
+
+Pager *pager_open(const char *filename, DbOptions *options)
+{
+    uint32_t cache_pages = options->cache_pages;
+    bool use_mmap = options->use_mmap;
+    int fd = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+
+    if (fd == -1)
+    {
+        printf("Unable to open file \n");
+        exit(EXIT_FAILURE);
+    }
+
+    off_t file_length = lseek(fd, 0, SEEK_END);
+    bool compressed;
+    // 有没有子树行数要等 db_open 读到 (可能还在日志里的) 文件头再定
+    layout_init(pager_file_format(fd, file_length, filename, options, &compressed), true);
+
+    Pager *pager = malloc(sizeof(Pager));
+    pager->file_descriptor = fd;
+    memset(&pager->stats, 0, sizeof(PagerStats));
+    pager->file_length = file_length;
+    pager->num_pages = (file_length / PAGE_SIZE);
+
+    if (!compressed && file_length % PAGE_SIZE != 0)
+    {
+        printf("db file is not a whole number of pages. Corrupt file.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pager->mode = PAGER_MODE_BUFFERED;
+    pager->map_base = NULL;
+    pager->map_length = 0;
+    pager->access = PAGER_ACCESS_RANDOM;
+    pager->sync_mode = SYNC_NORMAL;
+    if (compressed && use_mmap)
+    {
+        // 压缩的页在文件里不是按页号排的, 没法直接映射
+        printf("mmap does not work with a compressed file, using the buffer pool.\n");
+        use_mmap = false;
+    }
+    if (use_mmap && options->use_wal)
+    {
+        // 映射的页由内核随时写回, 没法先记日志; 提交时只能按 .sync 让内核写盘
+        printf("mmap mode runs without the log: a crash can leave the db file half written.\n");
+    }
+    if (use_mmap)
+    {
+        cache_pages = 0;
+    }
+    else if (cache_pages < PAGER_MIN_CACHE_PAGES)
+    {
+        cache_pages = PAGER_MIN_CACHE_PAGES;
+    }
+    else if (cache_pages > PAGER_MAX_CACHE_PAGES)
+    {
+        cache_pages = PAGER_MAX_CACHE_PAGES;
+    }
+    pager_init_frames(pager, cache_pages);
+    pager->prefetch_window = options->prefetch_pages;
+    pager->wal_undo = NULL;
+    pager->wal_undo_count = 0;
+    pager->wal_undo_capacity = 0;
+    pager->readers = 0;
+    pthread_cond_init(&pager->readers_done, NULL);
+    pthread_cond_init(&pager->writer_wakeup, NULL);
+    pager->writer_stop = false;
+    pager->writer_running = false;
+
+    /*
+    an existing log is always replayed, even when this session runs
+    without one, so committed work from a crashed session is not lost
+    */
+    pager->wal_path = malloc(strlen(filename) + 5);
+    sprintf(pager->wal_path, "%s-wal", filename);
+    pager->wal_fd = open(pager->wal_path, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+    if (pager->wal_fd == -1)
+    {
+        printf("Unable to open wal file \n");
+        exit(EXIT_FAILURE);
+    }
+    pager->wal_salt = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16);
+    pager->wal_unsynced = false;
+    pager->wal_index_mask = 1023;
+    pager->wal_index_pages = malloc(sizeof(uint32_t) * (pager->wal_index_mask + 1));
+    pager->wal_index_offsets = malloc(sizeof(uint64_t) * (pager->wal_index_mask + 1));
+    wal_index_clear(pager);
+    pager_compress_open(pager, filename, compressed);
+    wal_recover(pager);
+    pager->commit_checksum = pager->wal_checksum;
+    pager->commit_num_pages = pager->num_pages;
+    if (use_mmap || !options->use_wal)
+    {
+        close(pager->wal_fd);
+        unlink(pager->wal_path);
+        free(pager->wal_path);
+        free(pager->wal_index_pages);
+        free(pager->wal_index_offsets);
+        pager->wal_fd = -1;
+    }
+
+    if (use_mmap)
+    {
+        // 只占地址空间, 不占内存; 文件映射从预留区的开头往后长
+        pager->mode = PAGER_MODE_MMAP;
+        pager->map_base = mmap(NULL, PAGER_MMAP_RESERVE, PROT_NONE,
+                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (pager->map_base == MAP_FAILED)
+        {
+            printf("Error reserving address space: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        pager_map_grow(pager, pager->num_pages);
+    }
+
+    // 有日志时后台线程负责组提交的 fdatasync
+    if ((options->background_writer || pager->wal_fd != -1) && pager->mode == PAGER_MODE_BUFFERED)
+    {
+        pthread_create(&pager->writer_thread, NULL, pager_writer_main, pager);
+        pager->writer_running = true;
+    }
+    return pager;
+}
+
+Table *table_new(Pager *pager)
+{
+    Table *table = (Table *)malloc(sizeof(Table));
+
+    table->pager = pager;
+
+    result_writer_init(&table->output, STDOUT_FILENO, OUTPUT_TUPLE);
+    table->messages = stdout;
+    table->scan_threads = 1;
+    table->scan_unordered = false;
+    table->in_batch = false;
+    table->pending_rows = NULL;
+    table->num_pending = 0;
+    table->pending_capacity = 0;
+    table->batch_duplicates = 0;
+    table->prepared = NULL;
+    table->snapshot_of = NULL;
+    table->snapshot = NULL;
+    memset(&table->stats, 0, sizeof(TableStats));
+    table->stats_file = NULL;
+    table->stats_interval_ns = 0;
+    table->stats_last_dump = 0;
+    return table;
+}
+
+Table *db_open(const char *filename, DbOptions *options)
+{
+    key_search_init();
+    Pager *pager = pager_open(filename, options);
+    Table *table = table_new(pager);
+
+    if (pager->num_pages == 0)
+    {
+        // 新文件: 第 0 页是文件头, 根从第 1 页开始
+        void *header = get_page(pager, 0);
+        mark_page_dirty(pager, 0);
+        memset(header, 0, PAGE_SIZE);
+        *header_magic(header) = HEADER_MAGIC;
+        *header_version(header) = HEADER_FORMAT_VERSION;
+        *header_flags(header) = pager->compressed ? HEADER_FLAG_COMPRESSED : 0;
+        *header_page_size(header) = PAGE_SIZE;
+        *header_page_count(header) = 2;
+        *header_root_page(header) = 1;
+        unpin_page(pager, 0);
+
+        void *root_node = get_page(pager, 1);
+        initialize_leaf_node(root_node);
+        set_node_root(root_node, true);
+        mark_page_dirty(pager, 1);
+        unpin_page(pager, 1);
+    }
+    void *header = get_page(pager, 0);
+    if (*header_magic(header) != HEADER_MAGIC)
+    {
+        printf("db file has no valid header. Not a database or an older format.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (*header_version(header) == 0)
+    {
+        // 旧的文件头: 补上版本, 页大小和页数
+        mark_page_dirty(pager, 0);
+        *header_version(header) = HEADER_FORMAT_UNCOUNTED;
+        *header_page_size(header) = PAGE_SIZE;
+        *header_page_count(header) = pager->num_pages;
+    }
+    if (*header_page_count(header) > pager->num_pages)
+    {
+        printf("db file has %u pages but its header says %u. Truncated file.\n", pager->num_pages,
+               *header_page_count(header));
+        exit(EXIT_FAILURE);
+    }
+    layout_init(PAGE_SIZE, *header_version(header) >= HEADER_FORMAT_VERSION);
+    table->root_page_num = *header_root_page(header);
+    for (uint32_t i = 0; i < INDEX_COLUMN_COUNT; i++)
+    {
+        table->index_roots[i] = *header_index_root(header, i);
+    }
+    unpin_page(pager, 0);
+    // 新建的 (或刚补过文件头的) 文件马上提交, 快照从一开始就能看到一个空表
+    pager_commit(pager);
+    return table;
+}
+
+/*
+Snapshot readers. A commit appends every changed page to the log and the
+main file only changes at checkpoints, so the last committed state is
+always the main file overlaid with the log frames up to the last commit
+record, and those pages are never written again. A snapshot is a
+read-only pager over exactly that: it copies the log index, puts back
+the committed entries of pages evicted into the log since the last
+commit, and reads into a small buffer pool of its own. After that the
+reader shares nothing mutable with the writer, so lookups and scans on it
+never wait for an insert. Checkpoints would rewrite the main file and
+restart the log, so they wait until every snapshot has ended.
+Each snapshot belongs to one thread; open one per reader thread.
+*/
+Table *db_snapshot_begin(Table *table, uint32_t cache_pages)
+{
+    Pager *pager = table->pager;
+    if (pager->wal_fd == -1)
+    {
+        return NULL; // 没有日志时主文件随时会被改写, 给不出快照
+    }
+    if (cache_pages < PAGER_MIN_CACHE_PAGES)
+    {
+        cache_pages = PAGER_MIN_CACHE_PAGES;
+    }
+    else if (cache_pages > PAGER_MAX_CACHE_PAGES)
+    {
+        cache_pages = PAGER_MAX_CACHE_PAGES;
+    }
+
+    Pager *snapshot = malloc(sizeof(Pager));
+    memset(snapshot, 0, sizeof(Pager));
+    pager_init_frames(snapshot, cache_pages);
+    snapshot->mode = PAGER_MODE_BUFFERED;
+    snapshot->access = PAGER_ACCESS_RANDOM;
+    snapshot->sync_mode = SYNC_OFF;
+    snapshot->prefetch_window = pager->prefetch_window;
+    snapshot->file_descriptor = pager->file_descriptor;
+    snapshot->wal_fd = pager->wal_fd;
+    // 主文件的真实长度: 检查点被挡住以后它就不会再变
+    struct stat file_stat;
+    fstat(pager->file_descriptor, &file_stat);
+    snapshot->file_length = file_stat.st_size;
+
+    pthread_mutex_lock(&pager->lock);
+    snapshot->read_ns = pager->read_ns;
+    snapshot->num_pages = pager->num_pages;
+    // 页映射也只在检查点时变, 直接共用
+    snapshot->compressed = pager->compressed;
+    snapshot->slots = pager->slots;
+    snapshot->map_chunks = pager->map_chunks;
+    uint32_t index_size = pager->wal_index_mask + 1;
+    snapshot->wal_index_mask = pager->wal_index_mask;
+    snapshot->wal_index_count = pager->wal_index_count;
+    snapshot->wal_index_pages = malloc(sizeof(uint32_t) * index_size);
+    snapshot->wal_index_offsets = malloc(sizeof(uint64_t) * index_size);
+    memcpy(snapshot->wal_index_pages, pager->wal_index_pages, sizeof(uint32_t) * index_size);
+    memcpy(snapshot->wal_index_offsets, pager->wal_index_offsets, sizeof(uint64_t) * index_size);
+    // 倒着还原, 同一页被淘汰多次时最早那次记下的才是提交时的位置
+    for (uint32_t i = pager->wal_undo_count; i-- > 0;)
+    {
+        wal_index_set(snapshot, pager->wal_undo[i].page_num, pager->wal_undo[i].committed_offset);
+    }
+    pager->readers++;
+    pthread_mutex_unlock(&pager->lock);
+
+    Table *reader = table_new(snapshot);
+    reader->snapshot_of = pager;
+    void *header = get_page(snapshot, 0);
+    reader->root_page_num = *header_root_page(header);
+    for (uint32_t i = 0; i < INDEX_COLUMN_COUNT; i++)
+    {
+        reader->index_roots[i] = *header_index_root(header, i);
+    }
+    unpin_page(snapshot, 0);
+    return reader;
+}
+
+void db_snapshot_end(Table *reader)
+{
+    Pager *pager = reader->snapshot_of;
+    pthread_mutex_lock(&pager->lock);
+    pager->readers--;
+    if (pager->readers == 0)
+    {
+        pthread_cond_broadcast(&pager->readers_done);
+    }
+    pthread_mutex_unlock(&pager->lock);
+
+    Pager *snapshot = reader->pager;
+    pager_free_frames(snapshot);
+    free(snapshot->wal_index_pages);
+    free(snapshot->wal_index_offsets);
+    free(snapshot);
+    result_writer_free(&reader->output);
+    free(reader);
+}
+
+InputBuffer *new_input_buffer()
+{
+    InputBuffer *input_buffer = (InputBuffer *)malloc(sizeof(InputBuffer));
+    input_buffer->buffer = NULL;
+    input_buffer->buffer_length = 0;
+    input_buffer->input_length = 0;
+    return input_buffer;
+}
+
+void print_constants()
+{
+    printf("PAGE_SIZE: %d\n", PAGE_SIZE);
+    printf("ROW_SIZE: %d\n", ROW_SIZE);
+    printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
+    printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
+    printf("LEAF_NODE_ENTRY_SIZE: %d\n", LEAF_NODE_ENTRY_SIZE);
+    printf("LEAF_NODE_MIN_VALUE_SIZE: %d\n", LEAF_NODE_MIN_VALUE_SIZE);
+    printf("LEAF_NODE_MAX_VALUE_SIZE: %d\n", LEAF_NODE_MAX_VALUE_SIZE);
+    printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
+    printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
+    printf("INTERNAL_NODE_MAX_CELLS: %d\n", INTERNAL_NODE_MAX_CELLS);
+    printf("KEY_SEARCH_KERNEL: %s\n", key_search_kernel_name);
+}
+
+// 优先复用空闲页链表里的页, 没有时才把文件变长
+uint32_t get_unused_page_num(Pager *pager)
+{
+    void *header = get_page(pager, 0);
+    uint32_t page_num = *header_free_head(header);
+    if (page_num == 0)
+    {
+        // 文件变长一页
+        page_num = pager->num_pages;
+        mark_page_dirty(pager, 0);
+        *header_page_count(header) = page_num + 1;
+        unpin_page(pager, 0);
+        return page_num;
+    }
+    void *page = get_page(pager, page_num);
+    mark_page_dirty(pager, 0);
+    *header_free_head(header) = *free_page_next(page);
+    *header_free_count(header) -= 1;
+    unpin_page(pager, page_num);
+    unpin_page(pager, 0);
+    return page_num;
+}
+
+// 把不再使用的页挂到空闲页链表头上
+void free_page_num(Pager *pager, uint32_t page_num)
+{
+    void *header = get_page(pager, 0);
+    void *page = get_page(pager, page_num);
+    mark_page_dirty(pager, 0);
+    mark_page_dirty(pager, page_num);
+    set_node_type(page, NODE_FREE);
+    set_node_root(page, false);
+    *free_page_next(page) = *header_free_head(header);
+    *header_free_head(header) = page_num;
+    *header_free_count(header) += 1;
+    unpin_page(pager, page_num);
+    unpin_page(pager, 0);
+}
+
+/*
+Forget every page from num_pages on, for rebuilding the file from scratch.
+Their frames are dropped without being written and they read back as
+zeros when allocated again. Needs an empty log, i.e. right after a
+checkpoint. The file keeps its length until pager_truncate_file; in mmap
+mode the file is cut to num_pages on close as usual.
+*/
+void pager_discard_from(Pager *pager, uint32_t num_pages)
+{
+    pthread_mutex_lock(&pager->lock);
+    pager_prefetch_drain(pager);
+    for (uint32_t i = 0; i < pager->num_frames; i++)
+    {
+        Frame *frame = &pager->frames[i];
+        if (frame->page_num != INVALID_PAGE_NUM && frame->page_num >= num_pages)
+        {
+            if (frame->pin_count > 0)
+            {
+                printf("Tried to discard page %d while it is pinned\n", frame->page_num);
+                exit(EXIT_FAILURE);
+            }
+            page_table_remove(pager, frame->page_num);
+            frame->page_num = INVALID_PAGE_NUM;
+            frame->dirty = false;
+            frame->referenced = false;
+        }
+    }
+    pager->num_pages = num_pages;
+    for (uint32_t page_num = num_pages; page_num < pager->map_chunks * compress_slots_per_chunk(); page_num++)
+    {
+        if (pager->slots[page_num].sector != 0)
+        {
+            slot_lists_add(pager->released_slots, pager->slots[page_num].sector, pager->slots[page_num].capacity);
+            memset(&pager->slots[page_num], 0, sizeof(PageSlot));
+            pager->chunk_dirty[page_num / compress_slots_per_chunk()] = true;
+            pager->map_dirty = true;
+        }
+    }
+    if (pager->mode == PAGER_MODE_BUFFERED && !pager->compressed &&
+        pager->file_length > (uint64_t)num_pages * PAGE_SIZE)
+    {
+        pager->file_length = (uint64_t)num_pages * PAGE_SIZE;
+    }
+    pthread_mutex_unlock(&pager->lock);
+}
+
+/*
+compressed files are not cut but compacted: free slots are only reused,
+never given back to the file system, so every page is copied into a new file, in page order
+and in a slot of exactly its size, and the copy is renamed over the old
+file. A crash before the rename leaves the old file as it was. The buffer
+pool keeps its pages, only their place in the file changes. Caller holds
+pager->lock.
+*/
+void pager_compact(Pager *pager)
+{
+    if (pager->wal_fd == -1)
+    {
+        pager_write_back(pager, UINT32_MAX); // 没有日志时新树还在缓冲池里
+    }
+    char *compact_path = malloc(strlen(pager->path) + 9);
+    sprintf(compact_path, "%s-compact", pager->path);
+    int fd = open(compact_path, O_RDWR | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+    if (fd == -1)
+    {
+        printf("Unable to create %s\n", compact_path);
+        exit(EXIT_FAILURE);
+    }
+
+    uint32_t per_chunk = compress_slots_per_chunk();
+    uint32_t chunks = (pager->num_pages + per_chunk - 1) / per_chunk;
+    size_t directory_size = (size_t)COMPRESS_DIRECTORY_PAGES * PAGE_SIZE;
+    PageSlot *slots = calloc(chunks, PAGE_SIZE);
+    uint64_t *chunk_offsets = calloc(1, directory_size);
+    uint8_t *buffer = malloc(PAGE_SIZE);
+    uint64_t end = compress_data_start();
+    for (uint32_t page_num = 0; page_num < pager->num_pages; page_num++)
+    {
+        PageSlot slot = {0};
+        if (page_num < pager->map_chunks * per_chunk)
+        {
+            slot = pager->slots[page_num];
+        }
+        if (page_num != 0 && slot.sector == 0)
+        {
+            continue; // 从没写进主文件的页, 读出来是全零
+        }
+        uint32_t length = slot.length == 0 ? PAGE_SIZE : slot.length;
+        off_t from = (off_t)slot.sector * COMPRESS_SECTOR;
+        off_t to = 0;
+        if (page_num != 0)
+        {
+            uint32_t sectors = (length + COMPRESS_SECTOR - 1) / COMPRESS_SECTOR;
+            slots[page_num].sector = end / COMPRESS_SECTOR;
+            slots[page_num].length = slot.length;
+            slots[page_num].capacity = sectors;
+            to = end;
+            end += (uint64_t)sectors * COMPRESS_SECTOR;
+        }
+        if (pread(pager->file_descriptor, buffer, length, from) != (ssize_t)length ||
+            pwrite(fd, buffer, length, to) != (ssize_t)length)
+        {
+            printf("Error compacting db file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        pager->stats.bytes_written += length;
+    }
+    for (uint32_t i = 0; i < chunks; i++)
+    {
+        chunk_offsets[i] = end;
+        if (pwrite(fd, slots + (size_t)i * per_chunk, PAGE_SIZE, end) != PAGE_SIZE)
+        {
+            printf("Error compacting db file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        end += PAGE_SIZE;
+    }
+    if (pwrite(fd, chunk_offsets, directory_size, PAGE_SIZE) != (ssize_t)directory_size)
+    {
+        printf("Error compacting db file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    if (pager->sync_mode != SYNC_OFF)
+    {
+        sync_file(fd);
+    }
+    if (rename(compact_path, pager->path) == -1 || dup2(fd, pager->file_descriptor) == -1)
+    {
+        printf("Error replacing db file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    free(compact_path);
+    free(buffer);
+
+    free(pager->slots);
+    free(pager->chunk_offsets);
+    free(pager->chunk_dirty);
+    pager->slots = slots;
+    pager->chunk_offsets = chunk_offsets;
+    pager->chunk_dirty = calloc(chunks, sizeof(bool));
+    pager->map_chunks = chunks;
+    pager->map_dirty = false;
+    pager->file_length = end;
+    pager_slots_reset(pager, false);
+}
+
+// 把主文件截到 num_pages 页
+void pager_truncate_file(Pager *pager)
+{
+    if (pager->mode == PAGER_MODE_MMAP)
+    {
+        return;
+    }
+    pthread_mutex_lock(&pager->lock);
+    if (pager->compressed)
+    {
+        pager_compact(pager);
+        pthread_mutex_unlock(&pager->lock);
+        return;
+    }
+    if (ftruncate(pager->file_descriptor, (off_t)pager->num_pages * PAGE_SIZE) == -1)
+    {
+        printf("Error truncating db file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    pager->file_length = (uint64_t)pager->num_pages * PAGE_SIZE;
+    pthread_mutex_unlock(&pager->lock);
+}
+
+void print_prompt() { printf("db > "); }
+
+// 读一行; 输入结束时返回 false
+bool read_input(InputBuffer *input_buffer)
+{
+    ssize_t bytes_read =
+        getline(&(input_buffer->buffer), &(input_buffer->buffer_length), stdin);
+
+    if (bytes_read <= 0)
+    {
+        return false;
+    }
+
+    if (input_buffer->buffer[bytes_read - 1] == '\n')
+    {
+        bytes_read--;
+    }
+    input_buffer->input_length = bytes_read;
+    input_buffer->buffer[bytes_read] = 0;
+    return true;
+}
+
+void close_input_buffer(InputBuffer *input_buffer)
+{
+    free(input_buffer->buffer);
+    free(input_buffer);
+}
+
+// insert id username email [id username email ...]
+NodeType get_node_type(void *node)
+{
+    uint8_t value = *((uint8_t *)(node + NODE_TYPE_OFFSET));
+    return (NodeType)value;
+}
+
+// 内部节点的最大 key 在最右孩子的子树里, 一直往右走到叶子
+uint32_t get_node_max_key(Pager *pager, void *node)
+{
+    if (get_node_type(node) == NODE_LEAF)
+    {
+        return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+    }
+    uint32_t page_num = *internal_node_right_child(node);
+    while (true)
+    {
+        void *child = get_page(pager, page_num);
+        if (get_node_type(child) == NODE_LEAF)
+        {
+            uint32_t max_key = *leaf_node_key(child, *leaf_node_num_cells(child) - 1);
+            unpin_page(pager, page_num);
+            return max_key;
+        }
+        uint32_t right_child_page_num = *internal_node_right_child(child);
+        unpin_page(pager, page_num);
+        page_num = right_child_page_num;
+    }
+}
+
+uint32_t *node_parent(void *node) { return node + PARENT_POINTER_OFFSET; }
+
+uint32_t internal_node_find_child(void *node, uint32_t key)
+{
+    uint32_t num_keys = *internal_node_num_keys(node);
+
+    return key_lower_bound(internal_node_key(node, 0), num_keys, key);
+}
+
+// child 在父节点里的下标; 叶子可能已经删空, 不能按 key 找
+uint32_t internal_node_child_index(void *node, uint32_t child_page_num)
+{
+    uint32_t num_keys = *internal_node_num_keys(node);
+    for (uint32_t i = 0; i < num_keys; i++)
+    {
+        if (*internal_node_cell(node, i) == child_page_num)
+        {
+            return i;
+        }
+    }
+    return num_keys;
+}
+
+// 子树里的行数: 叶子数自己的行, 内部节点把各孩子的行数加起来
+uint32_t node_row_count(void *node)
+{
+    if (get_node_type(node) == NODE_LEAF)
+    {
+        return *leaf_node_num_cells(node);
+    }
+    uint32_t rows = 0;
+    for (uint32_t i = 0; i <= *internal_node_num_keys(node); i++)
+    {
+        rows += *internal_node_count(node, i);
+    }
+    return rows;
+}
+
+/*
+Inserting or deleting rows changes the count of every internal node on
+the path from the root down to the leaf holding key, so the path is
+adjusted before the leaf changes shape. Splits, merges and redistributions
+below only move rows between siblings under one parent, and recount those
+siblings from the nodes themselves (internal_node_recount_child).
+*/
+void table_count_add(Table *table, uint32_t key, int32_t delta)
+{
+    if (!INTERNAL_NODE_HAS_COUNTS)
+    {
+        return;
+    }
+    Pager *pager = table->pager;
+    uint32_t page_num = table->root_page_num;
+    while (true)
+    {
+        void *node = get_page(pager, page_num);
+        if (get_node_type(node) == NODE_LEAF)
+        {
+            unpin_page(pager, page_num);
+            return;
+        }
+        mark_page_dirty(pager, page_num);
+        uint32_t child_num = internal_node_find_child(node, key);
+        *internal_node_count(node, child_num) += delta;
+        uint32_t child_page_num = *internal_node_child(node, child_num);
+        unpin_page(pager, page_num);
+        page_num = child_page_num;
+    }
+}
+
+// 重新数一遍 child 的行数, 写到 parent 里它那一项; parent 由调用者标脏
+void internal_node_recount_child(Pager *pager, void *parent, uint32_t child_page_num)
+{
+    if (!INTERNAL_NODE_HAS_COUNTS)
+    {
+        return;
+    }
+    void *child = get_page(pager, child_page_num);
+    *internal_node_count(parent, internal_node_child_index(parent, child_page_num)) = node_row_count(child);
+    unpin_page(pager, child_page_num);
+}
+
+void create_new_root(Table *table, uint32_t right_child_page_num)
+{
+    void *root = get_page(table->pager, table->root_page_num);
+    void *right_child = get_page(table->pager, right_child_page_num);
+
+    uint32_t left_child_page_num = get_unused_page_num(table->pager);
+    void *left_child = get_page(table->pager, left_child_page_num);
+    mark_page_dirty(table->pager, table->root_page_num);
+    mark_page_dirty(table->pager, right_child_page_num);
+    mark_page_dirty(table->pager, left_child_page_num);
+
+    memcpy(left_child, root, PAGE_SIZE);
+    set_node_root(left_child, false);
+
+    if (get_node_type(left_child) == NODE_INTERNAL)
+    {
+        // 旧根的孩子搬到了新的左孩子下面
+        for (uint32_t i = 0; i <= *internal_node_num_keys(left_child); i++)
+        {
+            uint32_t child_page_num = *internal_node_child(left_child, i);
+            void *child = get_page(table->pager, child_page_num);
+            mark_page_dirty(table->pager, child_page_num);
+            *node_parent(child) = left_child_page_num;
+            unpin_page(table->pager, child_page_num);
+        }
+    }
+
+    initialize_internal_node(root);
+    set_node_root(root, true);
+    *internal_node_num_keys(root) = 1;
+    *internal_node_child(root, 0) = left_child_page_num;
+    uint32_t left_child_max_key = get_node_max_key(table->pager, left_child);
+    *internal_node_key(root, 0) = left_child_max_key;
+    *internal_node_right_child(root) = right_child_page_num;
+    if (INTERNAL_NODE_HAS_COUNTS)
+    {
+        *internal_node_count(root, 0) = node_row_count(left_child);
+        *internal_node_count(root, 1) = node_row_count(right_child);
+    }
+
+    *node_parent(left_child) = table->root_page_num;
+    *node_parent(right_child) = table->root_page_num;
+
+    unpin_page(table->pager, left_child_page_num);
+    unpin_page(table->pager, right_child_page_num);
+    unpin_page(table->pager, table->root_page_num);
+}
+
+void update_internal_node_key(void *node, uint32_t old_key, uint32_t new_key)
+{
+    uint32_t old_child_index = internal_node_find_child(node, old_key);
+    // 最右孩子没有自己的 key
+    if (old_child_index < *internal_node_num_keys(node))
+    {
+        *internal_node_key(node, old_child_index) = new_key;
+    }
+}
+
+// 用排好序的 count 个孩子填满一个内部节点, 最后一个作为最右孩子; counts 是各孩子的行数
+void internal_node_fill(void *node, uint32_t *children, uint32_t *keys, uint32_t *counts, uint32_t count)
+{
+    *internal_node_num_keys(node) = count - 1;
+    for (uint32_t i = 0; i + 1 < count; i++)
+    {
+        *internal_node_child(node, i) = children[i];
+        *internal_node_key(node, i) = keys[i];
+    }
+    *internal_node_right_child(node) = children[count - 1];
+    if (INTERNAL_NODE_HAS_COUNTS)
+    {
+        for (uint32_t i = 0; i < count; i++)
+        {
+            *internal_node_count(node, i) = counts[i];
+        }
+    }
+}
+
+void internal_node_insert(Table *table, uint32_t parent_page_num,
+                          uint32_t child_page_num);
+
+void internal_node_split_and_insert(Table *table, uint32_t parent_page_num,
+                                    uint32_t child_page_num)
+{
+    Pager *pager = table->pager;
+    table->stats.internal_splits++;
+    void *old_node = get_page(pager, parent_page_num);
+    mark_page_dirty(pager, parent_page_num);
+    uint32_t old_num_keys = *internal_node_num_keys(old_node);
+    uint32_t old_max = get_node_max_key(pager, old_node);
+
+    void *child = get_page(pager, child_page_num);
+    uint32_t child_max = get_node_max_key(pager, child);
+    uint32_t child_rows = INTERNAL_NODE_HAS_COUNTS ? node_row_count(child) : 0;
+    unpin_page(pager, child_page_num);
+
+    /*
+    Lay the old children plus the new one out in key order. The key of
+    every child is its max key, the old right child's being old_max.
+    */
+    uint32_t total = old_num_keys + 2;
+    uint32_t *children = malloc(sizeof(uint32_t) * total);
+    uint32_t *keys = malloc(sizeof(uint32_t) * total);
+    uint32_t *counts = malloc(sizeof(uint32_t) * total);
+    uint32_t count = 0;
+    bool inserted = false;
+    for (uint32_t i = 0; i <= old_num_keys; i++)
+    {
+        uint32_t key = i < old_num_keys ? *internal_node_key(old_node, i) : old_max;
+        if (!inserted && child_max < key)
+        {
+            children[count] = child_page_num;
+            counts[count] = child_rows;
+            keys[count++] = child_max;
+            inserted = true;
+        }
+        children[count] = *internal_node_child(old_node, i);
+        counts[count] = INTERNAL_NODE_HAS_COUNTS ? *internal_node_count(old_node, i) : 0;
+        keys[count++] = key;
+    }
+    if (!inserted)
+    {
+        children[count] = child_page_num;
+        counts[count] = child_rows;
+        keys[count++] = child_max;
+    }
+
+    uint32_t left_count = total / 2;
+    uint32_t new_page_num = get_unused_page_num(pager);
+    void *new_node = get_page(pager, new_page_num);
+    mark_page_dirty(pager, new_page_num);
+    initialize_internal_node(new_node);
+    internal_node_fill(old_node, children, keys, counts, left_count);
+    internal_node_fill(new_node, children + left_count, keys + left_count, counts + left_count,
+                       total - left_count);
+
+    for (uint32_t i = 0; i < total; i++)
+    {
+        if (i < left_count && children[i] != child_page_num)
+        {
+            continue;
+        }
+        void *moved = get_page(pager, children[i]);
+        mark_page_dirty(pager, children[i]);
+        *node_parent(moved) = i < left_count ? parent_page_num : new_page_num;
+        unpin_page(pager, children[i]);
+    }
+
+    bool splitting_root = is_node_root(old_node);
+    uint32_t grandparent_page_num = *node_parent(old_node);
+    uint32_t new_left_max = keys[left_count - 1];
+    free(children);
+    free(keys);
+    free(counts);
+    unpin_page(pager, new_page_num);
+    unpin_page(pager, parent_page_num);
+
+    if (splitting_root)
+    {
+        create_new_root(table, new_page_num);
+    }
+    else
+    {
+        // 祖父里旧节点那一项先只算留下的孩子, 新节点的行数由 internal_node_insert 加上
+        void *grandparent = get_page(pager, grandparent_page_num);
+        mark_page_dirty(pager, grandparent_page_num);
+        update_internal_node_key(grandparent, old_max, new_left_max);
+        internal_node_recount_child(pager, grandparent, parent_page_num);
+        unpin_page(pager, grandparent_page_num);
+        internal_node_insert(table, grandparent_page_num, new_page_num);
+    }
+}
+
+void internal_node_insert(Table *table, uint32_t parent_page_num,
+                          uint32_t child_page_num)
+{
+    /*
+    Add a new child/key pair to parent that corresponds to child
+    */
+
+    void *parent = get_page(table->pager, parent_page_num);
+    uint32_t original_num_keys = *internal_node_num_keys(parent);
+    if (original_num_keys >= INTERNAL_NODE_MAX_CELLS)
+    {
+        unpin_page(table->pager, parent_page_num);
+        internal_node_split_and_insert(table, parent_page_num, child_page_num);
+        return;
+    }
+
+    mark_page_dirty(table->pager, parent_page_num);
+    void *child = get_page(table->pager, child_page_num);
+    mark_page_dirty(table->pager, child_page_num);
+    *node_parent(child) = parent_page_num;
+    uint32_t child_max_key = get_node_max_key(table->pager, child);
+    uint32_t child_rows = INTERNAL_NODE_HAS_COUNTS ? node_row_count(child) : 0;
+    uint32_t index = internal_node_find_child(parent, child_max_key);
+    *internal_node_num_keys(parent) = original_num_keys + 1;
+
+    uint32_t right_child_page_num = *internal_node_right_child(parent);
+    void *right_child = get_page(table->pager, right_child_page_num);
+    uint32_t right_child_max_key = get_node_max_key(table->pager, right_child);
+    unpin_page(table->pager, right_child_page_num);
+    unpin_page(table->pager, child_page_num);
+
+    if (child_max_key > right_child_max_key)
+    {
+        /* Replace right child */
+        *internal_node_child(parent, original_num_keys) = right_child_page_num;
+        *internal_node_key(parent, original_num_keys) = right_child_max_key;
+        *internal_node_right_child(parent) = child_page_num;
+        if (INTERNAL_NODE_HAS_COUNTS)
+        {
+            uint32_t *right_rows = internal_node_cell_count(parent, INTERNAL_NODE_MAX_CELLS);
+            *internal_node_cell_count(parent, original_num_keys) = *right_rows;
+            *right_rows = child_rows;
+        }
+    }
+    else
+    {
+        /* Make room for the new cell */
+        memmove(internal_node_key(parent, index + 1), internal_node_key(parent, index),
+                (original_num_keys - index) * INTERNAL_NODE_KEYS_SIZE);
+        memmove(internal_node_cell(parent, index + 1), internal_node_cell(parent, index),
+                (original_num_keys - index) * INTERNAL_NODE_CHILD_SIZE);
+        *internal_node_child(parent, index) = child_page_num;
+        *internal_node_key(parent, index) = child_max_key;
+        if (INTERNAL_NODE_HAS_COUNTS)
+        {
+            memmove(internal_node_cell_count(parent, index + 1), internal_node_cell_count(parent, index),
+                    (original_num_keys - index) * INTERNAL_NODE_COUNT_SIZE);
+            *internal_node_cell_count(parent, index) = child_rows;
+        }
+    }
+    unpin_page(table->pager, parent_page_num);
+}
+
+// 在 index 处插入一个目录项: 键数组变长 4 字节, 槽数组整体往后挪
+void leaf_node_insert_entry(void *node, uint32_t index, uint32_t key, uint16_t value_offset)
+{
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    uint32_t *keys = leaf_node_key(node, 0);
+    uint16_t *old_slots = leaf_node_slot(node, 0);
+    uint16_t *new_slots = (uint16_t *)(keys + num_cells + 1);
+    // 从高地址往低地址搬, 前面的搬动不会覆盖还没搬的数据
+    memmove(new_slots + index + 1, old_slots + index, (num_cells - index) * LEAF_NODE_SLOT_SIZE);
+    memmove(new_slots, old_slots, index * LEAF_NODE_SLOT_SIZE);
+    memmove(keys + index + 1, keys + index, (num_cells - index) * LEAF_NODE_KEY_SIZE);
+    keys[index] = key;
+    new_slots[index] = value_offset;
+    *leaf_node_num_cells(node) = num_cells + 1;
+}
+
+// 把 value 放到内容区最前面, 目录项追加在最后; 调用者保证空间足够
+void leaf_node_append_cell(void *node, uint32_t key, void *value, uint32_t size)
+{
+    *leaf_node_content_start(node) -= size;
+    memcpy(node + *leaf_node_content_start(node), value, size);
+    leaf_node_insert_entry(node, *leaf_node_num_cells(node), key, *leaf_node_content_start(node));
+}
+
+// 重新紧凑地排列所有 value, 把碎片合并进中间的空闲区
+void leaf_node_defragment(void *node)
+{
+    uint8_t scratch[PAGE_SIZE];
+    memcpy(scratch, node, PAGE_SIZE);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    *leaf_node_num_cells(node) = 0;
+    *leaf_node_content_start(node) = PAGE_SIZE;
+    *leaf_node_fragmented_bytes(node) = 0;
+    for (uint32_t i = 0; i < num_cells; i++)
+    {
+        leaf_node_append_cell(node, *leaf_node_key(scratch, i), leaf_node_value(scratch, i),
+                              leaf_node_value_size(scratch, i));
+    }
+}
+
+// 清空叶子的单元, 再按顺序放入 count 个单元; 节点类型、父指针和 next_leaf 不变
+void leaf_node_fill(void *node, uint32_t *keys, void **values, uint32_t *sizes, uint32_t count)
+{
+    *leaf_node_num_cells(node) = 0;
+    *leaf_node_content_start(node) = PAGE_SIZE;
+    *leaf_node_fragmented_bytes(node) = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        leaf_node_append_cell(node, keys[i], values[i], sizes[i]);
+    }
+}
+
+void leaf_node_split_and_insert(Cursor *cursor, uint32_t key, void *value, uint32_t value_size)
+{
+    Pager *pager = cursor->table->pager;
+    cursor->table->stats.leaf_splits++;
+    void *old_node = get_page(pager, cursor->page_num);
+    uint32_t old_max = get_node_max_key(pager, old_node);
+    uint32_t new_page_num = get_unused_page_num(pager);
+    void *new_node = get_page(pager, new_page_num);
+    mark_page_dirty(pager, cursor->page_num);
+    mark_page_dirty(pager, new_page_num);
+    initialize_leaf_node(new_node);
+
+    *node_parent(new_node) = *node_parent(old_node);
+    *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
+    *leaf_node_next_leaf(old_node) = new_page_num;
+
+    /*
+    cells are variable length, so the split point is chosen by bytes:
+    the left node takes cells until it holds half of the payload.
+    Work from a copy of the old page since it is rebuilt in place.
+    */
+    uint8_t scratch[PAGE_SIZE];
+    memcpy(scratch, old_node, PAGE_SIZE);
+
+    uint32_t total_cells = *leaf_node_num_cells(scratch) + 1;
+    uint32_t keys[LEAF_NODE_MAX_CELLS + 1];
+    void *values[LEAF_NODE_MAX_CELLS + 1];
+    uint32_t sizes[LEAF_NODE_MAX_CELLS + 1];
+    uint32_t total_bytes = 0;
+    for (uint32_t i = 0; i < total_cells; i++)
+    {
+        if (i == cursor->cell_num)
+        {
+            keys[i] = key;
+            values[i] = value;
+            sizes[i] = value_size;
+        }
+        else
+        {
+            uint32_t old_index = i > cursor->cell_num ? i - 1 : i;
+            keys[i] = *leaf_node_key(scratch, old_index);
+            values[i] = leaf_node_value(scratch, old_index);
+            sizes[i] = leaf_node_value_size(scratch, old_index);
+        }
+        total_bytes += sizes[i] + LEAF_NODE_ENTRY_SIZE;
+    }
+
+    uint32_t left_count = 0;
+    uint32_t left_bytes = 0;
+    while (left_count < total_cells - 1 && (left_count == 0 || left_bytes < total_bytes / 2))
+    {
+        left_bytes += sizes[left_count] + LEAF_NODE_ENTRY_SIZE;
+        left_count++;
+    }
+
+    leaf_node_fill(old_node, keys, values, sizes, left_count);
+    leaf_node_fill(new_node, keys + left_count, values + left_count, sizes + left_count,
+                   total_cells - left_count);
+
+    // 往上递归之前先放掉两个叶子的 pin, 树再高也只 pin 住常数个页
+    bool splitting_root = is_node_root(old_node);
+    uint32_t parent_page_num = *node_parent(old_node);
+    uint32_t new_max = get_node_max_key(pager, old_node);
+    unpin_page(pager, new_page_num);
+    unpin_page(pager, cursor->page_num);
+
+    if (splitting_root)
+    {
+        create_new_root(cursor->table, new_page_num);
+    }
+    else
+    {
+        void *parent = get_page(pager, parent_page_num);
+        mark_page_dirty(pager, parent_page_num);
+        update_internal_node_key(parent, old_max, new_max);
+        internal_node_recount_child(pager, parent, cursor->page_num);
+        unpin_page(pager, parent_page_num);
+        internal_node_insert(cursor->table, parent_page_num, new_page_num);
+    }
+}
+
+void leaf_node_insert(Cursor *cursor, uint32_t key, void *value, uint32_t row_size)
+{
+    table_count_add(cursor->table, key, 1);
+    void *node = get_page(cursor->table->pager, cursor->page_num);
+    if (leaf_node_free_space(node) < row_size + LEAF_NODE_ENTRY_SIZE)
+    {
+        unpin_page(cursor->table->pager, cursor->page_num);
+        leaf_node_split_and_insert(cursor, key, value, row_size);
+        return;
+    }
+    mark_page_dirty(cursor->table->pager, cursor->page_num);
+
+    if (leaf_node_gap(node) < row_size + LEAF_NODE_ENTRY_SIZE)
+    {
+        leaf_node_defragment(node);
+    }
+
+    // value 放进内容区, 只移动键和槽数组给新行腾位置
+    *leaf_node_content_start(node) -= row_size;
+    uint16_t value_offset = *leaf_node_content_start(node);
+    memcpy(node + value_offset, value, row_size);
+    leaf_node_insert_entry(node, cursor->cell_num, key, value_offset);
+    unpin_page(cursor->table->pager, cursor->page_num);
+}
+
+// 删掉 index 处的目录项, 与 leaf_node_insert_entry 相反; value 挨着空闲区时直接还给空闲区
+void leaf_node_remove_entry(void *node, uint32_t index)
+{
+    uint32_t num_cells = *leaf_node_num_cells(node);
+    uint32_t *keys = leaf_node_key(node, 0);
+    uint16_t *old_slots = leaf_node_slot(node, 0);
+    uint16_t *new_slots = (uint16_t *)(keys + num_cells - 1);
+    uint32_t size = leaf_node_value_size(node, index);
+    if (old_slots[index] == *leaf_node_content_start(node))
+    {
+        *leaf_node_content_start(node) += size;
+    }
+    else
+    {
+        *leaf_node_fragmented_bytes(node) += size;
+    }
+    // 从低地址往高地址搬, 前面的搬动不会覆盖还没搬的数据
+    memmove(keys + index, keys + index + 1, (num_cells - index - 1) * LEAF_NODE_KEY_SIZE);
+    memmove(new_slots, old_slots, index * LEAF_NODE_SLOT_SIZE);
+    memmove(new_slots + index, old_slots + index + 1, (num_cells - index - 1) * LEAF_NODE_SLOT_SIZE);
+    *leaf_node_num_cells(node) = num_cells - 1;
+    if (num_cells == 1)
+    {
+        *leaf_node_content_start(node) = PAGE_SIZE;
+        *leaf_node_fragmented_bytes(node) = 0;
+    }
+}
+
+uint32_t leaf_node_used_bytes(void *node)
+{
+    return LEAF_NODE_SPACE_FOR_CELLS - leaf_node_free_space(node);
+}
+
+// 去掉第 index 个孩子 (index > 0), 它的 key 范围并给左边的兄弟
+void internal_node_remove_child(void *node, uint32_t index)
+{
+    uint32_t num_keys = *internal_node_num_keys(node);
+    uint32_t removed = index;
+    if (index == num_keys)
+    {
+        *internal_node_right_child(node) = *internal_node_cell(node, index - 1);
+        removed = index - 1;
+    }
+    else
+    {
+        *internal_node_key(node, index - 1) = *internal_node_key(node, index);
+    }
+    memmove(internal_node_key(node, removed), internal_node_key(node, removed + 1),
+            (num_keys - removed - 1) * INTERNAL_NODE_KEYS_SIZE);
+    memmove(internal_node_cell(node, removed), internal_node_cell(node, removed + 1),
+            (num_keys - removed - 1) * INTERNAL_NODE_CHILD_SIZE);
+    if (INTERNAL_NODE_HAS_COUNTS)
+    {
+        // 行数跟着孩子走; 被并掉的那个孩子的行由调用者重新数进左兄弟
+        if (index == num_keys)
+        {
+            *internal_node_cell_count(node, INTERNAL_NODE_MAX_CELLS) = *internal_node_cell_count(node, index - 1);
+        }
+        memmove(internal_node_cell_count(node, removed), internal_node_cell_count(node, removed + 1),
+                (num_keys - removed - 1) * INTERNAL_NODE_COUNT_SIZE);
+    }
+    *internal_node_num_keys(node) = num_keys - 1;
+}
+
+void set_parent_page_num(Pager *pager, uint32_t page_num, uint32_t parent_page_num)
+{
+    void *node = get_page(pager, page_num);
+    mark_page_dirty(pager, page_num);
+    *node_parent(node) = parent_page_num;
+    unpin_page(pager, page_num);
+}
+
+// 根只剩一个孩子时把孩子搬进根页, 树矮一层
+void collapse_root(Table *table)
+{
+    Pager *pager = table->pager;
+    void *root = get_page(pager, table->root_page_num);
+    mark_page_dirty(pager, table->root_page_num);
+    uint32_t child_page_num = *internal_node_right_child(root);
+    void *child = get_page(pager, child_page_num);
+    memcpy(root, child, PAGE_SIZE);
+    set_node_root(root, true);
+    *node_parent(root) = 0;
+    unpin_page(pager, child_page_num);
+    free_page_num(pager, child_page_num);
+
+    if (get_node_type(root) == NODE_INTERNAL)
+    {
+        for (uint32_t i = 0; i <= *internal_node_num_keys(root); i++)
+        {
+            set_parent_page_num(pager, *internal_node_child(root, i), table->root_page_num);
+        }
+    }
+    unpin_page(pager, table->root_page_num);
+}
+
+/*
+An internal node with too few children is combined with its neighbour
+under the same parent: if both fit in one node they are merged and the
+right one is freed (which may underflow the parent in turn), otherwise
+the children are split evenly between the two.
+*/
+void internal_node_rebalance(Table *table, uint32_t page_num)
+{
+    Pager *pager = table->pager;
+    void *node = get_page(pager, page_num);
+    uint32_t num_children = *internal_node_num_keys(node) + 1;
+    bool root = is_node_root(node);
+    uint32_t parent_page_num = *node_parent(node);
+    unpin_page(pager, page_num);
+    if (root)
+    {
+        if (num_children == 1)
+        {
+            collapse_root(table);
+        }
+        return;
+    }
+    if (num_children >= INTERNAL_NODE_MIN_CHILDREN)
+    {
+        return;
+    }
+
+    void *parent = get_page(pager, parent_page_num);
+    mark_page_dirty(pager, parent_page_num);
+    uint32_t parent_num_keys = *internal_node_num_keys(parent);
+    uint32_t index = internal_node_child_index(parent, page_num);
+    uint32_t left_index = index < parent_num_keys ? index : index - 1;
+    uint32_t left_page_num = *internal_node_child(parent, left_index);
+    uint32_t right_page_num = *internal_node_child(parent, left_index + 1);
+    void *left = get_page(pager, left_page_num);
+    void *right = get_page(pager, right_page_num);
+    mark_page_dirty(pager, left_page_num);
+    mark_page_dirty(pager, right_page_num);
+
+    // 两个节点的孩子按顺序排开, 每个孩子的 key 是它子树的上界
+    uint32_t left_count = *internal_node_num_keys(left) + 1;
+    uint32_t right_count = *internal_node_num_keys(right) + 1;
+    uint32_t total = left_count + right_count;
+    uint32_t children[2 * (INTERNAL_NODE_MAX_CELLS + 1)];
+    uint32_t keys[2 * (INTERNAL_NODE_MAX_CELLS + 1)];
+    uint32_t counts[2 * (INTERNAL_NODE_MAX_CELLS + 1)];
+    for (uint32_t i = 0; i < left_count; i++)
+    {
+        children[i] = *internal_node_child(left, i);
+        keys[i] = i + 1 < left_count ? *internal_node_key(left, i) : *internal_node_key(parent, left_index);
+        counts[i] = INTERNAL_NODE_HAS_COUNTS ? *internal_node_count(left, i) : 0;
+    }
+    for (uint32_t i = 0; i < right_count; i++)
+    {
+        children[left_count + i] = *internal_node_child(right, i);
+        keys[left_count + i] = i + 1 < right_count ? *internal_node_key(right, i) : UINT32_MAX;
+        counts[left_count + i] = INTERNAL_NODE_HAS_COUNTS ? *internal_node_count(right, i) : 0;
+    }
+
+    bool merged = total <= INTERNAL_NODE_MAX_CELLS + 1;
+    uint32_t new_left_count = merged ? total : total / 2;
+    internal_node_fill(left, children, keys, counts, new_left_count);
+    if (!merged)
+    {
+        internal_node_fill(right, children + new_left_count, keys + new_left_count, counts + new_left_count,
+                           total - new_left_count);
+        *internal_node_key(parent, left_index) = keys[new_left_count - 1];
+        internal_node_recount_child(pager, parent, right_page_num);
+    }
+    unpin_page(pager, left_page_num);
+    unpin_page(pager, right_page_num);
+
+    // 只有换了节点的孩子需要改父指针
+    for (uint32_t i = 0; i < total; i++)
+    {
+        bool was_left = i < left_count;
+        bool is_left = i < new_left_count;
+        if (was_left != is_left)
+        {
+            set_parent_page_num(pager, children[i], is_left ? left_page_num : right_page_num);
+        }
+    }
+    if (merged)
+    {
+        internal_node_remove_child(parent, left_index + 1);
+        free_page_num(pager, right_page_num);
+    }
+    internal_node_recount_child(pager, parent, left_page_num);
+    unpin_page(pager, parent_page_num);
+    if (merged)
+    {
+        internal_node_rebalance(table, parent_page_num);
+    }
+}
+
+/*
+Same for a leaf that fell below LEAF_NODE_MIN_USED_BYTES: merge it with
+its neighbour when the cells of both fit in one page (the left leaf takes
+over the right one's next_leaf), otherwise redistribute the cells by bytes
+and move the separator key in the parent.
+*/
+void leaf_node_rebalance(Table *table, uint32_t page_num)
+{
+    Pager *pager = table->pager;
+    void *node = get_page(pager, page_num);
+    bool balanced = is_node_root(node) || leaf_node_used_bytes(node) >= LEAF_NODE_MIN_USED_BYTES;
+    uint32_t parent_page_num = *node_parent(node);
+    unpin_page(pager, page_num);
+    if (balanced)
+    {
+        return;
+    }
+
+    void *parent = get_page(pager, parent_page_num);
+    mark_page_dirty(pager, parent_page_num);
+    uint32_t parent_num_keys = *internal_node_num_keys(parent);
+    uint32_t index = internal_node_child_index(parent, page_num);
+    uint32_t left_index = index < parent_num_keys ? index : index - 1;
+    uint32_t left_page_num = *internal_node_child(parent, left_index);
+    uint32_t right_page_num = *internal_node_child(parent, left_index + 1);
+    void *left = get_page(pager, left_page_num);
+    void *right = get_page(pager, right_page_num);
+    mark_page_dirty(pager, left_page_num);
+    mark_page_dirty(pager, right_page_num);
+
+    uint8_t scratch[2][PAGE_SIZE];
+    memcpy(scratch[0], left, PAGE_SIZE);
+    memcpy(scratch[1], right, PAGE_SIZE);
+    uint32_t keys[2 * LEAF_NODE_MAX_CELLS];
+    void *values[2 * LEAF_NODE_MAX_CELLS];
+    uint32_t sizes[2 * LEAF_NODE_MAX_CELLS];
+    uint32_t total_cells = 0;
+    uint32_t total_bytes = 0;
+    for (uint32_t side = 0; side < 2; side++)
+    {
+        for (uint32_t i = 0; i < *leaf_node_num_cells(scratch[side]); i++)
+        {
+            keys[total_cells] = *leaf_node_key(scratch[side], i);
+            values[total_cells] = leaf_node_value(scratch[side], i);
+            sizes[total_cells] = leaf_node_value_size(scratch[side], i);
+            total_bytes += sizes[total_cells] + LEAF_NODE_ENTRY_SIZE;
+            total_cells++;
+        }
+    }
+
+    bool merged = total_bytes <= LEAF_NODE_SPACE_FOR_CELLS;
+    if (merged)
+    {
+        leaf_node_fill(left, keys, values, sizes, total_cells);
+        *leaf_node_next_leaf(left) = *leaf_node_next_leaf(right);
+        internal_node_remove_child(parent, left_index + 1);
+    }
+    else
+    {
+        uint32_t left_count = 0;
+        uint32_t left_bytes = 0;
+        while (left_count < total_cells - 1 && (left_count == 0 || left_bytes < total_bytes / 2))
+        {
+            left_bytes += sizes[left_count] + LEAF_NODE_ENTRY_SIZE;
+            left_count++;
+        }
+        leaf_node_fill(left, keys, values, sizes, left_count);
+        leaf_node_fill(right, keys + left_count, values + left_count, sizes + left_count,
+                       total_cells - left_count);
+        *internal_node_key(parent, left_index) = keys[left_count - 1];
+        internal_node_recount_child(pager, parent, right_page_num);
+    }
+    internal_node_recount_child(pager, parent, left_page_num);
+    unpin_page(pager, left_page_num);
+    unpin_page(pager, right_page_num);
+    if (merged)
+    {
+        free_page_num(pager, right_page_num);
+    }
+    unpin_page(pager, parent_page_num);
+    if (merged)
+    {
+        internal_node_rebalance(table, parent_page_num);
+    }
+}
+
+uint32_t *index_node_num_cells(void *node)
+{
+    return node + INDEX_NODE_NUM_CELLS_OFFSET;
+}
+
+uint32_t *index_node_link(void *node)
+{
+    return node + INDEX_NODE_LINK_OFFSET;
+}
+
+uint32_t *index_node_content_start(void *node)
+{
+    return node + INDEX_NODE_CONTENT_START_OFFSET;
+}
+
+uint32_t *index_node_fragmented_bytes(void *node)
+{
+    return node + INDEX_NODE_FRAGMENTED_OFFSET;
+}
+
+uint16_t *index_node_slot(void *node, uint32_t cell_num)
+{
+    return node + INDEX_NODE_HEADER_SIZE + cell_num * INDEX_NODE_SLOT_SIZE;
+}
+
+void *index_node_cell(void *node, uint32_t cell_num)
+{
+    return node + *index_node_slot(node, cell_num);
+}
+
+uint32_t *index_cell_child(void *cell)
+{
+    return cell + INDEX_CELL_CHILD_OFFSET;
+}
+
+uint32_t *index_cell_id(void *cell)
+{
+    return cell + INDEX_CELL_ID_OFFSET;
+}
+
+uint32_t index_cell_size(void *cell)
+{
+    return INDEX_CELL_VALUE_OFFSET + *(uint8_t *)(cell + INDEX_CELL_LENGTH_OFFSET);
+}
+
+// 按 value 的字节序比较, value 相同再比 id
+int index_cell_compare(void *a, void *b)
+{
+    uint8_t a_length = *(uint8_t *)(a + INDEX_CELL_LENGTH_OFFSET);
+    uint8_t b_length = *(uint8_t *)(b + INDEX_CELL_LENGTH_OFFSET);
+    int result = memcmp(a + INDEX_CELL_VALUE_OFFSET, b + INDEX_CELL_VALUE_OFFSET,
+                        a_length < b_length ? a_length : b_length);
+    if (result != 0)
+    {
+        return result;
+    }
+    if (a_length != b_length)
+    {
+        return a_length < b_length ? -1 : 1;
+    }
+    uint32_t a_id = *index_cell_id(a);
+    uint32_t b_id = *index_cell_id(b);
+    return (a_id > b_id) - (a_id < b_id);
+}
+
+// 组一个 cell, 插入和查找都用它作为 key
+void index_cell_build(void *cell, uint32_t child, uint32_t id, const char *value, uint8_t length)
+{
+    *index_cell_child(cell) = child;
+    *index_cell_id(cell) = id;
+    *(uint8_t *)(cell + INDEX_CELL_LENGTH_OFFSET) = length;
+    memcpy(cell + INDEX_CELL_VALUE_OFFSET, value, length);
+}
+
+// 表里一行的 value 中某一列的位置和长度
+void *row_value_column(void *value, IndexColumn column, uint8_t *length)
+{
+    uint8_t username_length = *(uint8_t *)value;
+    if (column == INDEX_USERNAME)
+    {
+        *length = username_length;
+        return value + FIELD_LENGTH_SIZE;
+    }
+    *length = *(uint8_t *)(value + FIELD_LENGTH_SIZE + username_length);
+    return value + 2 * FIELD_LENGTH_SIZE + username_length;
+}
+
+void initialize_index_node(void *node, NodeType type)
+{
+    set_node_type(node, type);
+    set_node_root(node, false);
+    *node_parent(node) = 0;
+    *index_node_num_cells(node) = 0;
+    *index_node_link(node) = 0;
+    *index_node_content_start(node) = PAGE_SIZE;
+    *index_node_fragmented_bytes(node) = 0;
+}
+
+uint32_t index_node_gap(void *node)
+{
+    return *index_node_content_start(node) - INDEX_NODE_HEADER_SIZE -
+           *index_node_num_cells(node) * INDEX_NODE_SLOT_SIZE;
+}
+
+// 第一个不小于 key 的 cell 的下标
+uint32_t index_node_lower_bound(void *node, void *key)
+{
+    uint32_t low = 0;
+    uint32_t high = *index_node_num_cells(node);
+    while (low < high)
+    {
+        uint32_t middle = low + (high - low) / 2;
+        if (index_cell_compare(index_node_cell(node, middle), key) < 0)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// 清空节点的 cell, 再按顺序放入 count 个; 类型和 link 不变
+void index_node_fill(void *node, void **cells, uint32_t count)
+{
+    *index_node_num_cells(node) = 0;
+    *index_node_content_start(node) = PAGE_SIZE;
+    *index_node_fragmented_bytes(node) = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint32_t size = index_cell_size(cells[i]);
+        *index_node_content_start(node) -= size;
+        memcpy(node + *index_node_content_start(node), cells[i], size);
+        *index_node_slot(node, i) = *index_node_content_start(node);
+        *index_node_num_cells(node) = i + 1;
+    }
+}
+
+// 调用者保证空间足够; 中间的空闲区不够时先整理碎片
+void index_node_insert_cell(void *node, uint32_t index, void *cell)
+{
+    uint32_t size = index_cell_size(cell);
+    if (index_node_gap(node) < size + INDEX_NODE_SLOT_SIZE)
+    {
+        uint8_t scratch[PAGE_SIZE];
+        memcpy(scratch, node, PAGE_SIZE);
+        void *cells[PAGE_SIZE / INDEX_CELL_VALUE_OFFSET];
+        uint32_t num_cells = *index_node_num_cells(node);
+        for (uint32_t i = 0; i < num_cells; i++)
+        {
+            cells[i] = index_node_cell(scratch, i);
+        }
+        index_node_fill(node, cells, num_cells);
+    }
+    uint32_t num_cells = *index_node_num_cells(node);
+    *index_node_content_start(node) -= size;
+    memcpy(node + *index_node_content_start(node), cell, size);
+    memmove(index_node_slot(node, index + 1), index_node_slot(node, index),
+            (num_cells - index) * INDEX_NODE_SLOT_SIZE);
+    *index_node_slot(node, index) = *index_node_content_start(node);
+    *index_node_num_cells(node) = num_cells + 1;
+}
+
+void index_node_remove_cell(void *node, uint32_t index)
+{
+    uint32_t num_cells = *index_node_num_cells(node);
+    *index_node_fragmented_bytes(node) += index_cell_size(index_node_cell(node, index));
+    memmove(index_node_slot(node, index), index_node_slot(node, index + 1),
+            (num_cells - index - 1) * INDEX_NODE_SLOT_SIZE);
+    *index_node_num_cells(node) = num_cells - 1;
+}
+
+// 从根走到叶子时经过的节点, 以及在每个节点里的位置
+typedef struct
+{
+    uint32_t depth;
+    uint32_t pages[INDEX_MAX_DEPTH];
+    uint32_t positions[INDEX_MAX_DEPTH];
+} IndexPath;
+
+void index_descend(Pager *pager, uint32_t root_page_num, void *key, IndexPath *path)
+{
+    uint32_t page_num = root_page_num;
+    path->depth = 0;
+    while (true)
+    {
+        void *node = get_page(pager, page_num);
+        uint32_t position = index_node_lower_bound(node, key);
+        path->pages[path->depth] = page_num;
+        path->positions[path->depth] = position;
+        path->depth++;
+        if (get_node_type(node) == NODE_INDEX_LEAF)
+        {
+            unpin_page(pager, page_num);
+            return;
+        }
+        uint32_t num_cells = *index_node_num_cells(node);
+        uint32_t child = position < num_cells ? *index_cell_child(index_node_cell(node, position))
+                                              : *index_node_link(node);
+        unpin_page(pager, page_num);
+        page_num = child;
+    }
+}
+
+/*
+Insert a cell at a position of the node on level `level` of the path.
+A full node is split by bytes: the left half stays in its page, the right
+half moves to a new page which takes over the node's place in the parent,
+and the left half is inserted in front of it with its largest entry as
+upper bound. A full root is first moved down into a new page so that the
+root page never changes.
+*/
+void index_insert_at(Pager *pager, IndexPath *path, uint32_t level, uint32_t position, void *cell)
+{
+    uint32_t page_num = path->pages[level];
+    void *node = get_page(pager, page_num);
+    mark_page_dirty(pager, page_num);
+    uint32_t cell_size = index_cell_size(cell);
+    uint32_t free_space = index_node_gap(node) + *index_node_fragmented_bytes(node);
+    if (free_space >= cell_size + INDEX_NODE_SLOT_SIZE)
+    {
+        index_node_insert_cell(node, position, cell);
+        unpin_page(pager, page_num);
+        return;
+    }
+
+    if (level == 0)
+    {
+        if (path->depth == INDEX_MAX_DEPTH)
+        {
+            printf("Index exceeded %d levels.\n", INDEX_MAX_DEPTH);
+            exit(EXIT_FAILURE);
+        }
+        uint32_t child_page_num = get_unused_page_num(pager);
+        void *child = get_page(pager, child_page_num);
+        mark_page_dirty(pager, child_page_num);
+        memcpy(child, node, PAGE_SIZE);
+        set_node_root(child, false);
+        initialize_index_node(node, NODE_INDEX_INTERNAL);
+        set_node_root(node, true);
+        *index_node_link(node) = child_page_num;
+        unpin_page(pager, child_page_num);
+        memmove(path->pages + 1, path->pages, path->depth * sizeof(uint32_t));
+        memmove(path->positions + 1, path->positions, path->depth * sizeof(uint32_t));
+        path->pages[1] = child_page_num;
+        path->positions[0] = 0;
+        path->depth++;
+        unpin_page(pager, page_num);
+        index_insert_at(pager, path, 1, position, cell);
+        return;
+    }
+
+    uint8_t scratch[PAGE_SIZE];
+    memcpy(scratch, node, PAGE_SIZE);
+    uint32_t total = *index_node_num_cells(scratch) + 1;
+    void *cells[PAGE_SIZE / INDEX_CELL_VALUE_OFFSET + 1];
+    uint32_t total_bytes = 0;
+    for (uint32_t i = 0; i < total; i++)
+    {
+        cells[i] = i == position ? cell : index_node_cell(scratch, i > position ? i - 1 : i);
+        total_bytes += index_cell_size(cells[i]) + INDEX_NODE_SLOT_SIZE;
+    }
+    uint32_t left_count = 0;
+    uint32_t left_bytes = 0;
+    while (left_count < total - 1 && (left_count == 0 || left_bytes < total_bytes / 2))
+    {
+        left_bytes += index_cell_size(cells[left_count]) + INDEX_NODE_SLOT_SIZE;
+        left_count++;
+    }
+
+    bool leaf = get_node_type(scratch) == NODE_INDEX_LEAF;
+    uint32_t new_page_num = get_unused_page_num(pager);
+    void *new_node = get_page(pager, new_page_num);
+    mark_page_dirty(pager, new_page_num);
+    initialize_index_node(new_node, leaf ? NODE_INDEX_LEAF : NODE_INDEX_INTERNAL);
+    *index_node_link(new_node) = *index_node_link(scratch);
+    index_node_fill(new_node, cells + left_count, total - left_count);
+    if (leaf)
+    {
+        index_node_fill(node, cells, left_count);
+        *index_node_link(node) = new_page_num;
+    }
+    else
+    {
+        // 左半边最后一个 cell 的孩子变成左节点的最右孩子, 它的 key 交给父节点
+        index_node_fill(node, cells, left_count - 1);
+        *index_node_link(node) = *index_cell_child(cells[left_count - 1]);
+    }
+    uint8_t separator[INDEX_MAX_CELL_SIZE];
+    memcpy(separator, cells[left_count - 1], index_cell_size(cells[left_count - 1]));
+    *index_cell_child(separator) = page_num;
+    unpin_page(pager, new_page_num);
+    unpin_page(pager, page_num);
+
+    uint32_t parent_page_num = path->pages[level - 1];
+    uint32_t parent_position = path->positions[level - 1];
+    void *parent = get_page(pager, parent_page_num);
+    mark_page_dirty(pager, parent_page_num);
+    if (parent_position < *index_node_num_cells(parent))
+    {
+        *index_cell_child(index_node_cell(parent, parent_position)) = new_page_num;
+    }
+    else
+    {
+        *index_node_link(parent) = new_page_num;
+    }
+    unpin_page(pager, parent_page_num);
+    index_insert_at(pager, path, level - 1, parent_position, separator);
+}
+
+void index_insert(Pager *pager, uint32_t root_page_num, uint32_t id, const char *value, uint8_t length)
+{
+    uint8_t cell[INDEX_MAX_CELL_SIZE];
+    index_cell_build(cell, 0, id, value, length);
+    IndexPath path;
+    index_descend(pager, root_page_num, cell, &path);
+    index_insert_at(pager, &path, path.depth - 1, path.positions[path.depth - 1], cell);
+}
+
+// 删除只把 cell 从叶子里摘掉, 索引页不做合并
+void index_delete(Pager *pager, uint32_t root_page_num, uint32_t id, const char *value, uint8_t length)
+{
+    uint8_t cell[INDEX_MAX_CELL_SIZE];
+    index_cell_build(cell, 0, id, value, length);
+    IndexPath path;
+    index_descend(pager, root_page_num, cell, &path);
+    uint32_t page_num = path.pages[path.depth - 1];
+    uint32_t position = path.positions[path.depth - 1];
+    void *node = get_page(pager, page_num);
+    if (position < *index_node_num_cells(node) &&
+        index_cell_compare(index_node_cell(node, position), cell) == 0)
+    {
+        mark_page_dirty(pager, page_num);
+        index_node_remove_cell(node, position);
+    }
+    unpin_page(pager, page_num);
+}
+
+// 一行写进表以后 / 从表里删掉之前, 同步更新所有二级索引
+void table_index_update(Table *table, uint32_t id, void *value, bool insert)
+{
+    for (uint32_t column = 0; column < INDEX_COLUMN_COUNT; column++)
+    {
+        if (table->index_roots[column] == 0)
+        {
+            continue;
+        }
+        uint8_t length;
+        const char *data = row_value_column(value, column, &length);
+        if (insert)
+        {
+            index_insert(table->pager, table->index_roots[column], id, data, length);
+        }
+        else
+        {
+            index_delete(table->pager, table->index_roots[column], id, data, length);
+        }
+    }
+}
+
+// 跳过空格取下一个词; 没有了返回 false
+bool next_token(const char **cursor, Token *token)
+{
+    const char *p = *cursor;
+    while (*p == ' ')
+    {
+        p++;
+    }
+    if (*p == '\0')
+    {
+        return false;
+    }
+    token->start = p;
+    while (*p != ' ' && *p != '\0')
+    {
+        p++;
+    }
+    token->length = p - token->start;
+    *cursor = p;
+    return true;
+}
+
+bool token_equals(Token *token, const char *word)
+{
+    return strncmp(token->start, word, token->length) == 0 && word[token->length] == '\0';
+}
+
+bool parse_uint32(const char *text, uint32_t length, uint32_t *value)
+{
+    if (length == 0 || length > 10)
+    {
+        return false;
+    }
+    uint64_t parsed = 0;
+    for (uint32_t i = 0; i < length; i++)
+    {
+        if (text[i] < '0' || text[i] > '9')
+        {
+            return false;
+        }
+        parsed = parsed * 10 + (text[i] - '0');
+    }
+    if (parsed > UINT32_MAX)
+    {
+        return false;
+    }
+    *value = parsed;
+    return true;
+}
+
+// 检查一个值 (字面量或绑定的参数) 是否符合它所在位置的类型
+PrepareResult check_value(ParamKind kind, const char *text, uint32_t length, uint32_t *number)
+{
+    switch (kind)
+    {
+    case PARAM_NUMBER:
+        return parse_uint32(text, length, number) ? PREPARE_SUCCESS : PREPARE_SYNTAX_ERROR;
+    case PARAM_USERNAME:
+        return length > COLUMN_USERNAME_SIZE ? PREPARE_STRING_TOO_LONG : PREPARE_SUCCESS;
+    case PARAM_EMAIL:
+        return length > COLUMN_EMAIL_SIZE ? PREPARE_STRING_TOO_LONG : PREPARE_SUCCESS;
+    }
+    return PREPARE_SYNTAX_ERROR;
+}
+
+// 字面量在这里解析好, ? 登记成一个参数
+PrepareResult prepare_operand(Statement *statement, const char **cursor, ParamKind kind, Operand *operand)
+{
+    Token token;
+    if (!next_token(cursor, &token))
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    operand->param = -1;
+    operand->text = token;
+    if (token_equals(&token, "?"))
+    {
+        if (statement->num_params == STATEMENT_MAX_PARAMS)
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        operand->param = statement->num_params;
+        Param *param = &statement->params[statement->num_params++];
+        param->kind = kind;
+        param->bound = false;
+        return PREPARE_SUCCESS;
+    }
+    return check_value(kind, token.start, token.length, &operand->number);
+}
+
+uint32_t operand_number(Statement *statement, Operand *operand)
+{
+    return operand->param == -1 ? operand->number : statement->params[operand->param].number;
+}
+
+Token operand_text(Statement *statement, Operand *operand)
+{
+    return operand->param == -1 ? operand->text : statement->params[operand->param].text;
+}
+
+// insert id username email [id username email ...]
+PrepareResult prepare_insert(const char **cursor, Statement *statement)
+{
+    statement->type = STATEMENT_INSERT;
+    uint32_t capacity = 1;
+    statement->rows = malloc(sizeof(InsertOperands) * capacity);
+    Token token;
+    const char *peek = *cursor;
+    while (next_token(&peek, &token))
+    {
+        if (statement->num_rows == capacity)
+        {
+            capacity *= 2;
+            statement->rows = realloc(statement->rows, sizeof(InsertOperands) * capacity);
+        }
+        InsertOperands *row = &statement->rows[statement->num_rows++];
+        PrepareResult result = prepare_operand(statement, cursor, PARAM_NUMBER, &row->id);
+        if (result == PREPARE_SUCCESS)
+        {
+            result = prepare_operand(statement, cursor, PARAM_USERNAME, &row->username);
+        }
+        if (result == PREPARE_SUCCESS)
+        {
+            result = prepare_operand(statement, cursor, PARAM_EMAIL, &row->email);
+        }
+        if (result != PREPARE_SUCCESS)
+        {
+            return result;
+        }
+        peek = *cursor;
+    }
+    return statement->num_rows == 0 ? PREPARE_SYNTAX_ERROR : PREPARE_SUCCESS;
+}
+
+/*
+one predicate: id = N, id between A and B, id > N, id >= N, id < N,
+id <= N, or username = V / email = V (at most one of those per statement)
+*/
+PrepareResult prepare_predicate(const char **cursor, Statement *statement)
+{
+    if (statement->num_predicates == STATEMENT_MAX_PREDICATES)
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    Predicate *predicate = &statement->predicates[statement->num_predicates++];
+    Token column;
+    Token op;
+    if (!next_token(cursor, &column) || !next_token(cursor, &op))
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    if (token_equals(&column, "username") || token_equals(&column, "email"))
+    {
+        bool username = token_equals(&column, "username");
+        for (uint32_t i = 0; i + 1 < statement->num_predicates; i++)
+        {
+            if (statement->predicates[i].op == PREDICATE_COLUMN_EQ)
+            {
+                return PREPARE_SYNTAX_ERROR;
+            }
+        }
+        if (!token_equals(&op, "="))
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        predicate->op = PREDICATE_COLUMN_EQ;
+        predicate->column = username ? INDEX_USERNAME : INDEX_EMAIL;
+        return prepare_operand(statement, cursor, username ? PARAM_USERNAME : PARAM_EMAIL,
+                               &predicate->value);
+    }
+    if (!token_equals(&column, "id"))
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    if (token_equals(&op, "="))
+    {
+        predicate->op = PREDICATE_ID_EQ;
+    }
+    else if (token_equals(&op, "between"))
+    {
+        predicate->op = PREDICATE_ID_BETWEEN;
+    }
+    else if (token_equals(&op, ">"))
+    {
+        predicate->op = PREDICATE_ID_GT;
+    }
+    else if (token_equals(&op, ">="))
+    {
+        predicate->op = PREDICATE_ID_GE;
+    }
+    else if (token_equals(&op, "<"))
+    {
+        predicate->op = PREDICATE_ID_LT;
+    }
+    else if (token_equals(&op, "<="))
+    {
+        predicate->op = PREDICATE_ID_LE;
+    }
+    else
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    PrepareResult result = prepare_operand(statement, cursor, PARAM_NUMBER, &predicate->value);
+    if (result != PREPARE_SUCCESS || predicate->op != PREDICATE_ID_BETWEEN)
+    {
+        return result;
+    }
+    Token and;
+    if (!next_token(cursor, &and) || !token_equals(&and, "and"))
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    return prepare_operand(statement, cursor, PARAM_NUMBER, &predicate->upper);
+}
+
+/*
+select [count(*)] [where <predicate> [and <predicate> ...]] [limit K] [offset M]
+delete [where <predicate> [and <predicate> ...]] [limit K] [offset M]
+a username or email predicate goes through the column's index when there
+is one. count(*) prints how many rows the select would print.
+*/
+PrepareResult prepare_range_statement(const char **cursor, Statement *statement)
+{
+    Token token;
+    bool more = next_token(cursor, &token);
+    if (more && statement->type == STATEMEND_SELECT && token_equals(&token, "count(*)"))
+    {
+        statement->count = true;
+        more = next_token(cursor, &token);
+    }
+    if (more && token_equals(&token, "where"))
+    {
+        do
+        {
+            PrepareResult result = prepare_predicate(cursor, statement);
+            if (result != PREPARE_SUCCESS)
+            {
+                return result;
+            }
+            more = next_token(cursor, &token);
+        } while (more && token_equals(&token, "and"));
+    }
+    if (more && token_equals(&token, "limit"))
+    {
+        statement->has_limit = true;
+        PrepareResult result = prepare_operand(statement, cursor, PARAM_NUMBER, &statement->limit);
+        if (result != PREPARE_SUCCESS)
+        {
+            return result;
+        }
+        more = next_token(cursor, &token);
+    }
+    if (more && token_equals(&token, "offset"))
+    {
+        statement->has_offset = true;
+        PrepareResult result = prepare_operand(statement, cursor, PARAM_NUMBER, &statement->offset);
+        if (result != PREPARE_SUCCESS)
+        {
+            return result;
+        }
+        more = next_token(cursor, &token);
+    }
+    return more ? PREPARE_SYNTAX_ERROR : PREPARE_SUCCESS;
+}
+
+// create index on username|email
+PrepareResult prepare_create_index(const char **cursor, Statement *statement)
+{
+    statement->type = STATEMENT_CREATE_INDEX;
+    Token index;
+    Token on;
+    Token column;
+    Token extra;
+    if (!next_token(cursor, &index) || !next_token(cursor, &on) || !next_token(cursor, &column) ||
+        next_token(cursor, &extra) || !token_equals(&index, "index") || !token_equals(&on, "on"))
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    if (token_equals(&column, "username"))
+    {
+        statement->index_column = INDEX_USERNAME;
+    }
+    else if (token_equals(&column, "email"))
+    {
+        statement->index_column = INDEX_EMAIL;
+    }
+    else
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    return PREPARE_SUCCESS;
+}
+
+void statement_free(Statement *statement)
+{
+    free(statement->rows);
+    free(statement->sql);
+    statement->rows = NULL;
+    statement->sql = NULL;
+}
+
+// 解析 sql; 计划里的字面量直接指向 sql, 调用者要保证 sql 在执行完之前有效
+PrepareResult prepare_statement(const char *sql, Statement *statement)
+{
+    statement->rows = NULL;
+    statement->num_rows = 0;
+    statement->num_predicates = 0;
+    statement->has_limit = false;
+    statement->has_offset = false;
+    statement->count = false;
+    statement->num_params = 0;
+    statement->sql = NULL;
+
+    const char *cursor = sql;
+    Token keyword;
+    Token extra;
+    PrepareResult result = PREPARE_UNRECOGNIZED_STATEMENT;
+    if (!next_token(&cursor, &keyword))
+    {
+        return PREPARE_UNRECOGNIZED_STATEMENT;
+    }
+    if (token_equals(&keyword, "insert"))
+    {
+        result = prepare_insert(&cursor, statement);
+    }
+    else if (token_equals(&keyword, "select"))
+    {
+        statement->type = STATEMEND_SELECT;
+        result = prepare_range_statement(&cursor, statement);
+    }
+    else if (token_equals(&keyword, "delete"))
+    {
+        statement->type = STATEMENT_DELETE;
+        result = prepare_range_statement(&cursor, statement);
+    }
+    else if (token_equals(&keyword, "create"))
+    {
+        result = prepare_create_index(&cursor, statement);
+    }
+    else if (token_equals(&keyword, "begin") || token_equals(&keyword, "commit"))
+    {
+        statement->type = token_equals(&keyword, "begin") ? STATEMENT_BEGIN : STATEMENT_COMMIT;
+        result = next_token(&cursor, &extra) ? PREPARE_SYNTAX_ERROR : PREPARE_SUCCESS;
+    }
+    if (result != PREPARE_SUCCESS)
+    {
+        statement_free(statement);
+    }
+    return result;
+}
+
+/*
+prepare/bind/step: db_prepare keeps its own copy of the text, so the plan
+outlives the caller's buffer. Parameters are numbered from 0 in the order
+the ? appear. Bound text is not copied: it must stay valid until the
+step, which writes it straight into the row being inserted.
+*/
+PrepareResult db_prepare(const char *sql, Statement *statement)
+{
+    char *text = strdup(sql);
+    PrepareResult result = prepare_statement(text, statement);
+    if (result != PREPARE_SUCCESS)
+    {
+        free(text);
+        return result;
+    }
+    statement->sql = text;
+    return PREPARE_SUCCESS;
+}
+
+PrepareResult db_bind_text(Statement *statement, uint32_t index, const char *text, uint32_t length)
+{
+    if (index >= statement->num_params)
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    Param *param = &statement->params[index];
+    PrepareResult result = check_value(param->kind, text, length, &param->number);
+    param->text.start = text;
+    param->text.length = length;
+    param->bound = result == PREPARE_SUCCESS;
+    return result;
+}
+
+PrepareResult db_bind_uint32(Statement *statement, uint32_t index, uint32_t value)
+{
+    if (index >= statement->num_params || statement->params[index].kind != PARAM_NUMBER)
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    statement->params[index].number = value;
+    statement->params[index].bound = true;
+    return PREPARE_SUCCESS;
+}
+
+void db_finalize(Statement *statement)
+{
+    statement_free(statement);
+}
+
+// 用绑定好的值把 where/limit 算成 id 区间
+void statement_range(Statement *statement, KeyRange *range)
+{
+    range->lower = 0;
+    range->upper = UINT32_MAX;
+    range->limit = statement->has_limit ? operand_number(statement, &statement->limit) : UINT32_MAX;
+    range->offset = statement->has_offset ? operand_number(statement, &statement->offset) : 0;
+    range->empty = false;
+    range->column = -1;
+    for (uint32_t i = 0; i < statement->num_predicates; i++)
+    {
+        Predicate *predicate = &statement->predicates[i];
+        if (predicate->op == PREDICATE_COLUMN_EQ)
+        {
+            range->column = predicate->column;
+            range->value = operand_text(statement, &predicate->value);
+            continue;
+        }
+        uint32_t value = operand_number(statement, &predicate->value);
+        uint32_t lower = 0;
+        uint32_t upper = UINT32_MAX;
+        switch (predicate->op)
+        {
+        case PREDICATE_ID_EQ:
+            lower = upper = value;
+            break;
+        case PREDICATE_ID_BETWEEN:
+            lower = value;
+            upper = operand_number(statement, &predicate->upper);
+            break;
+        case PREDICATE_ID_GE:
+            lower = value;
+            break;
+        case PREDICATE_ID_LE:
+            upper = value;
+            break;
+        case PREDICATE_ID_GT:
+            range->empty |= value == UINT32_MAX;
+            lower = value + 1;
+            break;
+        case PREDICATE_ID_LT:
+            range->empty |= value == 0;
+            upper = value - 1;
+            break;
+        case PREDICATE_COLUMN_EQ:
+            break;
+        }
+        if (lower > range->lower)
+        {
+            range->lower = lower;
+        }
+        if (upper < range->upper)
+        {
+            range->upper = upper;
+        }
+    }
+    range->empty |= range->lower > range->upper;
+}
+
+Cursor *leaf_node_find(Table *table, uint32_t page_num, uint32_t key)
+{
+    void *node = get_page(table->pager, page_num);
+    uint32_t num_cells = *leaf_node_num_cells(node);
+
+    // 返回的 cursor 继续持有该叶子页的 pin, 由 cursor_close 释放
+    Cursor *cursor = malloc(sizeof(Cursor));
+    cursor->table = table;
+    cursor->page_num = page_num;
+    cursor->end_of_table = false;
+
+    // 第一个 >= key 的位置, 即找到的行或者插入位置
+    cursor->cell_num = key_lower_bound(leaf_node_key(node, 0), num_cells, key);
+    return cursor;
+}
+
+Cursor *internal_node_find(Table *table, uint32_t page_num, uint32_t key)
+{
+    void *node = get_page(table->pager, page_num);
+    uint32_t child_index = internal_node_find_child(node, key);
+    uint32_t child_num = *internal_node_child(node, child_index);
+    unpin_page(table->pager, page_num);
+    void *child = get_page(table->pager, child_num);
+    NodeType child_type = get_node_type(child);
+    unpin_page(table->pager, child_num);
+    switch (child_type)
+    {
+    case NODE_LEAF:
+        return leaf_node_find(table, child_num, key);
+
+    case NODE_INTERNAL:
+    default:
+        return internal_node_find(table, child_num, key);
+    }
+}
+
+Cursor *table_find(Table *table, uint32_t key)
+{
+    uint32_t root_page_num = table->root_page_num;
+    void *root_node = get_page(table->pager, root_page_num);
+    NodeType root_type = get_node_type(root_node);
+    unpin_page(table->pager, root_page_num);
+
+    if (root_type == NODE_LEAF)
+    {
+        return leaf_node_find(table, root_page_num, key);
+    }
+    else
+    {
+        // printf("Need to implement searching in internal nodes");
+        // exit(EXIT_FAILURE);
+        return internal_node_find(table, root_page_num, key);
+    }
+}
+
+Cursor *table_start(Table *table)
+{
+    Cursor *cursor = table_find(table, 0);
+    // cursor->table = table;
+    // // cursor->row_num = 0;
+    // cursor->page_num = table->root_page_num;
+    // cursor->cell_num = 0;
+
+    cursor_settle(cursor);
+    return cursor;
+}
+
+// 每条语句结束时提交; 日志够长了顺便做检查点
+void table_commit(Table *table)
+{
+    Pager *pager = table->pager;
+    pager_commit(pager);
+    pthread_mutex_lock(&pager->lock);
+    // 有快照时不自动做检查点, 日志先继续变长
+    bool checkpoint = pager->wal_fd != -1 && pager->wal_frames >= WAL_AUTOCHECKPOINT_FRAMES && pager->readers == 0;
+    pthread_mutex_unlock(&pager->lock);
+    if (checkpoint)
+    {
+        pager_checkpoint(pager);
+    }
+}
+
+// 按 key 排序, key 相同时保持输入顺序, 这样先插入的那行生效
+int compare_pending_rows(const void *a, const void *b, void *context)
+{
+    PendingRow *rows = context;
+    uint32_t left = *(const uint32_t *)a;
+    uint32_t right = *(const uint32_t *)b;
+    if (rows[left].id != rows[right].id)
+    {
+        return rows[left].id < rows[right].id ? -1 : 1;
+    }
+    return (left > right) - (left < right);
+}
+
+/*
+Write the pending rows into the tree in key order. The cursor stays on
+its leaf while the next key still belongs there (not past the leaf's max
+key, or the leaf is the right-most one), so consecutive keys skip the
+root-to-leaf descent and the duplicate check is a compare against the
+neighbouring cell. A split moves keys to another leaf, so the cursor is
+dropped and the next row descends again.
+*/
+void table_flush_pending(Table *table)
+{
+    Pager *pager = table->pager;
+    uint32_t count = table->num_pending;
+    PendingRow *rows = table->pending_rows;
+    uint32_t *order = malloc(sizeof(uint32_t) * (count + 1));
+    for (uint32_t i = 0; i < count; i++)
+    {
+        order[i] = i;
+    }
+    qsort_r(order, count, sizeof(uint32_t), compare_pending_rows, rows);
+
+    Cursor *cursor = NULL;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        PendingRow *row = &rows[order[i]];
+        if (cursor != NULL)
+        {
+            void *node = get_page(pager, cursor->page_num);
+            uint32_t num_cells = *leaf_node_num_cells(node);
+            bool same_leaf = *leaf_node_next_leaf(node) == 0 ||
+                             (num_cells > 0 && row->id <= *leaf_node_key(node, num_cells - 1));
+            if (same_leaf)
+            {
+                // 行已经排好序, 只需要从上一行的位置往后找
+                cursor->cell_num += key_lower_bound(leaf_node_key(node, cursor->cell_num),
+                                                    num_cells - cursor->cell_num, row->id);
+            }
+            unpin_page(pager, cursor->page_num);
+            if (!same_leaf)
+            {
+                cursor_close(cursor);
+                cursor = NULL;
+            }
+        }
+        if (cursor == NULL)
+        {
+            cursor = table_find(table, row->id);
+        }
+
+        void *node = get_page(pager, cursor->page_num);
+        uint32_t num_cells = *leaf_node_num_cells(node);
+        bool duplicate = cursor->cell_num < num_cells && *leaf_node_key(node, cursor->cell_num) == row->id;
+        bool will_split = leaf_node_free_space(node) < row->size + LEAF_NODE_ENTRY_SIZE;
+        unpin_page(pager, cursor->page_num);
+        if (duplicate)
+        {
+            table->batch_duplicates++;
+            continue;
+        }
+
+        leaf_node_insert(cursor, row->id, row->value, row->size);
+        table_index_update(table, row->id, row->value, true);
+        if (will_split)
+        {
+            cursor_close(cursor);
+            cursor = NULL;
+        }
+    }
+    if (cursor != NULL)
+    {
+        cursor_close(cursor);
+    }
+    free(order);
+    table->num_pending = 0;
+}
+
+// 写进树并提交; 有行因为重复 key 被跳过时报告一次
+ExecuteResult table_finish_batch(Table *table)
+{
+    table_flush_pending(table);
+    table_commit(table);
+    uint64_t duplicates = table->batch_duplicates;
+    table->batch_duplicates = 0;
+    if (duplicates > 1)
+    {
+        fprintf(table->messages, "Skipped %llu rows with duplicate keys.\n", (unsigned long long)duplicates);
+    }
+    return duplicates > 0 ? EXECUTE_DUPLICATE_KEY : EXECUTE_SUCCESS;
+}
+
+/*
+Upper bound on the pages that `cells` cells totalling `bytes` bytes (each
+counted with LEAF_NODE_ENTRY_SIZE) take in one tree. Leaves are cut at least
+fill_percent full (50 for leaves that split) less one cell, and an index
+cell is at most a few bytes longer than its row, hence the margin per
+cell. Internal nodes are filled the same way, so with a fanout of at
+least f the levels above the leaves add at most leaves / (f - 1) pages,
+plus one partly filled node per level.
+*/
+uint64_t tree_pages_for_cells(uint64_t cells, uint64_t bytes, uint32_t fill_percent)
+{
+    uint32_t least = LEAF_NODE_SPACE_FOR_CELLS * fill_percent / 100;
+    uint32_t max_cell = LEAF_NODE_ENTRY_SIZE + LEAF_NODE_MAX_VALUE_SIZE + 8;
+    uint64_t leaves = cells; // 至少每个叶子一格
+    if (least > max_cell && (bytes + 8 * cells) / (least - max_cell) + 1 < leaves)
+    {
+        leaves = (bytes + 8 * cells) / (least - max_cell) + 1;
+    }
+    uint64_t fanout = (uint64_t)(INTERNAL_NODE_MAX_CELLS + 1) * (fill_percent < 50 ? fill_percent : 50) / 100;
+    fanout = fanout < 2 ? 2 : fanout;
+    return leaves + leaves / (fanout - 1) + BULK_MAX_LEVELS;
+}
+
+// 二级索引的个数
+uint32_t table_index_count(Table *table)
+{
+    uint32_t count = 0;
+    for (uint32_t column = 0; column < INDEX_COLUMN_COUNT; column++)
+    {
+        count += table->index_roots[column] != 0;
+    }
+    return count;
+}
+
+// 表的叶子按 fill_percent 装, 索引靠分裂长大, 只算半满
+uint64_t table_pages_for_rows(Table *table, uint64_t rows, uint64_t bytes, uint32_t fill_percent)
+{
+    return tree_pages_for_cells(rows, bytes, fill_percent) +
+           tree_pages_for_cells(rows, bytes, 50) * table_index_count(table);
+}
+
+/*
+whether pages more pages still fit in the page map of a compressed file.
+Checked before anything is written: a map that overflows in the middle
+of a checkpoint could not be recovered. Free pages are used first.
+*/
+bool table_has_room(Table *table, uint64_t pages)
+{
+    Pager *pager = table->pager;
+    if (!pager->compressed)
+    {
+        return true;
+    }
+    void *header = get_page(pager, 0);
+    uint32_t free_pages = *header_free_count(header);
+    unpin_page(pager, 0);
+    return pager_map_has_room(pager, (uint64_t)pager->num_pages - free_pages + pages);
+}
+
+ExecuteResult execute_insert(Statement *statement, Table *table)
+{
+    uint64_t rows = (uint64_t)table->num_pending + statement->num_rows; // 批里还没写进树的行也算上
+    if (!table_has_room(table, table_pages_for_rows(table, rows, rows * (LEAF_NODE_ENTRY_SIZE + LEAF_NODE_MAX_VALUE_SIZE),
+                                                    50)))
+    {
+        return EXECUTE_TABLE_FULL;
+    }
+    if (table->num_pending + statement->num_rows > table->pending_capacity)
+    {
+        while (table->num_pending + statement->num_rows > table->pending_capacity)
+        {
+            table->pending_capacity = table->pending_capacity == 0 ? 64 : 2 * table->pending_capacity;
+        }
+        table->pending_rows = realloc(table->pending_rows, sizeof(PendingRow) * table->pending_capacity);
+    }
+    // 参数和字面量直接编码进批里这一行的 value, 不经过 Row
+    for (uint32_t i = 0; i < statement->num_rows; i++)
+    {
+        InsertOperands *operands = &statement->rows[i];
+        PendingRow *row = &table->pending_rows[table->num_pending++];
+        Token username = operand_text(statement, &operands->username);
+        Token email = operand_text(statement, &operands->email);
+        row->id = operand_number(statement, &operands->id);
+        row->size = encode_value(row->value, username.start, username.length, email.start, email.length);
+    }
+
+    if (!table->in_batch)
+    {
+        return table_finish_batch(table);
+    }
+    if (table->num_pending >= BATCH_FLUSH_ROWS)
+    {
+        table_flush_pending(table);
+    }
+    return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_begin(Table *table)
+{
+    if (table->in_batch)
+    {
+        return EXECUTE_ALREADY_IN_BATCH;
+    }
+    table->in_batch = true;
+    return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_commit(Table *table)
+{
+    if (!table->in_batch)
+    {
+        return EXECUTE_NOT_IN_BATCH;
+    }
+    table->in_batch = false;
+    return table_finish_batch(table);
+}
+
+// 丢掉批里还没提交的修改, 根页和索引根从提交时的文件头重新读; 没有日志时做不到, 返回 false
+bool table_rollback(Table *table)
+{
+    if (!pager_rollback(table->pager))
+    {
+        return false;
+    }
+    table->in_batch = false;
+    table->num_pending = 0;
+    table->batch_duplicates = 0;
+    void *header = get_page(table->pager, 0);
+    table->root_page_num = *header_root_page(header);
+    for (uint32_t column = 0; column < INDEX_COLUMN_COUNT; column++)
+    {
+        table->index_roots[column] = *header_index_root(header, column);
+    }
+    unpin_page(table->pager, 0);
+    return true;
+}
+
+// 把 [lower, upper] 里最多 limit 行写到 writer; 每个叶子只 pin 一次, 整页的行一起输出
+/*
+scan read-ahead. The leaves of a key range are, in order, the children of
+the internal nodes one level above them, so the next leaves can be listed
+from those parents without reading the leaves themselves. Whenever fewer
+than half a window of leaves is left ahead of the cursor, the scan descends
+from the root to the parent holding next_key and hands the following
+children to pager_prefetch, stopping at the leaf that covers upper.
+While recent reads come back at page cache speed the handoff to the
+prefetch threads costs more than it saves, and nothing is read ahead.
+*/
+typedef struct
+{
+    uint32_t next_key; // 下一批从包含这个 key 的叶子开始
+    uint32_t upper;
+    uint32_t window;
+    uint32_t levels; // 根到叶子之间的内部节点层数, 0 表示还没算
+    uint32_t ahead;  // 交给了 pager_prefetch 但扫描还没走到的叶子数
+    bool done;
+} ScanPrefetch;
+
+void scan_prefetch_init(Table *table, ScanPrefetch *prefetch, uint32_t upper)
+{
+    Pager *pager = table->pager;
+    uint32_t window = pager->prefetch_window;
+    // 在读的预读页最多占 1/8 的帧, 窗口再大也用不上
+    uint32_t frame_share = pager->num_frames / PAGER_PREFETCH_FRAME_SHARE;
+    if (pager->mode == PAGER_MODE_BUFFERED && window > frame_share)
+    {
+        window = frame_share;
+    }
+    prefetch->upper = upper;
+    prefetch->window = window > PAGER_PREFETCH_MAX_WINDOW ? PAGER_PREFETCH_MAX_WINDOW : window;
+    prefetch->levels = 0;
+    prefetch->ahead = 0;
+    prefetch->done = prefetch->window < 2;
+}
+
+// 扫描走进了下一个叶子, key 是它之后还要读的第一个 key
+void scan_prefetch_advance(Table *table, ScanPrefetch *prefetch, uint32_t key)
+{
+    if (prefetch->ahead > 0)
+    {
+        prefetch->ahead--;
+    }
+    Pager *pager = table->pager;
+    if (prefetch->done || prefetch->ahead > prefetch->window / 2)
+    {
+        return;
+    }
+    // 预读线程在锁里更新 read_ns
+    pthread_mutex_lock(&pager->lock);
+    int64_t read_ns = pager->read_ns;
+    pthread_mutex_unlock(&pager->lock);
+    if (pager->mode == PAGER_MODE_BUFFERED && read_ns < PAGER_PREFETCH_MIN_READ_NS)
+    {
+        return;
+    }
+    if (prefetch->levels == 0)
+    {
+        // 第一次: 沿着当前叶子的路径数一下层数, 路径上的页都刚读过
+        prefetch->next_key = key;
+        uint32_t page_num = table->root_page_num;
+        while (true)
+        {
+            void *node = get_page(pager, page_num);
+            bool internal = get_node_type(node) == NODE_INTERNAL;
+            uint32_t child = internal ? *internal_node_child(node, internal_node_find_child(node, key)) : 0;
+            unpin_page(pager, page_num);
+            if (!internal)
+            {
+                break;
+            }
+            prefetch->levels++;
+            page_num = child;
+        }
+        if (prefetch->levels == 0)
+        {
+            prefetch->done = true; // 只有一个叶子
+            return;
+        }
+    }
+
+    uint32_t pages[PAGER_PREFETCH_MAX_WINDOW];
+    uint32_t count = 0;
+    uint32_t wanted = prefetch->window - prefetch->ahead;
+    while (count < wanted && !prefetch->done)
+    {
+        // 找到叶子上面那一层里包含 next_key 的节点, 同时记下它的 key 上界
+        uint32_t page_num = table->root_page_num;
+        uint32_t node_upper = UINT32_MAX;
+        for (uint32_t level = 1; level < prefetch->levels; level++)
+        {
+            void *node = get_page(pager, page_num);
+            uint32_t index = internal_node_find_child(node, prefetch->next_key);
+            if (index < *internal_node_num_keys(node))
+            {
+                node_upper = *internal_node_key(node, index);
+            }
+            uint32_t child = *internal_node_child(node, index);
+            unpin_page(pager, page_num);
+            page_num = child;
+        }
+
+        void *node = get_page(pager, page_num);
+        uint32_t num_keys = *internal_node_num_keys(node);
+        uint32_t index = internal_node_find_child(node, prefetch->next_key);
+        for (; index <= num_keys && count < wanted; index++)
+        {
+            uint32_t child_upper = index < num_keys ? *internal_node_key(node, index) : node_upper;
+            pages[count++] = *internal_node_child(node, index);
+            if (child_upper >= prefetch->upper)
+            {
+                prefetch->done = true;
+                break;
+            }
+            prefetch->next_key = child_upper + 1;
+        }
+        unpin_page(pager, page_num);
+    }
+    prefetch->ahead += count;
+    pager_prefetch(pager, pages, count);
+}
+
+uint32_t scan_range(Table *table, uint32_t lower, uint32_t upper, uint32_t limit, ResultWriter *writer)
+{
+    Pager *pager = table->pager;
+    Cursor *cursor = table_find(table, lower);
+    cursor_settle(cursor);
+    ScanPrefetch prefetch;
+    scan_prefetch_init(table, &prefetch, upper);
+    uint32_t rows = 0;
+    bool done = false;
+    while (!(cursor->end_of_table) && !done)
+    {
+        void *node = get_page(pager, cursor->page_num);
+        uint32_t num_cells = *leaf_node_num_cells(node);
+        uint32_t key = 0;
+        for (; cursor->cell_num < num_cells; cursor->cell_num++)
+        {
+            key = *leaf_node_key(node, cursor->cell_num);
+            if (key > upper || rows == limit)
+            {
+                done = true;
+                break;
+            }
+            result_writer_row(writer, key, leaf_node_value(node, cursor->cell_num));
+            rows++;
+        }
+        unpin_page(pager, cursor->page_num);
+        if (!done)
+        {
+            cursor_settle(cursor); // 这个叶子读完了, 换到下一个
+            // 点查和短范围一个叶子就结束了, 走到第二个叶子才开始预读
+            if (!cursor->end_of_table && key < upper && (limit == UINT32_MAX || limit - rows > num_cells))
+            {
+                scan_prefetch_advance(table, &prefetch, key + 1);
+            }
+        }
+    }
+    cursor_close(cursor);
+    return rows;
+}
+
+/*
+parallel scan: walk down from the root until one level has enough
+subtrees, and use each subtree's max key as a partition bound. Partitions
+are key ranges, so every worker positions its own cursor with table_find
+and the workers never touch the same leaf. Returns the number of
+partitions; bounds[i] is the inclusive upper key of partition i.
+*/
+uint32_t scan_partition_bounds(Table *table, uint32_t wanted, uint32_t **bounds_out)
+{
+    Pager *pager = table->pager;
+    uint32_t count = 1;
+    uint32_t *pages = malloc(sizeof(uint32_t));
+    uint32_t *bounds = malloc(sizeof(uint32_t));
+    pages[0] = table->root_page_num;
+    bounds[0] = UINT32_MAX;
+
+    while (count < wanted)
+    {
+        // 树是平衡的, 同一层的节点类型相同
+        void *first = get_page(pager, pages[0]);
+        NodeType type = get_node_type(first);
+        unpin_page(pager, pages[0]);
+        if (type != NODE_INTERNAL)
+        {
+            break;
+        }
+
+        uint32_t *next_pages = malloc(sizeof(uint32_t) * count * (INTERNAL_NODE_MAX_CELLS + 1));
+        uint32_t *next_bounds = malloc(sizeof(uint32_t) * count * (INTERNAL_NODE_MAX_CELLS + 1));
+        uint32_t next_count = 0;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            void *node = get_page(pager, pages[i]);
+            uint32_t num_keys = *internal_node_num_keys(node);
+            for (uint32_t j = 0; j < num_keys; j++)
+            {
+                next_pages[next_count] = *internal_node_child(node, j);
+                next_bounds[next_count] = *internal_node_key(node, j);
+                next_count++;
+            }
+            // 最右孩子没有自己的 key, 上界和父节点相同
+            next_pages[next_count] = *internal_node_right_child(node);
+            next_bounds[next_count] = bounds[i];
+            next_count++;
+            unpin_page(pager, pages[i]);
+        }
+        free(pages);
+        free(bounds);
+        pages = next_pages;
+        bounds = next_bounds;
+        count = next_count;
+    }
+
+    free(pages);
+    *bounds_out = bounds;
+    return count;
+}
+
+typedef struct
+{
+    Table *table;
+    uint32_t lower;
+    uint32_t upper;
+    ResultWriter writer;
+    pthread_t thread;
+} ScanTask;
+
+void *scan_worker_main(void *arg)
+{
+    ScanTask *task = arg;
+    scan_range(task->table, task->lower, task->upper, UINT32_MAX, &task->writer);
+    if (task->writer.order != NULL)
+    {
+        result_writer_end_turn(&task->writer);
+    }
+    else
+    {
+        result_writer_flush(&task->writer);
+    }
+    return NULL;
+}
+
+/*
+splits [lower, upper] over the scan threads. Every worker flushes its own
+fixed size buffer to the output fd as it fills, under a shared lock. For
+ordered output the workers take turns in key order: the first partition
+writes straight through, the others fill their buffer and then wait until
+the partitions before them are done, so memory stays at one buffer per
+worker. Only a memory sink (fd -1) collects the partitions and joins them
+at the end. Unordered output writes whenever a buffer fills. Returns false
+when the range falls in a single partition.
+*/
+bool execute_parallel_scan(Table *table, uint32_t lower, uint32_t upper)
+{
+    uint32_t threads = table->scan_threads;
+    if (threads > SCAN_MAX_THREADS)
+    {
+        threads = SCAN_MAX_THREADS;
+    }
+    if (table->pager->mode == PAGER_MODE_BUFFERED)
+    {
+        // 每个线程最多同时 pin 住 3 个页, 留几个帧给其它访问和预读
+        uint32_t num_frames = table->pager->num_frames;
+        uint32_t frame_limit = (num_frames - 4 - num_frames / PAGER_PREFETCH_FRAME_SHARE) / 3;
+        if (threads > frame_limit)
+        {
+            threads = frame_limit;
+        }
+    }
+
+    uint32_t *bounds;
+    uint32_t partitions = scan_partition_bounds(table, threads * SCAN_PARTITIONS_PER_THREAD, &bounds);
+    if (threads > partitions)
+    {
+        threads = partitions;
+    }
+
+    ScanTask *tasks = calloc(threads, sizeof(ScanTask));
+    uint32_t num_tasks = 0;
+    for (uint32_t t = 0; t < threads; t++)
+    {
+        uint32_t first = t * partitions / threads;
+        uint32_t last = (t + 1) * partitions / threads - 1;
+        uint32_t task_lower = first == 0 ? 0 : bounds[first - 1] + 1;
+        uint32_t task_upper = bounds[last];
+        if (task_lower < lower)
+        {
+            task_lower = lower;
+        }
+        if (task_upper > upper)
+        {
+            task_upper = upper;
+        }
+        if (task_lower <= task_upper)
+        {
+            tasks[num_tasks].table = table;
+            tasks[num_tasks].lower = task_lower;
+            tasks[num_tasks].upper = task_upper;
+            num_tasks++;
+        }
+    }
+    free(bounds);
+    if (num_tasks < 2)
+    {
+        free(tasks);
+        return false;
+    }
+
+    // 内存 sink 没有 fd 可以共享, 只能按顺序拼起来
+    bool memory_sink = table->output.fd == -1;
+    bool ordered = !table->scan_unordered && !memory_sink;
+    pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+    OutputTurn order = {.changed = PTHREAD_COND_INITIALIZER, .turn = 0};
+    result_writer_flush(&table->output);
+    for (uint32_t t = 0; t < num_tasks; t++)
+    {
+        result_writer_init(&tasks[t].writer, table->output.fd, table->output.mode);
+        tasks[t].writer.lock = &output_lock;
+        if (ordered)
+        {
+            tasks[t].writer.order = &order;
+            tasks[t].writer.position = t;
+        }
+        pthread_create(&tasks[t].thread, NULL, scan_worker_main, &tasks[t]);
+    }
+    for (uint32_t t = 0; t < num_tasks; t++)
+    {
+        pthread_join(tasks[t].thread, NULL);
+    }
+
+    for (uint32_t t = 0; t < num_tasks; t++)
+    {
+        ResultWriter *writer = &tasks[t].writer;
+        if (memory_sink)
+        {
+            memcpy(result_writer_reserve(&table->output, writer->length), writer->buffer, writer->length);
+            table->output.length += writer->length;
+        }
+        result_writer_free(writer);
+    }
+    free(tasks);
+    pthread_mutex_destroy(&output_lock);
+    pthread_cond_destroy(&order.changed);
+    return true;
+}
+
+// 第 child_num 个孩子子树里的行数; 旧格式的文件没有记下来, 只能往下数
+uint32_t internal_node_child_rows(Pager *pager, void *node, uint32_t child_num)
+{
+    if (INTERNAL_NODE_HAS_COUNTS)
+    {
+        return *internal_node_count(node, child_num);
+    }
+    uint32_t page_num = *internal_node_child(node, child_num);
+    void *child = get_page(pager, page_num);
+    uint32_t rows = 0;
+    if (get_node_type(child) == NODE_LEAF)
+    {
+        rows = *leaf_node_num_cells(child);
+    }
+    else
+    {
+        for (uint32_t i = 0; i <= *internal_node_num_keys(child); i++)
+        {
+            rows += internal_node_child_rows(pager, child, i);
+        }
+    }
+    unpin_page(pager, page_num);
+    return rows;
+}
+
+/*
+Order statistics over the subtree counts. table_rank is the number of
+rows with an id below key (key past UINT32_MAX counts them all), and
+table_key_at finds the id of the row at a 0-based position in id order.
+Each is one descent that adds up or steps over the counts of the
+children to the left of the path.
+*/
+uint64_t table_rank(Table *table, uint64_t key)
+{
+    Pager *pager = table->pager;
+    uint32_t page_num = table->root_page_num;
+    uint64_t rank = 0;
+    while (true)
+    {
+        void *node = get_page(pager, page_num);
+        if (get_node_type(node) == NODE_LEAF)
+        {
+            uint32_t num_cells = *leaf_node_num_cells(node);
+            rank += key > UINT32_MAX ? num_cells : key_lower_bound(leaf_node_key(node, 0), num_cells, key);
+            unpin_page(pager, page_num);
+            return rank;
+        }
+        uint32_t child_num = key > UINT32_MAX ? *internal_node_num_keys(node) : internal_node_find_child(node, key);
+        for (uint32_t i = 0; i < child_num; i++)
+        {
+            rank += internal_node_child_rows(pager, node, i);
+        }
+        uint32_t child_page_num = *internal_node_child(node, child_num);
+        unpin_page(pager, page_num);
+        page_num = child_page_num;
+    }
+}
+
+bool table_key_at(Table *table, uint64_t position, uint32_t *key)
+{
+    Pager *pager = table->pager;
+    uint32_t page_num = table->root_page_num;
+    while (true)
+    {
+        void *node = get_page(pager, page_num);
+        if (get_node_type(node) == NODE_LEAF)
+        {
+            bool found = position < *leaf_node_num_cells(node);
+            if (found)
+            {
+                *key = *leaf_node_key(node, position);
+            }
+            unpin_page(pager, page_num);
+            return found;
+        }
+        uint32_t num_keys = *internal_node_num_keys(node);
+        uint32_t child_num = 0;
+        uint32_t rows = internal_node_child_rows(pager, node, 0);
+        while (position >= rows && child_num < num_keys)
+        {
+            position -= rows;
+            rows = internal_node_child_rows(pager, node, ++child_num);
+        }
+        uint32_t child_page_num = *internal_node_child(node, child_num);
+        unpin_page(pager, page_num);
+        if (position >= rows)
+        {
+            return false;
+        }
+        page_num = child_page_num;
+    }
+}
+
+// offset M: 下界换成区间里第 M 行 (从 0 数) 的 id, 跳过的行不用读
+void table_skip_rows(Table *table, KeyRange *range)
+{
+    if (range->empty || range->offset == 0)
+    {
+        return;
+    }
+    uint32_t key;
+    if (!table_key_at(table, table_rank(table, range->lower) + range->offset, &key) || key > range->upper)
+    {
+        range->empty = true;
+        return;
+    }
+    range->lower = key;
+}
+
+/*
+Ids of the rows whose username or email equals range->value, within the
+id range, offset and limit, in id order. With an index on the column this is a
+descent to (value, lower) followed by a walk along the index leaves;
+without one the id range of the table is scanned.
+*/
+uint32_t table_match_column(Table *table, KeyRange *range, uint32_t **ids_out)
+{
+    Pager *pager = table->pager;
+    uint32_t count = 0;
+    uint32_t capacity = 16;
+    uint32_t *ids = malloc(sizeof(uint32_t) * capacity);
+    *ids_out = ids;
+    if (range->empty || range->limit == 0)
+    {
+        return 0;
+    }
+    uint8_t length = range->value.length;
+    uint32_t root_page_num = table->index_roots[range->column];
+    uint32_t skip = range->offset;
+
+    if (root_page_num != 0)
+    {
+        uint8_t key[INDEX_MAX_CELL_SIZE];
+        index_cell_build(key, 0, range->lower, range->value.start, length);
+        IndexPath path;
+        index_descend(pager, root_page_num, key, &path);
+        uint32_t page_num = path.pages[path.depth - 1];
+        uint32_t position = path.positions[path.depth - 1];
+        bool done = false;
+        while (page_num != 0 && !done)
+        {
+            void *node = get_page(pager, page_num);
+            for (; position < *index_node_num_cells(node); position++)
+            {
+                void *cell = index_node_cell(node, position);
+                uint32_t id = *index_cell_id(cell);
+                if (*(uint8_t *)(cell + INDEX_CELL_LENGTH_OFFSET) != length ||
+                    memcmp(cell + INDEX_CELL_VALUE_OFFSET, range->value.start, length) != 0 ||
+                    id > range->upper || count == range->limit)
+                {
+                    done = true;
+                    break;
+                }
+                if (skip > 0)
+                {
+                    skip--;
+                    continue;
+                }
+                if (count == capacity)
+                {
+                    capacity *= 2;
+                    ids = realloc(ids, sizeof(uint32_t) * capacity);
+                }
+                ids[count++] = id;
+            }
+            uint32_t next_page_num = *index_node_link(node);
+            unpin_page(pager, page_num);
+            page_num = next_page_num;
+            position = 0;
+        }
+        *ids_out = ids;
+        return count;
+    }
+
+    Cursor *cursor = table_find(table, range->lower);
+    cursor_settle(cursor);
+    while (!cursor->end_of_table && count < range->limit)
+    {
+        uint32_t id = cursor_key(cursor);
+        if (id > range->upper)
+        {
+            break;
+        }
+        uint8_t value_length;
+        void *value = row_value_column(cursor_value(cursor), range->column, &value_length);
+        bool match = value_length == length && memcmp(value, range->value.start, length) == 0;
+        if (match && skip > 0)
+        {
+            skip--;
+        }
+        else if (match)
+        {
+            if (count == capacity)
+            {
+                capacity *= 2;
+                ids = realloc(ids, sizeof(uint32_t) * capacity);
+            }
+            ids[count++] = id;
+        }
+        cursor_advance(cursor);
+    }
+    cursor_close(cursor);
+    *ids_out = ids;
+    return count;
+}
+
+// 给一列建索引: 新的根页, 把表里现有的行都插进去, 再记进文件头
+void table_build_index(Table *table, IndexColumn column)
+{
+    Pager *pager = table->pager;
+    uint32_t root_page_num = get_unused_page_num(pager);
+    void *root = get_page(pager, root_page_num);
+    mark_page_dirty(pager, root_page_num);
+    initialize_index_node(root, NODE_INDEX_LEAF);
+    set_node_root(root, true);
+    unpin_page(pager, root_page_num);
+
+    Cursor *cursor = table_start(table);
+    while (!cursor->end_of_table)
+    {
+        uint8_t length;
+        const char *value = row_value_column(cursor_value(cursor), column, &length);
+        index_insert(pager, root_page_num, cursor_key(cursor), value, length);
+        cursor_advance(cursor);
+    }
+    cursor_close(cursor);
+
+    void *header = get_page(pager, 0);
+    mark_page_dirty(pager, 0);
+    *header_index_root(header, column) = root_page_num;
+    unpin_page(pager, 0);
+    table->index_roots[column] = root_page_num;
+}
+
+ExecuteResult execute_create_index(Statement *statement, Table *table)
+{
+    table_flush_pending(table);
+    IndexColumn column = statement->index_column;
+    if (table->index_roots[column] != 0)
+    {
+        return EXECUTE_INDEX_EXISTS;
+    }
+    // 索引格不比表里的行长多少, 表占的页数就限定了它们的总字节数
+    uint64_t rows = table_rank(table, (uint64_t)UINT32_MAX + 1);
+    if (!table_has_room(table, tree_pages_for_cells(rows, (uint64_t)table->pager->num_pages * LEAF_NODE_SPACE_FOR_CELLS,
+                                                    50)))
+    {
+        return EXECUTE_TABLE_FULL;
+    }
+    table_build_index(table, column);
+    if (!table->in_batch)
+    {
+        table_commit(table);
+    }
+    return EXECUTE_SUCCESS;
+}
+
+/*
+count(*) over an id range is the difference of two ranks, so it costs two
+descents however many rows it covers; offset and limit then clip it. With
+a column predicate the matching ids are collected as for a select.
+*/
+void execute_count(Table *table, KeyRange *range)
+{
+    uint64_t rows = 0;
+    if (range->column != -1)
+    {
+        uint32_t *ids;
+        rows = table_match_column(table, range, &ids);
+        free(ids);
+    }
+    else if (!range->empty)
+    {
+        rows = table_rank(table, (uint64_t)range->upper + 1) - table_rank(table, range->lower);
+        rows = rows > range->offset ? rows - range->offset : 0;
+        rows = rows < range->limit ? rows : range->limit;
+    }
+    result_writer_count(&table->output, rows);
+    result_writer_flush(&table->output);
+}
+
+ExecuteResult execute_select(Statement *statement, Table *table)
+{
+    // 批里还没写进树的行也要能查到
+    table_flush_pending(table);
+    KeyRange key_range;
+    KeyRange *range = &key_range;
+    statement_range(statement, range);
+    if (statement->count)
+    {
+        execute_count(table, range);
+        return EXECUTE_SUCCESS;
+    }
+    if (range->column != -1)
+    {
+        // 按索引 (或扫描) 找到 id, 再回表取行
+        uint32_t *ids;
+        uint32_t count = table_match_column(table, range, &ids);
+        for (uint32_t i = 0; i < count; i++)
+        {
+            scan_range(table, ids[i], ids[i], 1, &table->output);
+        }
+        result_writer_flush(&table->output);
+        free(ids);
+        return EXECUTE_SUCCESS;
+    }
+    table_skip_rows(table, range);
+    if (range->empty || range->limit == 0)
+    {
+        return EXECUTE_SUCCESS;
+    }
+    // 只有全表扫描才值得让内核预读, 点查和小范围保持随机访问
+    bool full_scan = range->lower == 0 && range->upper == UINT32_MAX && range->limit == UINT32_MAX;
+    if (full_scan)
+    {
+        pager_advise(table->pager, PAGER_ACCESS_SEQUENTIAL);
+    }
+
+    // 有 limit 时要按顺序数行, 只能单线程扫
+    bool parallel = table->scan_threads > 1 && range->limit == UINT32_MAX &&
+                    execute_parallel_scan(table, range->lower, range->upper);
+    if (!parallel)
+    {
+        // 从下界定位, 沿叶子链表往右扫到上界或者 limit 为止
+        scan_range(table, range->lower, range->upper, range->limit, &table->output);
+        result_writer_flush(&table->output);
+    }
+    if (full_scan)
+    {
+        pager_advise(table->pager, PAGER_ACCESS_RANDOM);
+    }
+    return EXECUTE_SUCCESS;
+}
+
+/*
+delete works leaf by leaf: the matching cells of a leaf are removed
+together, the leaf is rebalanced once, and the next leaf is found by
+descending again from just past the last deleted key (rebalancing may
+have moved the remaining keys to another page).
+*/
+void delete_range(Table *table, uint32_t lower, uint32_t upper, uint32_t limit)
+{
+    Pager *pager = table->pager;
+    uint32_t remaining = limit;
+    uint32_t next_key = lower;
+    while (remaining > 0)
+    {
+        Cursor *cursor = table_find(table, next_key);
+        cursor_settle(cursor);
+        if (cursor->end_of_table)
+        {
+            cursor_close(cursor);
+            break;
+        }
+        uint32_t page_num = cursor->page_num;
+        uint32_t first = cursor->cell_num;
+        void *node = get_page(pager, page_num);
+        uint32_t num_cells = *leaf_node_num_cells(node);
+        uint32_t end = first;
+        while (end < num_cells && end - first < remaining && *leaf_node_key(node, end) <= upper)
+        {
+            end++;
+        }
+        uint32_t last_key = end > first ? *leaf_node_key(node, end - 1) : 0;
+        if (end > first)
+        {
+            mark_page_dirty(pager, page_num);
+        }
+        for (uint32_t i = first; i < end; i++)
+        {
+            table_index_update(table, *leaf_node_key(node, first), leaf_node_value(node, first), false);
+            leaf_node_remove_entry(node, first);
+        }
+        unpin_page(pager, page_num);
+        cursor_close(cursor);
+        if (end == first)
+        {
+            break;
+        }
+
+        remaining -= end - first;
+        table_count_add(table, last_key, -(int32_t)(end - first));
+        leaf_node_rebalance(table, page_num);
+        if (last_key >= upper)
+        {
+            break;
+        }
+        next_key = last_key + 1;
+    }
+}
+
+ExecuteResult execute_delete(Statement *statement, Table *table)
+{
+    table_flush_pending(table);
+    KeyRange key_range;
+    KeyRange *range = &key_range;
+    statement_range(statement, range);
+    if (range->column != -1)
+    {
+        // 先收集要删的 id, 再一个个删, 删除过程中不去读索引
+        uint32_t *ids;
+        uint32_t count = table_match_column(table, range, &ids);
+        for (uint32_t i = 0; i < count; i++)
+        {
+            delete_range(table, ids[i], ids[i], 1);
+        }
+        free(ids);
+    }
+    else
+    {
+        table_skip_rows(table, range);
+        if (!range->empty)
+        {
+            delete_range(table, range->lower, range->upper, range->limit);
+        }
+    }
+
+    if (!table->in_batch)
+    {
+        table_commit(table);
+    }
+    return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_statement(Statement *statement, Table *table)
+{
+    switch (statement->type)
+    {
+    case (STATEMENT_INSERT):
+    {
+        //        printf("This is where we would do an insert .\n");
+        //      break;
+        return execute_insert(statement, table);
+    }
+    case (STATEMENT_BEGIN):
+        return execute_begin(table);
+
+    case (STATEMENT_COMMIT):
+        return execute_commit(table);
+
+
+    case (STATEMEND_SELECT):
+        //        printf("This is where we would do a select .\n");
+        //        break;
+        return execute_select(statement, table);
+
+    case (STATEMENT_DELETE):
+        return execute_delete(statement, table);
+
+    case (STATEMENT_CREATE_INDEX):
+        return execute_create_index(statement, table);
+    }
+}
+
+const char *STATEMENT_NAMES[STATEMENT_TYPE_COUNT] = {"insert", "select", "begin", "commit", "delete", "create index"};
+
+uint32_t stats_bucket(uint64_t ns)
+{
+    uint64_t us = ns / 1000;
+    uint32_t bucket = 0;
+    while (us > 0 && bucket + 1 < STATS_HISTOGRAM_BUCKETS)
+    {
+        us >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+// nearest-rank 分位数: 排好序的 count 个样本里第 ceil(percentile * count) 个的下标
+uint64_t percentile_rank(uint64_t count, double percentile)
+{
+    uint64_t rank = (uint64_t)(percentile * count);
+    if ((double)rank < percentile * count)
+    {
+        rank++;
+    }
+    rank = rank == 0 ? 0 : rank - 1;
+    return rank < count ? rank : count - 1;
+}
+
+// 分位数所在的桶
+uint32_t stats_percentile_bucket(uint64_t *histogram, uint64_t count, double percentile)
+{
+    uint64_t rank = percentile_rank(count, percentile);
+    uint64_t seen = 0;
+    uint32_t bucket = 0;
+    for (; bucket + 1 < STATS_HISTOGRAM_BUCKETS; bucket++)
+    {
+        seen += histogram[bucket];
+        if (seen > rank)
+        {
+            break;
+        }
+    }
+    return bucket;
+}
+
+// 桶的范围: "< 2^i us", 最后一个桶没有上界, 是 ">= 2^(i-1) us"
+const char *stats_bucket_label(char *label, size_t size, uint32_t bucket)
+{
+    if (bucket + 1 == STATS_HISTOGRAM_BUCKETS)
+    {
+        snprintf(label, size, ">= %llu us", 1ull << (bucket - 1));
+    }
+    else
+    {
+        snprintf(label, size, "< %llu us", 1ull << bucket);
+    }
+    return label;
+}
+
+// 表的层数: 树是平衡的, 沿最左边的孩子走到叶子
+uint32_t table_depth(Table *table)
+{
+    Pager *pager = table->pager;
+    uint32_t page_num = table->root_page_num;
+    void *node = get_page(pager, page_num);
+    uint32_t depth = 1;
+    while (get_node_type(node) == NODE_INTERNAL)
+    {
+        uint32_t child_page_num = *internal_node_child(node, 0);
+        unpin_page(pager, page_num);
+        page_num = child_page_num;
+        node = get_page(pager, page_num);
+        depth++;
+    }
+    unpin_page(pager, page_num);
+    return depth;
+}
+
+void print_stats(Table *table, FILE *out)
+{
+    Pager *pager = table->pager;
+    pthread_mutex_lock(&pager->lock);
+    PagerStats pager_stats = pager->stats;
+    uint32_t num_pages = pager->num_pages;
+    int64_t read_ns = pager->read_ns;
+    pthread_mutex_unlock(&pager->lock);
+    void *header = get_page(pager, 0);
+    uint32_t free_pages = *header_free_count(header);
+    unpin_page(pager, 0);
+
+    fprintf(out, "pager:\n");
+    if (pager->mode == PAGER_MODE_MMAP)
+    {
+        fprintf(out, "  get_page hits: n/a (mmap), misses: n/a (mmap)\n");
+    }
+    else
+    {
+        uint64_t lookups = pager_stats.page_hits + pager_stats.page_misses;
+        fprintf(out, "  get_page hits: %llu, misses: %llu, hit rate: %.2f%% (%u frames)\n",
+                (unsigned long long)pager_stats.page_hits, (unsigned long long)pager_stats.page_misses,
+                lookups == 0 ? 0.0 : 100.0 * pager_stats.page_hits / lookups, pager->num_frames);
+    }
+    fprintf(out, "  bytes read: %llu, written: %llu, wal written: %llu, pages prefetched: %llu\n",
+            (unsigned long long)pager_stats.bytes_read, (unsigned long long)pager_stats.bytes_written,
+            (unsigned long long)pager_stats.wal_bytes_written, (unsigned long long)pager_stats.prefetch_reads);
+    if (pager->mode == PAGER_MODE_BUFFERED)
+    {
+        fprintf(out, "  recent page read: %.1f us\n", read_ns / 1000.0);
+    }
+    fprintf(out, "btree:\n");
+    fprintf(out, "  depth: %u, pages: %u (%u free)\n", table_depth(table), num_pages, free_pages);
+    fprintf(out, "  leaf splits: %llu, internal splits: %llu\n", (unsigned long long)table->stats.leaf_splits,
+            (unsigned long long)table->stats.internal_splits);
+    fprintf(out, "statements:\n");
+    for (uint32_t type = 0; type < STATEMENT_TYPE_COUNT; type++)
+    {
+        uint64_t count = table->stats.statements[type];
+        if (count == 0)
+        {
+            continue;
+        }
+        uint64_t *histogram = table->stats.histogram[type];
+        char p50[32], p99[32], max[32];
+        fprintf(out, "  %s: %llu statements, avg %.1f us, p50 %s, p99 %s, max %s\n", STATEMENT_NAMES[type],
+                (unsigned long long)count, table->stats.statement_ns[type] / 1000.0 / count,
+                stats_bucket_label(p50, sizeof(p50), stats_percentile_bucket(histogram, count, 0.50)),
+                stats_bucket_label(p99, sizeof(p99), stats_percentile_bucket(histogram, count, 0.99)),
+                stats_bucket_label(max, sizeof(max), stats_percentile_bucket(histogram, count, 1.0)));
+        fprintf(out, "   ");
+        for (uint32_t bucket = 0; bucket < STATS_HISTOGRAM_BUCKETS; bucket++)
+        {
+            if (histogram[bucket] == 0)
+            {
+                continue;
+            }
+            if (bucket + 1 == STATS_HISTOGRAM_BUCKETS)
+            {
+                fprintf(out, " >=%llu us: %llu", 1ull << (bucket - 1), (unsigned long long)histogram[bucket]);
+            }
+            else
+            {
+                fprintf(out, " <%llu us: %llu", 1ull << bucket, (unsigned long long)histogram[bucket]);
+            }
+        }
+        fprintf(out, "\n");
+    }
+}
+
+void stats_reset(Table *table)
+{
+    pthread_mutex_lock(&table->pager->lock);
+    memset(&table->pager->stats, 0, sizeof(PagerStats));
+    pthread_mutex_unlock(&table->pager->lock);
+    memset(&table->stats, 0, sizeof(TableStats));
+}
+
+// 给 .stats dump 的文件追加一份带时间的统计
+void stats_dump(Table *table)
+{
+    time_t now = time(NULL);
+    char stamp[32];
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&now));
+    fprintf(table->stats_file, "-- %s\n", stamp);
+    print_stats(table, table->stats_file);
+    fflush(table->stats_file);
+}
+
+// 执行一条解析好的语句; 参数要全部绑定过. 可以反复 bind/step
+ExecuteResult db_step(Statement *statement, Table *table)
+{
+    for (uint32_t i = 0; i < statement->num_params; i++)
+    {
+        if (!statement->params[i].bound)
+        {
+            return EXECUTE_UNBOUND_PARAMETER;
+        }
+    }
+    if (table->snapshot_of != NULL && statement->type != STATEMEND_SELECT)
+    {
+        return EXECUTE_READ_ONLY;
+    }
+    uint64_t started = monotonic_ns();
+    ExecuteResult result = execute_statement(statement, table);
+    uint64_t finished = monotonic_ns();
+    table->stats.statements[statement->type]++;
+    table->stats.statement_ns[statement->type] += finished - started;
+    table->stats.histogram[statement->type][stats_bucket(finished - started)]++;
+
+    // 定期写统计是在语句之间检查的, 空闲的时候不写
+    if (table->stats_file != NULL && finished - table->stats_last_dump >= table->stats_interval_ns)
+    {
+        table->stats_last_dump = finished;
+        stats_dump(table);
+    }
+    return result;
+}
+
+void print_prepare_result(PrepareResult result, const char *input)
+{
+    switch (result)
+    {
+    case (PREPARE_SUCCESS):
+        break;
+
+    case (PREPARE_STRING_TOO_LONG):
+        printf("strint is too long\n");
+        break;
+
+    case (PREPPARE_NEGATIVE_ID):
+    case (PREPARE_SYNTAX_ERROR):
+        printf("Unrecogniezed keyword at start of '%s'.\n", input);
+        break;
+
+    case (PREPARE_UNRECOGNIZED_STATEMENT):
+        printf("unrecongnized keyword at start of '%s'.\n  ", input);
+        break;
+    }
+}
+
+// 错误的说明文字, 成功时返回 NULL
+const char *execute_result_message(ExecuteResult result)
+{
+    switch (result)
+    {
+    case (EXECUTE_SUCCESS):
+        break;
+    case (EXECUTE_DUPLICATE_KEY):
+        return "ERROR: Duplicate key.";
+    case (EXECUTE_ALREADY_IN_BATCH):
+        return "ERROR: Already inside begin.";
+    case (EXECUTE_INDEX_EXISTS):
+        return "ERROR: Index already exists.";
+    case (EXECUTE_UNBOUND_PARAMETER):
+        return "ERROR: Unbound parameter.";
+    case (EXECUTE_READ_ONLY):
+        return "ERROR: Snapshot is read-only.";
+    case (EXECUTE_NOT_IN_BATCH):
+        return "ERROR: commit without begin.";
+    case (EXECUTE_TABLE_FULL):
+        return "ERROR: table full .";
+    }
+    return NULL;
+}
+
+// quiet 时不打印成功, 只报告错误
+void print_execute_result(ExecuteResult result, bool quiet)
+{
+    if (result != EXECUTE_SUCCESS)
+    {
+        printf("%s\n", execute_result_message(result));
+    }
+    else if (!quiet)
+    {
+        printf("Executed.\n");
+    }
+}
+
+PreparedStatement *find_prepared(Table *table, const char *name, uint32_t length)
+{
+    for (PreparedStatement *entry = table->prepared; entry != NULL; entry = entry->next)
+    {
+        if (strlen(entry->name) == length && strncmp(entry->name, name, length) == 0)
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// .prepare <name> <statement>: 同名的语句被替换
+bool execute_prepare_command(Table *table, const char *arguments)
+{
+    Token name;
+    if (!next_token(&arguments, &name))
+    {
+        printf("Usage: .prepare <name> <statement>\n");
+        return false;
+    }
+    while (*arguments == ' ')
+    {
+        arguments++;
+    }
+    Statement statement;
+    PrepareResult result = db_prepare(arguments, &statement);
+    if (result != PREPARE_SUCCESS)
+    {
+        print_prepare_result(result, arguments);
+        return false;
+    }
+    PreparedStatement *entry = find_prepared(table, name.start, name.length);
+    if (entry == NULL)
+    {
+        entry = malloc(sizeof(PreparedStatement));
+        entry->name = strndup(name.start, name.length);
+        entry->next = table->prepared;
+        table->prepared = entry;
+    }
+    else
+    {
+        db_finalize(&entry->statement);
+    }
+    entry->statement = statement;
+    return true;
+}
+
+// .exec <name> [参数...]: 参数直接指向输入行, 按顺序绑定到各个 ?
+bool execute_exec_command(Table *table, const char *arguments, bool quiet)
+{
+    Token name;
+    if (!next_token(&arguments, &name))
+    {
+        printf("Usage: .exec <name> [parameters...]\n");
+        return false;
+    }
+    PreparedStatement *entry = find_prepared(table, name.start, name.length);
+    if (entry == NULL)
+    {
+        printf("ERROR: No prepared statement '%.*s'.\n", (int)name.length, name.start);
+        return false;
+    }
+    Statement *statement = &entry->statement;
+    Token argument;
+    uint32_t count = 0;
+    while (next_token(&arguments, &argument))
+    {
+        PrepareResult result = count < statement->num_params
+                                   ? db_bind_text(statement, count, argument.start, argument.length)
+                                   : PREPARE_SYNTAX_ERROR;
+        count++;
+        if (result == PREPARE_STRING_TOO_LONG)
+        {
+            printf("strint is too long\n");
+            return false;
+        }
+        if (result != PREPARE_SUCCESS && count <= statement->num_params)
+        {
+            printf("ERROR: Bad value for parameter %u.\n", count);
+            return false;
+        }
+        if (result != PREPARE_SUCCESS)
+        {
+            break;
+        }
+    }
+    if (count != statement->num_params)
+    {
+        printf("ERROR: '%s' takes %u parameters.\n", entry->name, statement->num_params);
+        return false;
+    }
+    ExecuteResult result = db_step(statement, table);
+    print_execute_result(result, quiet);
+    return result == EXECUTE_SUCCESS;
+}
+
+/*
+.import: external merge sort of the input followed by a bottom-up build.
+Leaves are written left to right at the requested fill factor and chained
+through next_leaf; every level keeps one open internal node that collects
+(child, max key) pairs and is written out when it is full.
+*/
+typedef struct
+{
+    uint32_t page_num; // 正在填的节点, 没有时为 INVALID_PAGE_NUM
+    uint32_t num_children;
+    uint32_t *children;
+    uint32_t *keys;
+    uint32_t *counts; // 每个孩子子树的行数
+    uint32_t nodes_created;
+} BulkLevel;
+
+typedef struct
+{
+    Table *table;
+    uint32_t leaf_reserve; // 每个叶子留出的空闲字节
+    uint32_t internal_capacity;
+    uint32_t leaf_page_num; // 正在填的叶子
+    void *leaf;
+    uint32_t prev_leaf_page_num; // 上一个叶子保持 pin 住, 等下一个叶子分配后再链起来
+    void *prev_leaf;
+    uint32_t leaves_created;
+    uint64_t rows;
+    BulkLevel levels[BULK_MAX_LEVELS];
+} BulkLoader;
+
+void bulk_loader_init(BulkLoader *loader, Table *table, uint32_t fill_percent)
+{
+    loader->table = table;
+    loader->leaf_reserve = LEAF_NODE_SPACE_FOR_CELLS * (100 - fill_percent) / 100;
+    loader->internal_capacity = (INTERNAL_NODE_MAX_CELLS + 1) * fill_percent / 100;
+    if (loader->internal_capacity < 2)
+    {
+        loader->internal_capacity = 2;
+    }
+    loader->leaf_page_num = INVALID_PAGE_NUM;
+    loader->leaf = NULL;
+    loader->prev_leaf_page_num = INVALID_PAGE_NUM;
+    loader->prev_leaf = NULL;
+    loader->leaves_created = 0;
+    loader->rows = 0;
+    for (uint32_t i = 0; i < BULK_MAX_LEVELS; i++)
+    {
+        BulkLevel *level = &loader->levels[i];
+        level->page_num = INVALID_PAGE_NUM;
+        level->num_children = 0;
+        level->children = malloc(sizeof(uint32_t) * loader->internal_capacity);
+        level->keys = malloc(sizeof(uint32_t) * loader->internal_capacity);
+        level->counts = malloc(sizeof(uint32_t) * loader->internal_capacity);
+        level->nodes_created = 0;
+    }
+}
+
+uint32_t bulk_loader_push(BulkLoader *loader, uint32_t level_index, uint32_t child_page_num,
+                          uint32_t child_max_key, uint32_t child_rows);
+
+// 把一层里正在填的内部节点写到页里, 并挂到上一层; 返回它的页号
+void bulk_loader_finish_node(BulkLoader *loader, uint32_t level_index)
+{
+    Pager *pager = loader->table->pager;
+    BulkLevel *level = &loader->levels[level_index];
+    uint32_t page_num = level->page_num;
+    uint32_t max_key = level->keys[level->num_children - 1];
+    uint32_t rows = 0;
+    for (uint32_t i = 0; i < level->num_children; i++)
+    {
+        rows += level->counts[i];
+    }
+
+    void *node = get_page(pager, page_num);
+    mark_page_dirty(pager, page_num);
+    internal_node_fill(node, level->children, level->keys, level->counts, level->num_children);
+    unpin_page(pager, page_num);
+
+    level->page_num = INVALID_PAGE_NUM;
+    level->num_children = 0;
+    uint32_t parent_page_num = bulk_loader_push(loader, level_index + 1, page_num, max_key, rows);
+
+    node = get_page(pager, page_num);
+    *node_parent(node) = parent_page_num;
+    unpin_page(pager, page_num);
+}
+
+// 把一个孩子加到某一层正在填的节点里, 返回这个节点的页号 (即孩子的父节点)
+uint32_t bulk_loader_push(BulkLoader *loader, uint32_t level_index, uint32_t child_page_num,
+                          uint32_t child_max_key, uint32_t child_rows)
+{
+    if (level_index >= BULK_MAX_LEVELS)
+    {
+        printf("Bulk load exceeded %d internal levels.\n", BULK_MAX_LEVELS);
+        exit(EXIT_FAILURE);
+    }
+
+    Pager *pager = loader->table->pager;
+    BulkLevel *level = &loader->levels[level_index];
+    if (level->page_num == INVALID_PAGE_NUM)
+    {
+        level->page_num = get_unused_page_num(pager);
+        void *node = get_page(pager, level->page_num);
+        mark_page_dirty(pager, level->page_num);
+        initialize_internal_node(node);
+        unpin_page(pager, level->page_num);
+        level->nodes_created++;
+    }
+
+    uint32_t page_num = level->page_num;
+    level->children[level->num_children] = child_page_num;
+    level->keys[level->num_children] = child_max_key;
+    level->counts[level->num_children] = child_rows;
+    level->num_children++;
+    if (level->num_children == loader->internal_capacity)
+    {
+        bulk_loader_finish_node(loader, level_index);
+    }
+    return page_num;
+}
+
+void bulk_loader_finish_leaf(BulkLoader *loader)
+{
+    Pager *pager = loader->table->pager;
+    void *leaf = loader->leaf;
+    uint32_t max_key = *leaf_node_key(leaf, *leaf_node_num_cells(leaf) - 1);
+    *node_parent(leaf) = bulk_loader_push(loader, 0, loader->leaf_page_num, max_key, *leaf_node_num_cells(leaf));
+
+    if (loader->prev_leaf != NULL)
+    {
+        unpin_page(pager, loader->prev_leaf_page_num);
+    }
+    loader->prev_leaf_page_num = loader->leaf_page_num;
+    loader->prev_leaf = leaf;
+    loader->leaf_page_num = INVALID_PAGE_NUM;
+    loader->leaf = NULL;
+}
+
+void bulk_loader_add(BulkLoader *loader, Row *row)
+{
+    Pager *pager = loader->table->pager;
+    uint32_t row_size = row_value_size(row);
+    if (loader->leaf != NULL && *leaf_node_num_cells(loader->leaf) > 0 &&
+        leaf_node_gap(loader->leaf) < row_size + LEAF_NODE_ENTRY_SIZE + loader->leaf_reserve)
+    {
+        bulk_loader_finish_leaf(loader);
+    }
+    if (loader->leaf == NULL)
+    {
+        loader->leaf_page_num = get_unused_page_num(pager);
+        loader->leaf = get_page(pager, loader->leaf_page_num);
+        mark_page_dirty(pager, loader->leaf_page_num);
+        initialize_leaf_node(loader->leaf);
+        loader->leaves_created++;
+        if (loader->prev_leaf != NULL)
+        {
+            *leaf_node_next_leaf(loader->prev_leaf) = loader->leaf_page_num;
+        }
+    }
+
+    uint8_t value[LEAF_NODE_MAX_VALUE_SIZE];
+    serialize_row(row, value);
+    leaf_node_append_cell(loader->leaf, row->id, value, row_size);
+    table_index_update(loader->table, row->id, value, true);
+    loader->rows++;
+}
+
+// 把最顶层那个节点的内容搬进根页, 孩子的父指针改成根, 原来的页放回空闲链表
+void bulk_loader_install_root(BulkLoader *loader, uint32_t top_page_num)
+{
+    Table *table = loader->table;
+    Pager *pager = table->pager;
+    void *top = get_page(pager, top_page_num);
+    void *root = get_page(pager, table->root_page_num);
+    mark_page_dirty(pager, table->root_page_num);
+    memcpy(root, top, PAGE_SIZE);
+    set_node_root(root, true);
+    *node_parent(root) = 0;
+    unpin_page(pager, top_page_num);
+
+    if (get_node_type(root) == NODE_INTERNAL)
+    {
+        for (uint32_t i = 0; i <= *internal_node_num_keys(root); i++)
+        {
+            uint32_t child_page_num = *internal_node_child(root, i);
+            void *child = get_page(pager, child_page_num);
+            mark_page_dirty(pager, child_page_num);
+            *node_parent(child) = table->root_page_num;
+            unpin_page(pager, child_page_num);
+        }
+    }
+    unpin_page(pager, table->root_page_num);
+    free_page_num(pager, top_page_num);
+}
+
+void bulk_loader_finish(BulkLoader *loader)
+{
+    Pager *pager = loader->table->pager;
+    uint32_t top_page_num = INVALID_PAGE_NUM;
+
+    if (loader->leaves_created == 1)
+    {
+        top_page_num = loader->leaf_page_num;
+        unpin_page(pager, loader->leaf_page_num);
+    }
+    else if (loader->leaves_created > 1)
+    {
+        bulk_loader_finish_leaf(loader);
+        unpin_page(pager, loader->prev_leaf_page_num);
+    }
+
+    // 自底向上收尾: 每层只剩一个节点且上面没有层时, 它就是根
+    for (uint32_t i = 0; i < BULK_MAX_LEVELS && top_page_num == INVALID_PAGE_NUM; i++)
+    {
+        BulkLevel *level = &loader->levels[i];
+        if (level->page_num == INVALID_PAGE_NUM)
+        {
+            continue;
+        }
+        bool is_top = level->nodes_created == 1 &&
+                      (i + 1 == BULK_MAX_LEVELS || loader->levels[i + 1].nodes_created == 0);
+        if (is_top && level->num_children == 1)
+        {
+            top_page_num = level->children[0]; // 只有一个孩子时让孩子当根, 省掉一层
+            free_page_num(pager, level->page_num);
+        }
+        else if (is_top)
+        {
+            top_page_num = level->page_num;
+            void *node = get_page(pager, top_page_num);
+            mark_page_dirty(pager, top_page_num);
+            internal_node_fill(node, level->children, level->keys, level->counts, level->num_children);
+            unpin_page(pager, top_page_num);
+        }
+        else
+        {
+            bulk_loader_finish_node(loader, i);
+        }
+    }
+
+    if (top_page_num != INVALID_PAGE_NUM)
+    {
+        bulk_loader_install_root(loader, top_page_num);
+    }
+    for (uint32_t i = 0; i < BULK_MAX_LEVELS; i++)
+    {
+        free(loader->levels[i].children);
+        free(loader->levels[i].keys);
+        free(loader->levels[i].counts);
+    }
+}
+
+int compare_rows_by_id(const void *a, const void *b)
+{
+    uint32_t left = ((const Row *)a)->id;
+    uint32_t right = ((const Row *)b)->id;
+    return (left > right) - (left < right);
+}
+
+typedef enum
+{
+    IMPORT_ROW_OK,
+    IMPORT_ROW_EOF,
+    IMPORT_ROW_SKIP, // 空行或表头
+    IMPORT_ROW_ERROR
+} ImportRowResult;
+
+/*
+Binary import records are fixed size: a little-endian uint32 id followed
+by the NUL padded username and email fields of Row.
+*/
+ImportRowResult import_read_binary_row(FILE *input, Row *row)
+{
+    uint8_t record[ID_SIZE + USERNAME_SIZE + EMAIL_SIZE];
+    size_t bytes_read = fread(record, 1, sizeof(record), input);
+    if (bytes_read == 0)
+    {
+        return IMPORT_ROW_EOF;
+    }
+    if (bytes_read != sizeof(record))
+    {
+        return IMPORT_ROW_ERROR;
+    }
+    memcpy(&row->id, record, ID_SIZE);
+    memcpy(row->username, record + ID_SIZE, USERNAME_SIZE);
+    memcpy(row->email, record + ID_SIZE + USERNAME_SIZE, EMAIL_SIZE);
+    row->username[COLUMN_USERNAME_SIZE] = '\0';
+    row->email[COLUMN_EMAIL_SIZE] = '\0';
+    return IMPORT_ROW_OK;
+}
+
+/*
+one CSV field starting at *cursor, RFC 4180 style as format_csv_field
+writes it: a quoted field may hold commas, newlines and doubled quotes.
+The field is unquoted in place; more tells whether a comma followed.
+Returns false on a stray or unterminated quote.
+*/
+bool csv_parse_field(char **cursor, char **field, bool *more)
+{
+    char *text = *cursor;
+    *field = text;
+    if (*text != '"')
+    {
+        char *end = text + strcspn(text, ",\"");
+        if (*end == '"')
+        {
+            return false;
+        }
+        *more = *end == ',';
+        *end = '\0';
+        *cursor = *more ? end + 1 : end;
+        return true;
+    }
+
+    // 去引号后的内容往前挪一个字节, 写的位置总在读的位置之前
+    char *out = text;
+    text++;
+    while (true)
+    {
+        if (*text == '\0')
+        {
+            return false;
+        }
+        if (*text == '"' && text[1] == '"')
+        {
+            *out++ = '"';
+            text += 2;
+        }
+        else if (*text == '"')
+        {
+            text++;
+            break;
+        }
+        else
+        {
+            *out++ = *text++;
+        }
+    }
+    if (*text != ',' && *text != '\0')
+    {
+        return false;
+    }
+    *more = *text == ',';
+    *out = '\0';
+    *cursor = *more ? text + 1 : text;
+    return true;
+}
+
+// CSV 行格式: id,username,email; 引号里的换行让一条记录跨多行
+ImportRowResult import_read_csv_row(FILE *input, Row *row, char **line, size_t *line_capacity,
+                                    uint64_t line_number)
+{
+    ssize_t length = getline(line, line_capacity, input);
+    if (length == -1)
+    {
+        return IMPORT_ROW_EOF;
+    }
+    // 引号个数是奇数说明引号里的字段还没完, 接上下一行
+    size_t quotes = 0;
+    for (ssize_t i = 0; i < length; i++)
+    {
+        quotes += (*line)[i] == '"';
+    }
+    while (quotes % 2 == 1)
+    {
+        char *more_text = NULL;
+        size_t more_capacity = 0;
+        ssize_t more_length = getline(&more_text, &more_capacity, input);
+        if (more_length == -1)
+        {
+            free(more_text);
+            return IMPORT_ROW_ERROR;
+        }
+        if ((size_t)(length + more_length + 1) > *line_capacity)
+        {
+            *line_capacity = length + more_length + 1;
+            *line = realloc(*line, *line_capacity);
+        }
+        memcpy(*line + length, more_text, more_length + 1);
+        length += more_length;
+        for (ssize_t i = 0; i < more_length; i++)
+        {
+            quotes += more_text[i] == '"';
+        }
+        free(more_text);
+    }
+    char *text = *line;
+    while (length > 0 && (text[length - 1] == '\n' || text[length - 1] == '\r'))
+    {
+        text[--length] = '\0';
+    }
+    if (length == 0)
+    {
+        return IMPORT_ROW_SKIP;
+    }
+
+    char *cursor = text;
+    char *id_text;
+    char *username;
+    char *email;
+    bool more;
+    if (!csv_parse_field(&cursor, &id_text, &more) || !more ||
+        !csv_parse_field(&cursor, &username, &more) || !more ||
+        !csv_parse_field(&cursor, &email, &more) || more)
+    {
+        return IMPORT_ROW_ERROR;
+    }
+    text = id_text;
+
+    char *id_end;
+    errno = 0;
+    unsigned long id = strtoul(text, &id_end, 10);
+    if (id_end == text || *id_end != '\0' || errno != 0 || id > UINT32_MAX)
+    {
+        // 第一行不是数字就当作表头
+        return line_number == 1 ? IMPORT_ROW_SKIP : IMPORT_ROW_ERROR;
+    }
+    if (strlen(username) > COLUMN_USERNAME_SIZE || strlen(email) > COLUMN_EMAIL_SIZE)
+    {
+        return IMPORT_ROW_ERROR;
+    }
+    row->id = id;
+    memcpy(row->username, username, strlen(username) + 1);
+    memcpy(row->email, email, strlen(email) + 1);
+    return IMPORT_ROW_OK;
+}
+
+typedef struct
+{
+    FILE *file;
+    Row row;
+} ImportRun;
+
+// 小顶堆, 按每个 run 当前行的 id 排序
+void import_heap_sift_down(ImportRun **heap, uint32_t size, uint32_t index)
+{
+    while (true)
+    {
+        uint32_t smallest = index;
+        uint32_t left = 2 * index + 1;
+        uint32_t right = left + 1;
+        if (left < size && heap[left]->row.id < heap[smallest]->row.id)
+        {
+            smallest = left;
+        }
+        if (right < size && heap[right]->row.id < heap[smallest]->row.id)
+        {
+            smallest = right;
+        }
+        if (smallest == index)
+        {
+            return;
+        }
+        ImportRun *swap = heap[index];
+        heap[index] = heap[smallest];
+        heap[smallest] = swap;
+        index = smallest;
+    }
+}
+
+bool execute_import(Table *table, const char *filename, uint32_t fill_percent)
+{
+    Pager *pager = table->pager;
+    void *root = get_page(pager, table->root_page_num);
+    bool empty = get_node_type(root) == NODE_LEAF && *leaf_node_num_cells(root) == 0;
+    unpin_page(pager, table->root_page_num);
+    if (!empty)
+    {
+        printf("ERROR: .import needs an empty table.\n");
+        return false;
+    }
+
+    FILE *input = fopen(filename, "r");
+    if (input == NULL)
+    {
+        printf("ERROR: unable to open '%s'.\n", filename);
+        return false;
+    }
+    size_t name_length = strlen(filename);
+    bool binary = name_length > 4 && strcmp(filename + name_length - 4, ".bin") == 0;
+
+    /*
+    Phase 1: read sorted runs. A run that does not fit in memory is spilled
+    to a temporary file; the whole input is validated before the table is
+    touched.
+    */
+    Row *run = malloc(sizeof(Row) * IMPORT_RUN_ROWS);
+    ImportRun *runs = NULL;
+    uint32_t num_runs = 0;
+    uint32_t run_length = 0;
+    uint64_t total_rows = 0; // 各段去重之后的行数和字节数, 段之间的重复键不算
+    uint64_t total_bytes = 0;
+    uint64_t duplicates = 0;
+    uint64_t line_number = 0;
+    char *line = NULL;
+    size_t line_capacity = 0;
+    bool failed = false;
+    bool at_eof = false;
+
+    while (!at_eof && !failed)
+    {
+        run_length = 0;
+        while (run_length < IMPORT_RUN_ROWS)
+        {
+            line_number++;
+            ImportRowResult result = binary
+                                         ? import_read_binary_row(input, &run[run_length])
+                                         : import_read_csv_row(input, &run[run_length], &line,
+                                                               &line_capacity, line_number);
+            if (result == IMPORT_ROW_EOF)
+            {
+                at_eof = true;
+                break;
+            }
+            if (result == IMPORT_ROW_ERROR)
+            {
+                printf("ERROR: malformed %s %llu in '%s'.\n", binary ? "record" : "line",
+                       (unsigned long long)line_number, filename);
+                failed = true;
+                break;
+            }
+            if (result == IMPORT_ROW_OK)
+            {
+                run_length++;
+            }
+        }
+        if (failed)
+        {
+            break;
+        }
+
+        qsort(run, run_length, sizeof(Row), compare_rows_by_id);
+        uint32_t unique_length = 0;
+        for (uint32_t i = 0; i < run_length; i++)
+        {
+            if (unique_length > 0 && run[unique_length - 1].id == run[i].id)
+            {
+                duplicates++;
+                continue;
+            }
+            run[unique_length++] = run[i];
+            total_bytes += row_value_size(&run[i]) + LEAF_NODE_ENTRY_SIZE;
+        }
+        run_length = unique_length;
+        total_rows += run_length;
+
+        if (at_eof && num_runs == 0)
+        {
+            break; // 整个输入放得进内存, 不需要落盘
+        }
+        FILE *spill = tmpfile();
+        if (spill == NULL || fwrite(run, sizeof(Row), run_length, spill) != run_length)
+        {
+            printf("ERROR: unable to write temporary sort run.\n");
+            failed = true;
+            break;
+        }
+        rewind(spill);
+        runs = realloc(runs, sizeof(ImportRun) * (num_runs + 1));
+        runs[num_runs++].file = spill;
+        run_length = 0;
+    }
+    free(line);
+    fclose(input);
+
+    if (!failed &&
+        !table_has_room(table, table_pages_for_rows(table, total_rows, total_bytes, fill_percent)))
+    {
+        printf("%s\n", execute_result_message(EXECUTE_TABLE_FULL));
+        failed = true;
+    }
+    if (!failed)
+    {
+        // Phase 2: merge the runs straight into the bottom-up builder.
+        BulkLoader loader;
+        bulk_loader_init(&loader, table, fill_percent);
+        if (num_runs == 0)
+        {
+            for (uint32_t i = 0; i < run_length; i++)
+            {
+                bulk_loader_add(&loader, &run[i]);
+            }
         }
         else
         {
-            min_index = index + 1;
+            ImportRun **heap = malloc(sizeof(ImportRun *) * num_runs);
+            uint32_t heap_size = 0;
+            for (uint32_t i = 0; i < num_runs; i++)
+            {
+                if (fread(&runs[i].row, sizeof(Row), 1, runs[i].file) == 1)
+                {
+                    heap[heap_size++] = &runs[i];
+                }
+            }
+            for (int32_t i = (int32_t)heap_size / 2 - 1; i >= 0; i--)
+            {
+                import_heap_sift_down(heap, heap_size, i);
+            }
+
+            bool have_last = false;
+            uint32_t last_id = 0;
+            while (heap_size > 0)
+            {
+                ImportRun *smallest = heap[0];
+                if (have_last && smallest->row.id == last_id)
+                {
+                    duplicates++;
+                }
+                else
+                {
+                    bulk_loader_add(&loader, &smallest->row);
+                    last_id = smallest->row.id;
+                    have_last = true;
+                }
+                if (fread(&smallest->row, sizeof(Row), 1, smallest->file) != 1)
+                {
+                    heap[0] = heap[--heap_size];
+                }
+                import_heap_sift_down(heap, heap_size, 0);
+            }
+            free(heap);
+        }
+        bulk_loader_finish(&loader);
+        printf("Imported %llu rows into %d leaves", (unsigned long long)loader.rows,
+               loader.leaves_created);
+        if (duplicates > 0)
+        {
+            printf(", skipped %llu duplicate keys", (unsigned long long)duplicates);
         }
+        printf(".\n");
     }
-    return min_index;
+
+    for (uint32_t i = 0; i < num_runs; i++)
+    {
+        fclose(runs[i].file);
+    }
+    free(runs);
+    free(run);
+    return !failed;
 }
 
-void create_new_root(Table *table, uint32_t right_child_page_num)
+/*
+.analyze: walk the tree level by level and report how full the pages are,
+then follow the leaf chain and count the links that do not lead to the
+next page of the file. A scan follows the chain, so each of those is a
+seek instead of a sequential read.
+*/
+void execute_analyze(Table *table)
 {
-    void *root = get_page(table->pager, table->root_page_num);
-    void *right_child = get_page(table->pager, right_child_page_num);
+    table_flush_pending(table);
+    Pager *pager = table->pager;
+    uint32_t *pages = malloc(sizeof(uint32_t));
+    uint32_t count = 1;
+    pages[0] = table->root_page_num;
+    uint32_t first_leaf = table->root_page_num;
+    for (uint32_t level = 0; count > 0; level++)
+    {
+        uint32_t *children = NULL;
+        uint32_t num_children = 0;
+        uint32_t children_capacity = 0;
+        uint64_t entries = 0;
+        uint64_t used_bytes = 0;
+        bool leaves = false;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            void *node = get_page(pager, pages[i]);
+            if (get_node_type(node) == NODE_LEAF)
+            {
+                leaves = true;
+                entries += *leaf_node_num_cells(node);
+                used_bytes += leaf_node_used_bytes(node);
+            }
+            else
+            {
+                uint32_t num_keys = *internal_node_num_keys(node);
+                entries += num_keys + 1;
+                if (num_children + num_keys + 1 > children_capacity)
+                {
+                    children_capacity = 2 * (num_children + num_keys + 1);
+                    children = realloc(children, sizeof(uint32_t) * children_capacity);
+                }
+                for (uint32_t j = 0; j <= num_keys; j++)
+                {
+                    children[num_children++] = *internal_node_child(node, j);
+                }
+            }
+            unpin_page(pager, pages[i]);
+        }
+        double fill = leaves ? 100.0 * used_bytes / ((uint64_t)count * LEAF_NODE_SPACE_FOR_CELLS)
+                             : 100.0 * entries / ((uint64_t)count * (INTERNAL_NODE_MAX_CELLS + 1));
+        printf("level %u: %u %s pages, %llu %s, average fill %.1f%%\n", level, count,
+               leaves ? "leaf" : "internal", (unsigned long long)entries, leaves ? "rows" : "children", fill);
+        if (leaves)
+        {
+            first_leaf = pages[0];
+        }
+        free(pages);
+        pages = children;
+        count = num_children;
+    }
+    free(pages);
 
-    uint32_t left_child_page_num = get_unused_page_num(table->pager);
-    void *left_child = get_page(table->pager, left_child_page_num);
+    uint32_t links = 0;
+    uint32_t out_of_order = 0;
+    uint32_t backward = 0;
+    uint32_t page_num = first_leaf;
+    while (true)
+    {
+        void *node = get_page(pager, page_num);
+        uint32_t next_page_num = *leaf_node_next_leaf(node);
+        unpin_page(pager, page_num);
+        if (next_page_num == 0)
+        {
+            break;
+        }
+        links++;
+        if (next_page_num != page_num + 1)
+        {
+            out_of_order++;
+        }
+        if (next_page_num < page_num)
+        {
+            backward++;
+        }
+        page_num = next_page_num;
+    }
+    printf("leaf chain: %u links, %u not to the next page (%.1f%%), %u backward\n", links, out_of_order,
+           links == 0 ? 0.0 : 100.0 * out_of_order / links, backward);
 
-    memcpy(left_child, root, PAGE_SIZE);
-    set_node_root(left_child, false);
-    initialize_internal_node(root);
+    void *header = get_page(pager, 0);
+    uint32_t free_pages = *header_free_count(header);
+    unpin_page(pager, 0);
+    printf("file: %u pages, %u free\n", pager->num_pages, free_pages);
+
+    if (pager->compressed)
+    {
+        // 空闲槽 (换槽留下的旧槽) 也算进文件大小, 之后的写会重用, .vacuum 能收回
+        uint64_t stored_bytes = PAGE_SIZE;
+        uint64_t used_bytes = compress_data_start();
+        pthread_mutex_lock(&pager->lock);
+        for (uint32_t i = 1; i < pager->num_pages && i < pager->map_chunks * compress_slots_per_chunk(); i++)
+        {
+            PageSlot *slot = &pager->slots[i];
+            if (slot->sector != 0)
+            {
+                stored_bytes += slot->length == 0 ? PAGE_SIZE : slot->length;
+                used_bytes += (uint64_t)slot->capacity * COMPRESS_SECTOR;
+            }
+        }
+        for (uint32_t i = 0; i < pager->map_chunks; i++)
+        {
+            used_bytes += pager->chunk_offsets[i] != 0 ? PAGE_SIZE : 0;
+        }
+        uint64_t file_bytes = pager->file_length;
+        pthread_mutex_unlock(&pager->lock);
+        printf("compressed: %llu bytes stored for %llu bytes of pages (%.2fx), file %llu bytes, %llu reclaimable\n",
+               (unsigned long long)stored_bytes, (unsigned long long)pager->num_pages * PAGE_SIZE,
+               (double)pager->num_pages * PAGE_SIZE / stored_bytes, (unsigned long long)file_bytes,
+               (unsigned long long)(file_bytes > used_bytes ? file_bytes - used_bytes : 0));
+    }
+}
+
+/*
+.vacuum: copy the rows out in key order, forget every page after the
+header and rebuild the tree bottom-up with the loader, so the leaves come
+out packed to the fill factor and in file order. Secondary indexes are
+rebuilt after the table. Files of an older format come out in the current
+one. The rebuild is committed and checkpointed before
+the file is cut to its new length, so a crash leaves the old tree or the
+new one.
+*/
+bool execute_vacuum(Table *table, uint32_t fill_percent)
+{
+    Pager *pager = table->pager;
+    table_commit(table);
+    pager_checkpoint(pager);
+    uint32_t old_pages = pager->num_pages;
+
+    FILE *spill = tmpfile();
+    if (spill == NULL)
+    {
+        printf("ERROR: unable to create a temporary file.\n");
+        return false;
+    }
+    uint64_t rows = 0;
+    uint64_t bytes = 0;
+    Cursor *cursor = table_start(table);
+    while (!cursor->end_of_table)
+    {
+        Row row;
+        row.id = cursor_key(cursor);
+        deserialize_row(cursor_value(cursor), &row);
+        if (fwrite(&row, sizeof(Row), 1, spill) != 1)
+        {
+            printf("ERROR: unable to write temporary file.\n");
+            cursor_close(cursor);
+            fclose(spill);
+            return false;
+        }
+        rows++;
+        bytes += row_value_size(&row) + LEAF_NODE_ENTRY_SIZE;
+        cursor_advance(cursor);
+    }
+    cursor_close(cursor);
+    rewind(spill);
+    if (!pager_map_has_room(pager, 2 + table_pages_for_rows(table, rows, bytes, fill_percent)))
+    {
+        printf("%s\n", execute_result_message(EXECUTE_TABLE_FULL));
+        fclose(spill);
+        return false;
+    }
+
+    // 文件头之后的页全部作废, 根重新放在第 1 页; 旧格式的文件顺便换成带子树行数的布局
+    bool indexed[INDEX_COLUMN_COUNT];
+    void *header = get_page(pager, 0);
+    mark_page_dirty(pager, 0);
+    if (*header_version(header) < HEADER_FORMAT_VERSION)
+    {
+        *header_flags(header) = header_compressed(header) ? HEADER_FLAG_COMPRESSED : 0;
+        *header_version(header) = HEADER_FORMAT_VERSION;
+        layout_init(PAGE_SIZE, true);
+    }
+    *header_root_page(header) = 1;
+    *header_page_count(header) = 2;
+    *header_free_head(header) = 0;
+    *header_free_count(header) = 0;
+    for (uint32_t column = 0; column < INDEX_COLUMN_COUNT; column++)
+    {
+        indexed[column] = table->index_roots[column] != 0;
+        *header_index_root(header, column) = 0;
+        table->index_roots[column] = 0;
+    }
+    unpin_page(pager, 0);
+    pager_discard_from(pager, 1);
+    table->root_page_num = 1;
+    void *root = get_page(pager, table->root_page_num);
+    mark_page_dirty(pager, table->root_page_num);
+    initialize_leaf_node(root);
     set_node_root(root, true);
-    *internal_node_num_keys(root) = 1;
-    *internal_node_child(root, 0) = left_child_page_num;
-    uint32_t left_child_max_key = get_node_max_key(left_child);
-    *internal_node_key(root, 0) = left_child_max_key;
-    *internal_node_right_child(root) = right_child_page_num;
+    unpin_page(pager, table->root_page_num);
 
-    *node_parent(left_child) = table->root_page_num;
-    *node_parent(right_child) = table->root_page_num;
+    BulkLoader loader;
+    bulk_loader_init(&loader, table, fill_percent);
+    Row row;
+    while (fread(&row, sizeof(Row), 1, spill) == 1)
+    {
+        bulk_loader_add(&loader, &row);
+    }
+    bulk_loader_finish(&loader);
+    fclose(spill);
+    for (uint32_t column = 0; column < INDEX_COLUMN_COUNT; column++)
+    {
+        if (indexed[column])
+        {
+            table_build_index(table, column);
+        }
+    }
+
+    table_commit(table);
+    pager_checkpoint(pager);
+    pager_truncate_file(pager);
+    printf("Vacuumed %llu rows: %u pages before, %u after.\n", (unsigned long long)rows, old_pages,
+           pager->num_pages);
+    return true;
 }
 
-void update_internal_node_key(void *node, uint32_t old_key, uint32_t new_key)
+bool run_script(Table *table, int fd);
+
+/*
+.stats prints the counters, .stats reset zeroes them, and .stats dump
+<file> <seconds> appends a timestamped copy to file at most every that
+many seconds (checked after each statement) until .stats dump off.
+*/
+bool execute_stats_command(Table *table, const char *args)
 {
-    uint32_t old_child_index = internal_node_find_child(node, old_key);
-    *internal_node_key(node, old_child_index) = new_key;
+    char filename[PATH_MAX];
+    uint32_t seconds;
+    if (*args == '\0')
+    {
+        print_stats(table, stdout);
+    }
+    else if (strcmp(args, " reset") == 0)
+    {
+        stats_reset(table);
+    }
+    else if (strcmp(args, " dump off") == 0)
+    {
+        if (table->stats_file != NULL)
+        {
+            fclose(table->stats_file);
+            table->stats_file = NULL;
+        }
+    }
+    else if (sscanf(args, " dump %4095s %u", filename, &seconds) == 2 && seconds > 0)
+    {
+        FILE *file = fopen(filename, "a");
+        if (file == NULL)
+        {
+            printf("ERROR: unable to open '%s'.\n", filename);
+            return false;
+        }
+        if (table->stats_file != NULL)
+        {
+            fclose(table->stats_file);
+        }
+        table->stats_file = file;
+        table->stats_interval_ns = (uint64_t)seconds * 1000000000ull;
+        table->stats_last_dump = monotonic_ns();
+    }
+    else
+    {
+        printf("Usage: .stats [reset | dump <file> <seconds> | dump off]\n");
+        return false;
+    }
+    return true;
 }
 
-void internal_node_insert(Table *table, uint32_t parent_page_num,
-                          uint32_t child_page_num)
+MetaCommandResult do_meta_command(InputBuffer *input_buffer, Table *table, bool quiet)
 {
-    /*
-    Add a new child/key pair to parent that corresponds to child
-    */
+    if (strcmp(input_buffer->buffer, ".exit") == 0)
+    {
+        db_close(table);
+        exit(EXIT_SUCCESS);
+    }
+    else if (strcmp(input_buffer->buffer, ".constants") == 0)
+    {
+        printf("Constants:\n");
+        print_constants();
+        return MATE_COMMAND_SUCCESS;
+    }
+    else if (strncmp(input_buffer->buffer, ".import ", 8) == 0)
+    {
+        char filename[PATH_MAX];
+        uint32_t fill_percent = IMPORT_DEFAULT_FILL_PERCENT;
+        int fields = sscanf(input_buffer->buffer + 8, "%4095s %u", filename, &fill_percent);
+        if (fields < 1 || fill_percent == 0 || fill_percent > 100)
+        {
+            printf("Usage: .import <file.csv|file.bin> [fill percent 1-100]\n");
+            return META_COMMAND_FAILED;
+        }
+        if (table->in_batch)
+        {
+            printf("ERROR: .import cannot run inside begin.\n");
+            return META_COMMAND_FAILED;
+        }
+        bool imported = execute_import(table, filename, fill_percent);
+        table_commit(table);
+        return imported ? MATE_COMMAND_SUCCESS : META_COMMAND_FAILED;
+    }
+    else if (strcmp(input_buffer->buffer, ".analyze") == 0)
+    {
+        execute_analyze(table);
+        return MATE_COMMAND_SUCCESS;
+    }
+    else if (strncmp(input_buffer->buffer, ".vacuum", 7) == 0)
+    {
+        uint32_t fill_percent = IMPORT_DEFAULT_FILL_PERCENT;
+        const char *args = input_buffer->buffer + 7;
+        if ((*args != '\0' && sscanf(args, " %u", &fill_percent) != 1) || fill_percent == 0 ||
+            fill_percent > 100)
+        {
+            printf("Usage: .vacuum [fill percent 1-100]\n");
+            return META_COMMAND_FAILED;
+        }
+        if (table->in_batch)
+        {
+            printf("ERROR: .vacuum cannot run inside begin.\n");
+            return META_COMMAND_FAILED;
+        }
+        if (table->snapshot != NULL)
+        {
+            printf("ERROR: .vacuum cannot run while a snapshot is open.\n");
+            return META_COMMAND_FAILED;
+        }
+        return execute_vacuum(table, fill_percent) ? MATE_COMMAND_SUCCESS : META_COMMAND_FAILED;
+    }
+    else if (strncmp(input_buffer->buffer, ".sync", 5) == 0)
+    {
+        const char *mode = input_buffer->buffer + 5;
+        Pager *pager = table->pager;
+        MetaCommandResult result = MATE_COMMAND_SUCCESS;
+        pthread_mutex_lock(&pager->lock);
+        if (strcmp(mode, " off") == 0)
+        {
+            pager->sync_mode = SYNC_OFF;
+        }
+        else if (strcmp(mode, " normal") == 0)
+        {
+            pager->sync_mode = SYNC_NORMAL;
+        }
+        else if (strcmp(mode, " full") == 0)
+        {
+            pager->sync_mode = SYNC_FULL;
+        }
+        else
+        {
+            printf("Usage: .sync off|normal|full\n");
+            result = META_COMMAND_FAILED;
+        }
+        pthread_mutex_unlock(&pager->lock);
+        return result;
+    }
+    else if (strncmp(input_buffer->buffer, ".read ", 6) == 0)
+    {
+        int fd = open(input_buffer->buffer + 6, O_RDONLY);
+        if (fd == -1)
+        {
+            printf("ERROR: unable to open '%s'.\n", input_buffer->buffer + 6);
+            return META_COMMAND_FAILED;
+        }
+        bool succeeded = run_script(table, fd);
+        close(fd);
+        return succeeded ? MATE_COMMAND_SUCCESS : META_COMMAND_FAILED;
+    }
+    else if (strncmp(input_buffer->buffer, ".prepare ", 9) == 0)
+    {
+        return execute_prepare_command(table, input_buffer->buffer + 9) ? MATE_COMMAND_SUCCESS
+                                                                         : META_COMMAND_FAILED;
+    }
+    else if (strncmp(input_buffer->buffer, ".exec ", 6) == 0)
+    {
+        return execute_exec_command(table, input_buffer->buffer + 6, quiet) ? MATE_COMMAND_SUCCESS
+                                                                            : META_COMMAND_FAILED;
+    }
+    else if (strncmp(input_buffer->buffer, ".stats", 6) == 0)
+    {
+        return execute_stats_command(table, input_buffer->buffer + 6) ? MATE_COMMAND_SUCCESS
+                                                                       : META_COMMAND_FAILED;
+    }
+    else if (strcmp(input_buffer->buffer, ".snapshot") == 0)
+    {
+        if (table->snapshot != NULL)
+        {
+            printf("ERROR: A snapshot is already open.\n");
+            return META_COMMAND_FAILED;
+        }
+        table->snapshot = db_snapshot_begin(table, PAGER_MIN_CACHE_PAGES);
+        if (table->snapshot == NULL)
+        {
+            printf("ERROR: Snapshots need the write-ahead log.\n");
+            return META_COMMAND_FAILED;
+        }
+        return MATE_COMMAND_SUCCESS;
+    }
+    else if (strcmp(input_buffer->buffer, ".snapshot end") == 0)
+    {
+        if (table->snapshot != NULL)
+        {
+            db_snapshot_end(table->snapshot);
+            table->snapshot = NULL;
+        }
+        return MATE_COMMAND_SUCCESS;
+    }
+    else if (strcmp(input_buffer->buffer, ".checkpoint") == 0)
+    {
+        if (table->snapshot != NULL)
+        {
+            // 检查点要等快照结束, 自己的快照会让它一直等下去
+            printf("ERROR: .checkpoint cannot run while a snapshot is open.\n");
+            return META_COMMAND_FAILED;
+        }
+        table_commit(table);
+        pager_checkpoint(table->pager);
+        return MATE_COMMAND_SUCCESS;
+    }
+    else if (strncmp(input_buffer->buffer, ".parallel", 9) == 0)
+    {
+        uint32_t threads;
+        char order[16] = "ordered";
+        int fields = sscanf(input_buffer->buffer + 9, "%u %15s", &threads, order);
+        bool unordered = strcmp(order, "unordered") == 0;
+        if (fields < 1 || threads == 0 || threads > SCAN_MAX_THREADS ||
+            (!unordered && strcmp(order, "ordered") != 0))
+        {
+            printf("Usage: .parallel <threads 1-%d> [ordered|unordered]\n", SCAN_MAX_THREADS);
+            return META_COMMAND_FAILED;
+        }
+        table->scan_threads = threads;
+        table->scan_unordered = unordered;
+        return MATE_COMMAND_SUCCESS;
+    }
+    else if (strncmp(input_buffer->buffer, ".mode", 5) == 0)
+    {
+        const char *mode = input_buffer->buffer + 5;
+        if (strcmp(mode, " tuple") == 0)
+        {
+            table->output.mode = OUTPUT_TUPLE;
+        }
+        else if (strcmp(mode, " csv") == 0)
+        {
+            table->output.mode = OUTPUT_CSV;
+        }
+        else if (strcmp(mode, " binary") == 0)
+        {
+            table->output.mode = OUTPUT_BINARY;
+        }
+        else
+        {
+            printf("Usage: .mode tuple|csv|binary\n");
+            return META_COMMAND_FAILED;
+        }
+        return MATE_COMMAND_SUCCESS;
+    }
+    else
+    {
+        return META_COMMAND_UNRECOGNIZED_COMMAND;
+    }
+}
 
-    void *parent = get_page(table->pager, parent_page_num);
-    void *child = get_page(table->pager, child_page_num);
-    uint32_t child_max_key = get_node_max_key(child);
-    uint32_t index = internal_node_find_child(parent, child_max_key);
+// 执行一行输入 (meta 命令或语句), 出错时返回 false
+bool run_line(Table *table, InputBuffer *input_buffer, bool quiet)
+{
+    if (strncmp(".", input_buffer->buffer, 1) == 0)
+    {
+        MetaCommandResult result = do_meta_command(input_buffer, table, quiet);
+        if (result == META_COMMAND_UNRECOGNIZED_COMMAND)
+        {
+            printf("Unrecognized command '%s'\n", input_buffer->buffer);
+        }
+        return result == MATE_COMMAND_SUCCESS;
+    }
 
-    uint32_t original_num_keys = *internal_node_num_keys(parent);
-    *internal_node_num_keys(parent) = original_num_keys + 1;
+    // 解析输入为 Statement 结构体; 字面量直接指向输入缓冲区
+    Statement statement;
+    PrepareResult prepared = prepare_statement(input_buffer->buffer, &statement);
+    if (prepared != PREPARE_SUCCESS)
+    {
+        print_prepare_result(prepared, input_buffer->buffer);
+        return false;
+    }
+    // .snapshot 打开着时 select 读快照, 其他语句照常写表
+    Table *target = table->snapshot != NULL && statement.type == STATEMEND_SELECT ? table->snapshot : table;
+    ExecuteResult result = db_step(&statement, target);
+    print_execute_result(result, quiet);
+    statement_free(&statement);
+    return result == EXECUTE_SUCCESS;
+}
 
-    if (original_num_keys >= INTERNAL_NODE_MAX_CELLS)
+/*
+batch mode (-b, .read): the input is read in large chunks and split into
+lines in place, without prompts or per-statement acknowledgements; only
+errors and a summary at the end are printed. .exit ends the script.
+Returns false if a line failed.
+*/
+bool run_script(Table *table, int fd)
+{
+    size_t capacity = SCRIPT_CHUNK_SIZE;
+    char *buffer = malloc(capacity + 1);
+    size_t start = 0;
+    size_t end = 0;
+    bool eof = false;
+    uint64_t statements = 0;
+    uint64_t failed = 0;
+    struct timespec began;
+    clock_gettime(CLOCK_MONOTONIC, &began);
+
+    while (true)
     {
-        printf("Need to implement splitting internal node\n");
-        exit(EXIT_FAILURE);
+        char *newline = memchr(buffer + start, '\n', end - start);
+        if (newline == NULL && !eof)
+        {
+            // 剩下的半行挪到开头, 一行比缓冲区还长时把缓冲区加倍
+            memmove(buffer, buffer + start, end - start);
+            end -= start;
+            start = 0;
+            if (end == capacity)
+            {
+                capacity *= 2;
+                buffer = realloc(buffer, capacity + 1);
+            }
+            ssize_t bytes_read = read(fd, buffer + end, capacity - end);
+            if (bytes_read < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (bytes_read <= 0)
+            {
+                eof = true;
+            }
+            else
+            {
+                end += bytes_read;
+            }
+            continue;
+        }
+        if (newline == NULL && start == end)
+        {
+            break;
+        }
+
+        size_t line_end = newline != NULL ? (size_t)(newline - buffer) : end;
+        size_t length = line_end - start;
+        if (length > 0 && buffer[start + length - 1] == '\r')
+        {
+            length--;
+        }
+        buffer[start + length] = '\0';
+        InputBuffer line = {.buffer = buffer + start, .buffer_length = length + 1, .input_length = length};
+        start = newline != NULL ? line_end + 1 : end;
+        if (length == 0)
+        {
+            continue;
+        }
+        if (strcmp(line.buffer, ".exit") == 0)
+        {
+            break;
+        }
+        statements++;
+        if (!run_line(table, &line, true))
+        {
+            failed++;
+        }
     }
+    free(buffer);
+
+    struct timespec finished;
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    double seconds = (finished.tv_sec - began.tv_sec) + (finished.tv_nsec - began.tv_nsec) / 1e9;
+    printf("Ran %llu statements (%llu failed) in %.3f s.\n", (unsigned long long)statements,
+           (unsigned long long)failed, seconds);
+    return failed == 0;
+}
+
+/*
+server mode (--serve <socket>): one process keeps the table and its page
+cache open and answers clients on a Unix domain socket, so a query costs a
+round trip instead of a process start and cold reads. A single thread runs
+an epoll loop over the listening socket and the connections; statements are
+executed one at a time, like in the shell.
+
+A request is one line in the shell's statement grammar. Clients may send
+many requests without waiting (pipelining); every non-empty line gets
+exactly one reply, in order:
+
+    u32 payload length (host byte order) | u8 status | payload
+
+Status 0 carries the rows of a select in the table's output mode (empty for
+other statements), status 1 and 2 a prepare or execute error message. Notes
+the executor prints in the shell, like the count of skipped duplicate keys,
+come first in the payload. .stats is the only meta command. begin makes the
+connection the owner of the batch; the other connections' requests wait
+until it commits or disconnects. A disconnect without commit rolls the batch
+back; only without a log, where that is not possible, are its rows committed.
+*/
+#define SERVE_MAX_EVENTS 64
+#define SERVE_READ_SIZE 65536
+#define SERVE_MAX_PENDING (1 << 20) // 收到未处理的请求或未发出的回复超过这么多时先不读
+#define SERVE_REPLY_HEADER_SIZE 5
+
+typedef enum
+{
+    REPLY_OK,
+    REPLY_PREPARE_ERROR,
+    REPLY_EXECUTE_ERROR
+} ReplyStatus;
 
-    uint32_t right_child_page_num = *internal_node_right_child(parent);
-    void *right_child = get_page(table->pager, right_child_page_num);
+typedef struct ServeClient
+{
+    int fd;
+    uint32_t events; // 当前在 epoll 里注册的事件, 0 表示没有注册
+    bool closing;    // 对方已经关了写端, 回复发完就关闭
+    char *in;        // [in_start, in_length) 是还没处理的请求
+    size_t in_start;
+    size_t in_length;
+    size_t in_capacity;
+    char *out; // [out_start, out_length) 是还没发出去的回复
+    size_t out_start;
+    size_t out_length;
+    size_t out_capacity;
+    struct ServeClient *prev;
+    struct ServeClient *next;
+} ServeClient;
 
-    if (child_max_key > get_node_max_key(right_child))
+typedef struct
+{
+    Table *table;
+    int epoll_fd;
+    int listen_fd;
+    ServeClient *clients;
+    ServeClient *batch_owner; // 正在 begin 里的连接
+    bool batch_released;      // 批结束了, 等着的连接可以继续
+    FILE *messages;           // table->messages 指向它, 每条请求的提示收集在 message_text 里
+    char *message_text;
+    size_t message_length;
+} Server;
+
+static int serve_stop_pipe[2] = {-1, -1};
+
+// SIGINT/SIGTERM 可能落在任何线程上, 用管道叫醒事件循环
+static void serve_handle_signal(int signal_number)
+{
+    (void)signal_number;
+    int saved_errno = errno;
+    if (write(serve_stop_pipe[1], "x", 1) == -1)
     {
-        /* Replace right child */
-        *internal_node_child(parent, original_num_keys) = right_child_page_num;
-        *internal_node_key(parent, original_num_keys) =
-            get_node_max_key(right_child);
-        *internal_node_right_child(parent) = child_page_num;
+        // 管道满了说明已经在退出
     }
-    else
+    errno = saved_errno;
+}
+
+void serve_reply(ServeClient *client, ReplyStatus status, const char *payload, size_t length)
+{
+    size_t needed = client->out_length + SERVE_REPLY_HEADER_SIZE + length;
+    if (needed > client->out_capacity)
     {
-        /* Make room for the new cell */
-        for (uint32_t i = original_num_keys; i > index; i--)
+        // 前面已经发出去的部分先挪走, 还不够再扩容
+        memmove(client->out, client->out + client->out_start, client->out_length - client->out_start);
+        client->out_length -= client->out_start;
+        client->out_start = 0;
+        needed = client->out_length + SERVE_REPLY_HEADER_SIZE + length;
+        while (needed > client->out_capacity)
         {
-            void *destination = internal_node_cell(parent, i);
-            void *source = internal_node_cell(parent, i - 1);
-            memcpy(destination, source, INTERNAL_NODE_CELL_SIZE);
+            client->out_capacity *= 2;
         }
-        *internal_node_child(parent, index) = child_page_num;
-        *internal_node_key(parent, index) = child_max_key;
+        client->out = realloc(client->out, client->out_capacity);
     }
+    uint32_t header_length = length;
+    char *header = client->out + client->out_length;
+    memcpy(header, &header_length, sizeof(uint32_t));
+    header[sizeof(uint32_t)] = status;
+    memcpy(header + SERVE_REPLY_HEADER_SIZE, payload, length);
+    client->out_length = needed;
 }
 
-void leaf_node_split_and_insert(Cursor *cursor, uint32_t key, Row *value)
+void serve_reply_message(ServeClient *client, ReplyStatus status, const char *message)
 {
-    void *old_node = get_page(cursor->table->pager, cursor->page_num);
-    uint32_t old_max = get_node_max_key(old_node);
-    uint32_t new_page_num = get_unused_page_num(cursor->table->pager);
-    void *new_node = get_page(cursor->table->pager, new_page_num);
-    initialize_leaf_node(new_node);
+    serve_reply(client, status, message, strlen(message));
+}
 
-    *node_parent(new_node) = *node_parent(old_node);
-    *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
-    *leaf_node_next_leaf(old_node);
+const char *prepare_result_message(PrepareResult result)
+{
+    switch (result)
+    {
+    case (PREPARE_STRING_TOO_LONG):
+        return "ERROR: String is too long.";
+    case (PREPARE_UNRECOGNIZED_STATEMENT):
+        return "ERROR: Unrecognized statement.";
+    default:
+        return "ERROR: Syntax error.";
+    }
+}
 
-    for (int32_t i = LEAF_NODE_MAX_CELLS; i >= 0; i--)
+// 执行一条请求, 回复追加到 client->out
+void serve_request(Server *server, ServeClient *client, char *line)
+{
+    Table *table = server->table;
+    if (line[0] == '.')
     {
-        void *destination_node;
-        if (i > LEAF_NODE_LEFT_SPLIT_COUNT)
-        { // 右半部分使用新的节点
-            destination_node = new_node;
-        }
-        else
-        {
-            destination_node = old_node;
-        }
-        uint32_t index_withindex_node = i % LEAF_NODE_LEFT_SPLIT_COUNT;
-        void *destination = leaf_node_cell(destination_node, index_withindex_node);
-        if (i == cursor->cell_num)
+        if (strcmp(line, ".stats") != 0)
         {
-            serialize_row(value, leaf_node_value(destination, index_withindex_node));
-            *leaf_node_key(destination_node, index_withindex_node) = key;
+            serve_reply_message(client, REPLY_PREPARE_ERROR, "ERROR: Unrecognized command.");
+            return;
         }
-        else if (i > cursor->cell_num)
+        char *text;
+        size_t length;
+        FILE *out = open_memstream(&text, &length);
+        print_stats(table, out);
+        fclose(out);
+        serve_reply(client, REPLY_OK, text, length);
+        free(text);
+        return;
+    }
+
+    Statement statement;
+    PrepareResult prepared = prepare_statement(line, &statement);
+    if (prepared != PREPARE_SUCCESS)
+    {
+        serve_reply_message(client, REPLY_PREPARE_ERROR, prepare_result_message(prepared));
+        return;
+    }
+    table->output.length = 0;
+    rewind(server->messages);
+    ExecuteResult result = db_step(&statement, table);
+    fflush(server->messages);
+    if (result != EXECUTE_SUCCESS)
+    {
+        fprintf(server->messages, "%s", execute_result_message(result));
+        fflush(server->messages);
+        serve_reply(client, REPLY_EXECUTE_ERROR, server->message_text, server->message_length);
+    }
+    else
+    {
+        if (server->message_length > 0)
         {
-            memcpy(destination, leaf_node_cell(old_node, i - 1), LEAF_NODE_CELL_SIZE);
+            // 有提示时和结果行拼在一起, 提示在前
+            fwrite(table->output.buffer, 1, table->output.length, server->messages);
+            fflush(server->messages);
+            serve_reply(client, REPLY_OK, server->message_text, server->message_length);
         }
         else
         {
-            memcpy(destination, leaf_node_cell(old_node, i), LEAF_NODE_CELL_SIZE);
+            serve_reply(client, REPLY_OK, table->output.buffer, table->output.length);
         }
     }
-
-    *(leaf_node_num_cells(old_node)) = LEAF_NODE_LEFT_SPLIT_COUNT;
-    *(leaf_node_num_cells(new_node)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
-
-    if (is_node_root(old_node))
+    // commit 报重复 key 时批也已经结束了, 按 in_batch 判断而不是按结果
+    if (table->in_batch)
     {
-        return create_new_root(cursor->table, new_page_num);
+        server->batch_owner = client;
     }
-    else
+    else if (server->batch_owner == client)
     {
-        uint32_t parent_page_num = *node_parent(old_node);
-        uint32_t new_max = get_node_max_key(new_node);
-        void *parent = get_page(cursor->table->pager, parent_page_num);
-
-        update_internal_node_key(parent, old_max, new_max);
-        internal_node_insert(cursor->table, parent_page_num, new_page_num);
-        return;
+        server->batch_owner = NULL;
+        server->batch_released = true;
     }
+    table->output.length = 0;
+    statement_free(&statement);
 }
 
-void leaf_node_insert(Cursor *cursor, uint32_t key, Row *value)
+/*
+runs the complete request lines in client->in until the input is used up,
+the pending replies reach SERVE_MAX_PENDING or another connection holds the
+batch. Returns false when a line without newline has outgrown the limit.
+*/
+bool serve_process(Server *server, ServeClient *client)
 {
-    void *node = get_page(cursor->table->pager, cursor->page_num);
-    uint32_t num_cells = *leaf_node_num_cells(node);
-    if (num_cells >= LEAF_NODE_MAX_CELLS)
+    while (client->out_length - client->out_start < SERVE_MAX_PENDING &&
+           (server->batch_owner == NULL || server->batch_owner == client))
     {
-        leaf_node_split_and_insert(cursor, key, value);
-        return;
+        char *start = client->in + client->in_start;
+        char *newline = memchr(start, '\n', client->in_length - client->in_start);
+        if (newline == NULL)
+        {
+            break;
+        }
+        client->in_start = newline + 1 - client->in;
+        if (newline > start && newline[-1] == '\r')
+        {
+            newline--;
+        }
+        *newline = '\0';
+        if (newline > start)
+        {
+            serve_request(server, client, start);
+        }
     }
 
-    if (cursor->cell_num < num_cells)
+    // 剩下的半行挪到开头
+    size_t remaining = client->in_length - client->in_start;
+    memmove(client->in, client->in + client->in_start, remaining);
+    client->in_start = 0;
+    client->in_length = remaining;
+    return remaining < SERVE_MAX_PENDING || memchr(client->in, '\n', remaining) != NULL;
+}
+
+// 尽量把回复发出去, 连接断了返回 false
+bool serve_flush(ServeClient *client)
+{
+    while (client->out_start < client->out_length)
     {
-        // Make room for new cell
-        for (uint32_t i = num_cells; i > cursor->cell_num; i--)
+        ssize_t sent = send(client->fd, client->out + client->out_start, client->out_length - client->out_start,
+                            MSG_NOSIGNAL);
+        if (sent == -1)
         {
-            memcpy(leaf_node_cell(node, i), leaf_node_cell(node, i - 1),
-                   LEAF_NODE_CELL_SIZE);
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
         }
+        client->out_start += sent;
     }
-
-    *(leaf_node_num_cells(node)) += 1;
-    *(leaf_node_key(node, cursor->cell_num)) = key;
-    serialize_row(value, leaf_node_value(node, cursor->cell_num));
+    client->out_start = 0;
+    client->out_length = 0;
+    return true;
 }
 
-PrepareResult prepare_statement(InputBuffer *input_buffer, Statement *statement)
+// 回复积压或者在等别人的批时不再读, 有回复没发完时等可写
+void serve_update_events(Server *server, ServeClient *client)
 {
-    if (strncmp(input_buffer->buffer, "insert", 6) == 0)
+    uint32_t events = 0;
+    if (!client->closing && client->in_length < SERVE_MAX_PENDING &&
+        client->out_length - client->out_start < SERVE_MAX_PENDING)
     {
-        return prepare_insert(input_buffer, statement);
+        events |= EPOLLIN;
     }
-    if (strcmp(input_buffer->buffer, "select") == 0)
+    if (client->out_start < client->out_length)
     {
-        statement->type = STATEMEND_SELECT;
-        return PREPARE_SUCCESS;
+        events |= EPOLLOUT;
+    }
+    if (events == client->events)
+    {
+        return;
     }
-    return PREPARE_UNRECOGNIZED_STATEMENT;
+    // 没有要等的事件时整个拿掉, 否则对方挂断后 EPOLLHUP 会一直报
+    struct epoll_event event = {.events = events, .data.ptr = client};
+    int operation = events == 0 ? EPOLL_CTL_DEL : client->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    epoll_ctl(server->epoll_fd, operation, client->fd, &event);
+    client->events = events;
 }
 
-Cursor *leaf_node_find(Table *table, uint32_t page_num, uint32_t key)
+void serve_close(Server *server, ServeClient *client)
 {
-    void *node = get_page(table->pager, page_num);
-    uint32_t num_cells = *leaf_node_num_cells(node);
-
-    Cursor *cursor = malloc(sizeof(Cursor));
-    cursor->table = table;
-    cursor->page_num = page_num;
-
-    // 二分查找
-    uint32_t min_index = 0;
-    uint32_t one_past_max_index = num_cells;
-    while (one_past_max_index != min_index)
+    if (server->batch_owner == client)
     {
-        uint32_t index = (min_index + one_past_max_index) / 2;
-        uint32_t key_at_index = *leaf_node_key(node, index);
-        if (key == key_at_index)
+        // 断开的连接没说 commit, 批里的修改不算数; 没有日志时回滚不了, 只能提交并说一声
+        if (!table_rollback(server->table))
         {
-            cursor->cell_num = index;
-            return cursor;
+            execute_commit(server->table);
+            printf("Connection closed inside begin; committed its rows, there is no log to roll back.\n");
+            fflush(stdout);
         }
-        if (key < key_at_index)
+        server->batch_owner = NULL;
+        server->batch_released = true;
+    }
+    close(client->fd);
+    if (client->prev != NULL)
+    {
+        client->prev->next = client->next;
+    }
+    else
+    {
+        server->clients = client->next;
+    }
+    if (client->next != NULL)
+    {
+        client->next->prev = client->prev;
+    }
+    free(client->in);
+    free(client->out);
+    free(client);
+}
+
+// 处理能处理的请求并发出回复; 连接被关掉时返回 false
+bool serve_run_client(Server *server, ServeClient *client)
+{
+    while (true)
+    {
+        if (!serve_process(server, client) || !serve_flush(client))
         {
-            one_past_max_index = index;
+            serve_close(server, client);
+            return false;
         }
-        else
+        // 因为回复积压停下的, 发完了就接着处理
+        bool more = client->out_length == 0 && memchr(client->in, '\n', client->in_length) != NULL &&
+                    (server->batch_owner == NULL || server->batch_owner == client);
+        if (!more)
         {
-            min_index = index + 1;
+            break;
         }
     }
-    cursor->cell_num = min_index;
-    return cursor;
-}
-
-Cursor *internal_node_find(Table *table, uint32_t page_num, uint32_t key)
-{
-    void *node = get_page(table->pager, page_num);
-    uint32_t child_index = internal_node_find_child(node, key);
-    uint32_t child_num = *internal_node_child(node, child_index);
-    void *child = get_page(table->pager, child_num);
-    switch (get_node_type(child))
+    if (client->closing && client->in_length == 0 && client->out_length == 0)
     {
-    case NODE_LEAF:
-        return leaf_node_find(table, child_num, key);
-
-    case NODE_INTERNAL:
-        return internal_node_find(table, child_num, key);
+        serve_close(server, client);
+        return false;
     }
+    serve_update_events(server, client);
+    return true;
 }
 
-Cursor *table_find(Table *table, uint32_t key)
+void serve_read(Server *server, ServeClient *client)
 {
-    uint32_t root_page_num = table->root_page_num;
-    void *root_node = get_page(table->pager, root_page_num);
-
-    if (get_node_type(root_node) == NODE_LEAF)
+    if (client->in_capacity - client->in_length < SERVE_READ_SIZE)
     {
-        return leaf_node_find(table, root_page_num, key);
+        client->in_capacity = client->in_length + SERVE_READ_SIZE;
+        client->in = realloc(client->in, client->in_capacity + 1);
+    }
+    ssize_t bytes_read = read(client->fd, client->in + client->in_length, SERVE_READ_SIZE);
+    if (bytes_read == -1 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        return;
+    }
+    if (bytes_read <= 0)
+    {
+        // 最后一行可以没有换行
+        if (client->in_length > 0 && client->in[client->in_length - 1] != '\n')
+        {
+            client->in[client->in_length++] = '\n';
+        }
+        client->closing = true;
     }
     else
     {
-        // printf("Need to implement searching in internal nodes");
-        // exit(EXIT_FAILURE);
-        return internal_node_find(table, root_page_num, key);
+        client->in_length += bytes_read;
     }
+    serve_run_client(server, client);
 }
 
-Cursor *table_start(Table *table)
-{
-    Cursor *cursor = table_find(table, 0);
-    // cursor->table = table;
-    // // cursor->row_num = 0;
-    // cursor->page_num = table->root_page_num;
-    // cursor->cell_num = 0;
-
-    void *root_node = get_page(table->pager, table->root_page_num);
-    uint32_t num_cells = *leaf_node_num_cells(root_node);
-    cursor->end_of_table = (num_cells == 0);
-    return cursor;
-}
-
-ExecuteResult execute_insert(Statement *statement, Table *table)
+void serve_accept(Server *server)
 {
-    void *node = get_page(table->pager, table->root_page_num);
-    uint32_t num_cells = (*leaf_node_num_cells(node));
-
-    Row *row_to_insert = &(statement->row_to_insert);
-    uint32_t key_to_insert = row_to_insert->id;
-    Cursor *cursor = table_find(table, key_to_insert);
-
-    if (cursor->cell_num < num_cells)
+    while (true)
     {
-        uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
-        if (key_at_index == key_to_insert)
+        int fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            // EAGAIN: 都接完了; 文件描述符不够之类的留到下次
+            return;
+        }
+        ServeClient *client = calloc(1, sizeof(ServeClient));
+        client->fd = fd;
+        client->events = EPOLLIN;
+        client->in_capacity = SERVE_READ_SIZE;
+        client->in = malloc(client->in_capacity + 1);
+        client->out_capacity = RESULT_BUFFER_SIZE;
+        client->out = malloc(client->out_capacity);
+        client->next = server->clients;
+        if (server->clients != NULL)
         {
-            return EXECUTE_DUPLICATE_KEY;
+            server->clients->prev = client;
         }
+        server->clients = client;
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = client};
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event);
     }
-
-    leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
-    free(cursor);
-    return EXECUTE_SUCCESS;
 }
 
-ExecuteResult execute_select(Statement *statement, Table *table)
+// 阻塞到 SIGINT/SIGTERM; 返回前关掉所有连接 (未提交的批会回滚)
+void serve(Table *table, const char *path)
 {
-    Cursor *cursor = table_start(table);
-    Row row;
-    while (!(cursor->end_of_table))
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path))
     {
-        deserialize_row(cursor_value(cursor), &row);
-        print_row(&row);
-        cursor_advance(cursor);
+        printf("Socket path is too long.\n");
+        exit(EXIT_FAILURE);
     }
-    free(cursor);
-    return EXECUTE_SUCCESS;
-}
-
-ExecuteResult execute_statement(Statement *statement, Table *table)
-{
-    switch (statement->type)
+    strcpy(address.sun_path, path);
+    // 上次没清理掉的 socket 文件可以直接替换, 其它文件不动
+    struct stat path_stat;
+    if (lstat(path, &path_stat) == 0 && S_ISSOCK(path_stat.st_mode))
     {
-    case (STATEMENT_INSERT):
-        //        printf("This is where we would do an insert .\n");
-        //      break;
-        return execute_insert(statement, table);
+        unlink(path);
+    }
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1 || bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) == -1 ||
+        listen(listen_fd, SOMAXCONN) == -1)
+    {
+        printf("Unable to listen on %s: %d\n", path, errno);
+        exit(EXIT_FAILURE);
+    }
+    if (pipe2(serve_stop_pipe, O_NONBLOCK | O_CLOEXEC) == -1)
+    {
+        printf("Unable to create pipe: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    struct sigaction action = {.sa_handler = serve_handle_signal};
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    Server server = {.table = table, .listen_fd = listen_fd};
+    server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = &server.listen_fd};
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+    event.data.ptr = &serve_stop_pipe[0];
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, serve_stop_pipe[0], &event);
+
+    // select 的结果和执行器的提示都先写进内存, 再作为回复的内容
+    result_writer_flush(&table->output);
+    table->output.fd = -1;
+    server.messages = open_memstream(&server.message_text, &server.message_length);
+    table->messages = server.messages;
+    printf("Serving on %s\n", path);
+    fflush(stdout);
+
+    struct epoll_event events[SERVE_MAX_EVENTS];
+    bool stopping = false;
+    while (!stopping)
+    {
+        int count = epoll_wait(server.epoll_fd, events, SERVE_MAX_EVENTS, -1);
+        if (count == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            printf("Error waiting for events: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < count; i++)
+        {
+            void *source = events[i].data.ptr;
+            if (source == &server.listen_fd)
+            {
+                serve_accept(&server);
+                continue;
+            }
+            if (source == &serve_stop_pipe[0])
+            {
+                stopping = true;
+                continue;
+            }
+            ServeClient *client = source;
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            {
+                // 读出错或到结尾时 serve_read 会处理剩下的请求并关闭连接
+                serve_read(&server, client);
+            }
+            else if (events[i].events & EPOLLOUT)
+            {
+                serve_run_client(&server, client);
+            }
+        }
+        // 批结束以后, 等着的连接继续处理攒下的请求
+        while (server.batch_released)
+        {
+            server.batch_released = false;
+            ServeClient *client = server.clients;
+            while (client != NULL)
+            {
+                ServeClient *next = client->next;
+                if (client->in_length > 0)
+                {
+                    serve_run_client(&server, client);
+                }
+                client = next;
+            }
+        }
+    }
 
-    case (STATEMEND_SELECT):
-        //        printf("This is where we would do a select .\n");
-        //        break;
-        return execute_select(statement, table);
+    while (server.clients != NULL)
+    {
+        serve_close(&server, server.clients);
     }
+    table->messages = stdout;
+    fclose(server.messages);
+    free(server.message_text);
+    close(server.epoll_fd);
+    close(listen_fd);
+    unlink(path);
+    close(serve_stop_pipe[0]);
+    close(serve_stop_pipe[1]);
+    table->output.fd = STDOUT_FILENO;
 }
 
+#ifndef SIMPLE_SQLITE_NO_MAIN
 int main(int argc, char *argv[])
 {
     if (argc < 2)
     {
         printf("Must supply a database filenname\n");
+        printf("Usage: %s <db file> [--cache-pages N] [--mmap (no log)] [--bg-writer] [--no-wal]\n"
+               "          [--page-size 4k-64k] [--prefetch N] [--compress] [-b | --serve <socket>]\n",
+               argv[0]);
         exit(EXIT_FAILURE);
     }
 
     char *filename = argv[1];
-    Table *table = db_open(filename);
-
-    InputBuffer *input_buffer = new_input_buffer();
-    while (true)
+    bool batch = false;
+    const char *serve_path = NULL;
+    DbOptions options = {.cache_pages = PAGER_DEFAULT_CACHE_PAGES,
+                         .use_mmap = false,
+                         .background_writer = false,
+                         .use_wal = true,
+                         .page_size = PAGE_SIZE_DEFAULT,
+                         .prefetch_pages = PAGER_PREFETCH_DEFAULT_WINDOW,
+                         .compress = false};
+    for (int i = 2; i < argc; i++)
     {
-        print_prompt();
-        read_input(input_buffer);
-
-        if (strncmp(".", input_buffer->buffer, 1) == 0)
+        if (strcmp(argv[i], "--cache-pages") == 0 && i + 1 < argc)
         {
-            switch (do_meta_command(input_buffer, table))
+            // 只收正的十进制数; strtoul 会把 "-5" 转成一个很大的数, 负号要自己拦
+            const char *value = argv[++i];
+            char *end;
+            errno = 0;
+            unsigned long pages = strtoul(value, &end, 10);
+            if (*value < '0' || *value > '9' || *end != '\0' || errno == ERANGE || pages == 0 ||
+                pages > PAGER_MAX_CACHE_PAGES)
             {
-            case (MATE_COMMAND_SUCCESS):
-                continue;
-
-            case (META_COMMAND_UNRECOGNIZED_COMMAND):
-                printf("Unrecognized command '%s'\n", input_buffer->buffer);
-                continue;
+                printf("Cache pages must be a number from 1 to %u.\n", PAGER_MAX_CACHE_PAGES);
+                exit(EXIT_FAILURE);
             }
+            options.cache_pages = pages;
         }
-
-        Statement statement;
-        switch (prepare_statement(input_buffer, &statement)) // 解析输入的参数为Statement结构体
+        else if (strcmp(argv[i], "--mmap") == 0)
         {
-        case (PREPARE_SUCCESS):
-            /* code */
-            break;
-
-        case (PREPARE_STRING_TOO_LONG):
-            printf("strint is too long\n");
-            continue;
-
-        case (PREPARE_SYNTAX_ERROR):
-            printf("Unrecogniezed keyword at start of '%s'.\n", input_buffer->buffer);
-            continue;
-
-        case (PREPARE_UNRECOGNIZED_STATEMENT):
-            printf("unrecongnized keyword at start of '%s'.\n  ", input_buffer->buffer);
-            continue;
+            options.use_mmap = true;
+        }
+        else if (strcmp(argv[i], "--bg-writer") == 0)
+        {
+            options.background_writer = true;
+        }
+        else if (strcmp(argv[i], "--no-wal") == 0)
+        {
+            options.use_wal = false;
         }
+        else if (strcmp(argv[i], "--page-size") == 0 && i + 1 < argc)
+        {
+            // 字节数, 或者带 k 的 KB 数; 后面不能再有别的字符
+            const char *value = argv[++i];
+            char *end;
+            errno = 0;
+            unsigned long size = strtoul(value, &end, 10);
+            if (*end == 'k' || *end == 'K')
+            {
+                size = size > ULONG_MAX / 1024 ? 0 : size * 1024;
+                end++;
+            }
+            if (*value < '0' || *value > '9' || *end != '\0' || errno == ERANGE || size > UINT32_MAX ||
+                !page_size_supported(size))
+            {
+                printf("Page size must be 4k, 8k, 16k, 32k or 64k.\n");
+                exit(EXIT_FAILURE);
+            }
+            options.page_size = size;
+        }
+        else if (strcmp(argv[i], "--prefetch") == 0 && i + 1 < argc)
+        {
+            // 扫描提前读的叶子数, 0 关掉预读
+            options.prefetch_pages = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--compress") == 0)
+        {
+            // 只对新建的文件有效, 已有的文件按它自己的格式打开
+            options.compress = true;
+        }
+        else if (strcmp(argv[i], "-b") == 0)
+        {
+            batch = true;
+        }
+        else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc)
+        {
+            serve_path = argv[++i];
+        }
+        else
+        {
+            printf("Unrecognized option '%s'\n", argv[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    Table *table = db_open(filename, &options);
+    if (serve_path != NULL)
+    {
+        serve(table, serve_path);
+        db_close(table);
+        return EXIT_SUCCESS;
+    }
 
-        switch (execute_statement(&statement, table))
+    InputBuffer *input_buffer = new_input_buffer();
+    if (batch)
+    {
+        run_script(table, STDIN_FILENO);
+        db_close(table);
+        close_input_buffer(input_buffer);
+        return EXIT_SUCCESS;
+    }
+    while (true)
+    {
+        print_prompt();
+        if (!read_input(input_buffer))
         {
-        case (EXECUTE_SUCCESS):
-            printf("Executed.\n");
-            break;
-        case (EXECUTE_DUPLICATE_KEY):
-            printf("ERROR: Duplicate key.\n");
-            break;
-        case (EXECUTE_TABLE_FULL):
-            printf("ERROR: table full .\n");
-            break;
+            // 输入结束 (比如管道里的脚本读完了) 和 .exit 一样正常关闭
+            printf("\n");
+            db_close(table);
+            close_input_buffer(input_buffer);
+            return EXIT_SUCCESS;
         }
+        run_line(table, input_buffer, false);
     }
 }
+#endif